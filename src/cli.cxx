@@ -1,6 +1,7 @@
 #include <argparse/argparse.hpp>
 
 #include "s5router/common/net.hpp"
+#include "s5router/dns.hpp"
 #include "s5router/s5router.hpp"
 #include "s5router/utils.hpp"
 
@@ -8,6 +9,9 @@
     #include <ws2tcpip.h>
 #endif
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <signal.h>
 
@@ -20,8 +24,29 @@ struct Params {
     uint16_t server_port;
     in_addr server_ip;
     in_addr route_ip;
+    s5r::S5Settings settings;
 };
 
+// "first-last" or a single port, empty for any port
+bool parse_port_range(const std::string& range_str, s5r::PortRange* range)
+{
+    *range = s5r::PortRange();
+
+    if (range_str.empty())
+        return true;
+
+    size_t dash = range_str.find('-');
+    int first = std::atoi(range_str.c_str());
+    int last = dash == std::string::npos ? first : std::atoi(range_str.c_str() + dash + 1);
+
+    if (first <= 0 || last < first || last > 65535)
+        return false;
+
+    range->first = (uint16_t)first;
+    range->last = (uint16_t)last;
+    return true;
+}
+
 Params parse_args(int argc, char** argv)
 {
     argparse::ArgumentParser parser(argv[0], __S5R_VERSION__);
@@ -42,6 +67,233 @@ Params parse_args(int argc, char** argv)
         .default_value("0.0.0.0")
         .nargs(1);
 
+    parser.add_argument("--mode")
+        .help("Run mode: \"reactor\" (epoll workers, Linux only) or \"threaded\" (thread per connection)")
+#ifdef __linux__
+        .default_value("reactor")
+#else
+        .default_value("threaded")
+#endif
+        .nargs(1);
+
+    parser.add_argument("--workers")
+        .help("Number of reactor worker threads.\n0 will use one worker per core")
+        .default_value(0)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--shards")
+        .help("Number of SO_REUSEPORT listeners per address in reactor mode,\neach accepting on its own worker.\n0 will give every worker its own listener")
+        .default_value(0)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--relay")
+        .help("TCP relay method: \"copy\" (recv/send) or \"splice\"\n(zero-copy through pipes, Linux only)")
+        .default_value("copy")
+        .nargs(1);
+
+    parser.add_argument("--connect-delay")
+        .help("Milliseconds before racing the next address of a CONNECT\ndestination while earlier attempts are pending")
+        .default_value(250)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--connect-timeout")
+        .help("Milliseconds after which a single connect attempt is abandoned")
+        .default_value(10000)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--udp-batch")
+        .help("Datagrams a UDP relay reads and forwards per system call (Linux only), 1 disables batching")
+        .default_value(16)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--udp-workers")
+        .help("Threads serving UDP associations in threaded mode (Linux only).\n0 gives every association its own thread")
+        .default_value(2)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--udp-idle-timeout")
+        .help("Milliseconds without datagrams after which a UDP association is closed,\n0 keeps it open as long as its control connection")
+        .default_value(120000)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--udp-reassembly-max")
+        .help("Bytes a fragmented UDP datagram may add up to, 0 drops fragments")
+        .default_value(65507)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--udp-reassembly-timeout")
+        .help("Milliseconds the fragments of a UDP datagram have to arrive within")
+        .default_value(5000)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--udp-socket-pool")
+        .help("Bound UDP sockets kept for new associations per address, 0 disables the pool")
+        .default_value(32)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--upstream-pool")
+        .help("Connected route sockets kept for each hot destination, 0 disables the pool")
+        .default_value(0)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--upstream-pool-destinations")
+        .help("Most requested destinations (address and port) the upstream pool keeps warm")
+        .default_value(8)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--upstream-pool-idle")
+        .help("Milliseconds a pooled route socket may wait for a CONNECT before it's closed")
+        .default_value(30000)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--udp-client-ports")
+        .help("Port range (\"first-last\") of the UDP sockets clients send datagrams to,\nany port if not set")
+        .default_value("")
+        .nargs(1);
+
+    parser.add_argument("--udp-route-ports")
+        .help("Port range (\"first-last\") of the UDP sockets talking to remote hosts,\nany port if not set")
+        .default_value("")
+        .nargs(1);
+
+    parser.add_argument("--buffer-min")
+        .help("Smallest relay buffer a TCP tunnel shrinks to (bytes per direction)")
+        .default_value(4096)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--buffer-max")
+        .help("Largest relay buffer a TCP tunnel grows to (bytes per direction).\nSame as --buffer-min keeps the size fixed")
+        .default_value(1048576)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--memory-budget")
+        .help("MiB of memory for sessions, relay buffers, DNS cache and queued datagrams.\nCaches shrink close to it and requests are refused past it, 0 means no limit")
+        .default_value(0)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--session-slab-size")
+        .help("Sessions preallocated together in one slab")
+        .default_value(256)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--session-slabs")
+        .help("Session slabs allocated at startup")
+        .default_value(1)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--session-slabs-max")
+        .help("Clients are refused once this many session slabs are full.\n0 lets the pool grow without a limit")
+        .default_value(0)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--dns")
+        .help("Upstream nameserver as ip[:port], can be repeated.\nDefaults to the nameservers of /etc/resolv.conf")
+        .default_value(std::vector<std::string>{})
+        .append()
+        .nargs(1);
+
+    parser.add_argument("--rules")
+        .help("Policy rules file, one rule per line: matchers (dst CIDR, domain SUFFIX,\nport N[-M], src CIDR) and an action (route INTERFACE, reject or direct).\nUDP datagrams are only dropped by reject rules")
+        .default_value("")
+        .nargs(1);
+
+    parser.add_argument("--dns-timeout")
+        .help("Milliseconds to wait for a single DNS response")
+        .default_value(2000)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--dns-retries")
+        .help("Times a DNS query is sent again (to the next nameserver) after a timeout")
+        .default_value(2)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--dns-cache-size")
+        .help("Answers kept by the DNS cache, 0 disables it")
+        .default_value(10000)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--dns-min-ttl")
+        .help("Seconds a DNS answer is cached at least")
+        .default_value(5)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--dns-max-ttl")
+        .help("Seconds a DNS answer is cached at most")
+        .default_value(3600)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--dns-negative-ttl")
+        .help("Seconds NXDOMAIN (no records) answers are cached at most")
+        .default_value(30)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--dns-failure-ttl")
+        .help("Seconds SERVFAIL and timed out lookups are cached")
+        .default_value(5)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--dns-prefetch-hits")
+        .help("Hits within its TTL that get a DNS answer refreshed before it expires, 0 disables it")
+        .default_value(8)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--dns-prefetch-rate")
+        .help("Background DNS refreshes started per second at most")
+        .default_value(50)
+        .scan<'i', int>()
+        .nargs(1);
+
+    parser.add_argument("--io-uring")
+        .help("Use io_uring for accepting and for threaded mode relaying\nif the kernel supports it (one operation in flight per direction,\nreactor mode doesn't use it)")
+        .default_value(false)
+        .implicit_value(true)
+        .nargs(0);
+
+    parser.add_argument("--optimistic-connect")
+        .help("Reply to CONNECT before the route is connected, saving clients a round trip.\nRoute failures then reset the client connection")
+        .default_value(false)
+        .implicit_value(true)
+        .nargs(0);
+
+    parser.add_argument("--tcp-fastopen")
+        .help("Use TCP Fast Open on listening sockets and route connects\n(needs net.ipv4.tcp_fastopen enabled)")
+        .default_value(false)
+        .implicit_value(true)
+        .nargs(0);
+
+    parser.add_argument("--no-udp-offload")
+        .help("Don't use UDP GRO/GSO for UDP associations even if the kernel supports it")
+        .default_value(false)
+        .implicit_value(true)
+        .nargs(0);
+
     try {
         parser.parse_args(argc, argv);
     } catch (const std::exception& err) {
@@ -58,10 +310,122 @@ Params parse_args(int argc, char** argv)
     in_addr route_addr;
     inet_pton(AF_INET, route_str.c_str(), &route_addr);
 
+    s5r::S5Settings settings;
+
+    std::string mode_str = parser.get<std::string>("--mode");
+    if (mode_str == "threaded")
+    {
+        settings.run_mode = s5r::RunMode::Threaded;
+    }
+    else if (mode_str == "reactor")
+    {
+#ifndef __linux__
+        std::cerr << "Reactor mode is only supported on Linux" << std::endl;
+        exit(1);
+#endif
+        settings.run_mode = s5r::RunMode::Reactor;
+    }
+    else
+    {
+        std::cerr << "Unknown run mode: " << mode_str << std::endl;
+        std::cerr << parser;
+        exit(1);
+    }
+
+    settings.workers = (unsigned int)std::max(0, parser.get<int>("--workers"));
+    settings.shards = (unsigned int)std::max(0, parser.get<int>("--shards"));
+    settings.io_uring = parser.get<bool>("--io-uring");
+    settings.udp_offload = !parser.get<bool>("--no-udp-offload");
+    settings.optimistic_connect = parser.get<bool>("--optimistic-connect");
+    settings.tcp_fastopen = parser.get<bool>("--tcp-fastopen");
+    settings.connect_delay_ms = (uint32_t)std::max(0, parser.get<int>("--connect-delay"));
+    settings.connect_timeout_ms = (uint32_t)std::max(1, parser.get<int>("--connect-timeout"));
+    settings.udp_batch = (unsigned int)std::min(std::max(1, parser.get<int>("--udp-batch")), (int)s5r::S5_UDP_BATCH_MAX);
+    settings.udp_workers = (unsigned int)std::max(0, parser.get<int>("--udp-workers"));
+    settings.udp_idle_timeout_ms = (uint32_t)std::max(0, parser.get<int>("--udp-idle-timeout"));
+    settings.udp_reassembly_max = (size_t)std::max(0, parser.get<int>("--udp-reassembly-max"));
+    settings.udp_reassembly_timeout_ms = (uint32_t)std::max(0, parser.get<int>("--udp-reassembly-timeout"));
+    settings.udp_socket_pool = (unsigned int)std::max(0, parser.get<int>("--udp-socket-pool"));
+    settings.upstream_pool = (unsigned int)std::max(0, parser.get<int>("--upstream-pool"));
+    settings.upstream_pool_destinations = (unsigned int)std::max(0, parser.get<int>("--upstream-pool-destinations"));
+    settings.upstream_pool_idle_ms = (uint32_t)std::max(1, parser.get<int>("--upstream-pool-idle"));
+
+
+    if (!parse_port_range(parser.get<std::string>("--udp-client-ports"), &settings.udp_client_ports)
+        || !parse_port_range(parser.get<std::string>("--udp-route-ports"), &settings.udp_route_ports))
+    {
+        std::cerr << "Invalid UDP port range" << std::endl;
+        std::cerr << parser;
+        exit(1);
+    }
+    settings.relay_buffer_min = (size_t)std::max(1, parser.get<int>("--buffer-min"));
+    settings.relay_buffer_max = (size_t)std::max(1, parser.get<int>("--buffer-max"));
+    settings.memory_budget = (size_t)std::max(0, parser.get<int>("--memory-budget")) * 1024 * 1024;
+    settings.session_slab_size = (unsigned int)std::max(1, parser.get<int>("--session-slab-size"));
+    settings.session_slabs = (unsigned int)std::max(0, parser.get<int>("--session-slabs"));
+    settings.session_slabs_max = (unsigned int)std::max(0, parser.get<int>("--session-slabs-max"));
+
+    for (auto& server_str : parser.get<std::vector<std::string>>("--dns"))
+    {
+        sockaddr_in server;
+        memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_port = htons(s5r::DNS_PORT);
+
+        std::string ip_str = server_str;
+        size_t colon = server_str.find(':');
+
+        if (colon != std::string::npos)
+        {
+            ip_str = server_str.substr(0, colon);
+            server.sin_port = htons((uint16_t)std::atoi(server_str.c_str() + colon + 1));
+        }
+
+        if (inet_pton(AF_INET, ip_str.c_str(), &server.sin_addr) != 1)
+        {
+            std::cerr << "Invalid nameserver: " << server_str << std::endl;
+            exit(1);
+        }
+
+        settings.dns.servers.push_back(server);
+    }
+
+    settings.dns.timeout_ms = (uint32_t)std::max(1, parser.get<int>("--dns-timeout"));
+    settings.dns.retries = (unsigned int)std::max(0, parser.get<int>("--dns-retries"));
+    settings.dns.cache_size = (size_t)std::max(0, parser.get<int>("--dns-cache-size"));
+    settings.dns.cache_min_ttl = (uint32_t)std::max(0, parser.get<int>("--dns-min-ttl"));
+    settings.dns.cache_max_ttl = (uint32_t)std::max(0, parser.get<int>("--dns-max-ttl"));
+    settings.dns.cache_negative_ttl = (uint32_t)std::max(0, parser.get<int>("--dns-negative-ttl"));
+    settings.dns.cache_failure_ttl = (uint32_t)std::max(0, parser.get<int>("--dns-failure-ttl"));
+    settings.dns.prefetch_hits = (uint32_t)std::max(0, parser.get<int>("--dns-prefetch-hits"));
+    settings.dns.prefetch_rate = (uint32_t)std::max(0, parser.get<int>("--dns-prefetch-rate"));
+    settings.rules_file = parser.get<std::string>("--rules");
+
+    std::string relay_str = parser.get<std::string>("--relay");
+    if (relay_str == "copy")
+    {
+        settings.tcp_relay = s5r::RelayMode::Copy;
+    }
+    else if (relay_str == "splice")
+    {
+#ifndef __linux__
+        std::cerr << "Splice relay is only supported on Linux" << std::endl;
+        exit(1);
+#endif
+        settings.tcp_relay = s5r::RelayMode::Splice;
+    }
+    else
+    {
+        std::cerr << "Unknown relay method: " << relay_str << std::endl;
+        std::cerr << parser;
+        exit(1);
+    }
+
     Params params{
         (uint16_t)parser.get<int>("--port"),
         listen_addr,
-        route_addr
+        route_addr,
+        settings
     };
 
     return params;
@@ -89,6 +453,11 @@ void print_info(const Params& params)
         << "Routing traffic to -> "
         << inet_ntoa(params.route_ip)
         << std::endl;
+
+    std::cout
+        << "Run mode: "
+        << (params.settings.run_mode == s5r::RunMode::Reactor ? "reactor" : "threaded")
+        << std::endl;
 }
 
 int main(int argc, char** argv) {
@@ -97,7 +466,8 @@ int main(int argc, char** argv) {
     router = new s5r::S5Router(
         params.server_port,
         params.server_ip,
-        params.route_ip
+        params.route_ip,
+        params.settings
     );
 
     print_info(params);
@@ -111,5 +481,100 @@ int main(int argc, char** argv) {
 
     router->run();
 
+    s5r::SessionPoolStats session_stats = router->session_stats();
+
+    std::cout
+        << "Sessions: "
+        << session_stats.peak << " peak, "
+        << session_stats.capacity << " slots in "
+        << session_stats.slabs << " slabs"
+        << std::endl;
+
+    s5r::UdpAssociationStats udp_stats = router->udp_association_stats();
+
+    std::cout
+        << "UDP associations: "
+        << udp_stats.opened << " opened, "
+        << udp_stats.expired << " expired, "
+        << udp_stats.peak << " peak"
+        << std::endl;
+
+    s5r::UdpFragmentStats fragment_stats = router->udp_fragment_stats();
+
+    std::cout
+        << "UDP fragments: "
+        << fragment_stats.reassembled << " datagrams reassembled, "
+        << fragment_stats.dropped << " dropped, "
+        << fragment_stats.expired << " expired"
+        << std::endl;
+
+    s5r::UdpSocketPoolStats socket_stats = router->udp_socket_stats();
+
+    std::cout
+        << "UDP sockets: "
+        << socket_stats.reused << " reused, "
+        << socket_stats.created << " created, "
+        << socket_stats.failed << " failed to bind"
+        << std::endl;
+
+    s5r::PolicyStats policy_stats = router->policy_stats();
+
+    std::cout
+        << "Policy: "
+        << policy_stats.routed << " routed, "
+        << policy_stats.rejected << " rejected, "
+        << policy_stats.direct << " direct, "
+        << policy_stats.unmatched << " unmatched"
+        << std::endl;
+
+    s5r::UpstreamPoolStats upstream_stats = router->upstream_stats();
+
+    std::cout
+        << "Upstream pool: "
+        << upstream_stats.hits << " hits, "
+        << upstream_stats.misses << " misses, "
+        << upstream_stats.connected << " connected ahead, "
+        << upstream_stats.expired << " expired"
+        << std::endl;
+
+    s5r::MemoryStats memory_stats = router->memory_stats();
+
+    std::cout
+        << "Memory: "
+        << memory_stats.used[(size_t)s5r::MemoryUse::Sessions] / 1024 << " KiB sessions, "
+        << memory_stats.used[(size_t)s5r::MemoryUse::Buffers] / 1024 << " KiB buffers, "
+        << memory_stats.used[(size_t)s5r::MemoryUse::DnsCache] / 1024 << " KiB DNS cache, "
+        << memory_stats.used[(size_t)s5r::MemoryUse::Udp] / 1024 << " KiB UDP, "
+        << memory_stats.refused << " requests refused"
+        << std::endl;
+
+    s5r::BufferPoolStats buffer_stats = router->buffer_stats();
+
+    std::cout
+        << "Relay buffers: "
+        << buffer_stats.allocated / 1024 << " KiB allocated, "
+        << buffer_stats.in_use / 1024 << " KiB in use"
+        << std::endl;
+
+    s5r::DnsCacheStats dns_stats = router->dns_cache_stats();
+
+    std::cout
+        << "DNS cache: "
+        << dns_stats.hits << " hits ("
+        << dns_stats.negative_hits << " negative), "
+        << dns_stats.misses << " misses, "
+        << dns_stats.evictions << " evictions, "
+        << dns_stats.prefetches << " prefetches, "
+        << dns_stats.size << " entries"
+        << std::endl;
+
+    s5r::DnsFlightStats flight_stats = router->dns_flight_stats();
+
+    std::cout
+        << "DNS lookups: "
+        << flight_stats.flights << " sent, "
+        << flight_stats.coalesced << " coalesced"
+        << std::endl;
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include "buffer_pool.hpp"
+#include "memory_budget.hpp"
+
+#include <algorithm>
+#include <new>
+
+namespace s5r
+{
+    // idle bytes cached per class by each thread and by the depot
+    static constexpr size_t THREAD_CACHE_BYTES = 256 * 1024;
+    static constexpr size_t DEPOT_BYTES = 4 * 1024 * 1024;
+
+    // large classes still keep a full UDP batch per thread
+    static constexpr size_t THREAD_CACHE_MIN_BUFFERS = 16;
+
+    static size_t _cache_limit(size_t index)
+    {
+        return std::max(THREAD_CACHE_MIN_BUFFERS, THREAD_CACHE_BYTES / BUFFER_CLASSES[index]);
+    }
+
+    BufferPool& BufferPool::shared()
+    {
+        static BufferPool pool;
+        return pool;
+    }
+
+    BufferPool::ThreadCache::~ThreadCache()
+    {
+        for (size_t i = 0; i < BUFFER_CLASS_COUNT; i++)
+        {
+            BufferPool::shared()._flush(&buffers[i], i, 0);
+        }
+    }
+
+    BufferPool::ThreadCache& BufferPool::_local()
+    {
+        thread_local ThreadCache cache;
+        return cache;
+    }
+
+    size_t BufferPool::_class_of(size_t size)
+    {
+        for (size_t i = 0; i < BUFFER_CLASS_COUNT; i++)
+        {
+            if (size <= BUFFER_CLASSES[i])
+                return i;
+        }
+
+        return BUFFER_CLASS_COUNT;
+    }
+
+    char* BufferPool::acquire(size_t size, size_t* capacity)
+    {
+        size_t index = _class_of(size);
+        *capacity = index < BUFFER_CLASS_COUNT ? BUFFER_CLASSES[index] : size;
+
+        char* data = nullptr;
+
+        if (index < BUFFER_CLASS_COUNT)
+        {
+            std::vector<char*>& cache = _local().buffers[index];
+
+            if (!cache.empty() || _refill(&cache, index))
+            {
+                data = cache.back();
+                cache.pop_back();
+            }
+        }
+
+        if (!data)
+        {
+            data = new (std::nothrow) char[*capacity];
+
+            if (!data)
+                return nullptr;
+
+            _allocated += *capacity;
+            MemoryBudget::shared().charge(MemoryUse::Buffers, *capacity);
+        }
+
+        _in_use += *capacity;
+        return data;
+    }
+
+    void BufferPool::release(char* data, size_t size)
+    {
+        if (!data)
+            return;
+
+        size_t index = _class_of(size);
+
+        if (index == BUFFER_CLASS_COUNT)
+        {
+            _in_use -= size;
+            _free(data, size);
+            return;
+        }
+
+        _in_use -= BUFFER_CLASSES[index];
+
+        std::vector<char*>& cache = _local().buffers[index];
+        cache.push_back(data);
+
+        // no idle buffers are kept while memory is short
+        size_t limit = MemoryBudget::shared().pressure() == MemoryPressure::None
+            ? _cache_limit(index)
+            : 0;
+
+        if (cache.size() > limit)
+            _flush(&cache, index, limit / 2);
+    }
+
+    void BufferPool::trim()
+    {
+        std::lock_guard<std::mutex> lock(_depot_mutex);
+
+        for (size_t i = 0; i < BUFFER_CLASS_COUNT; i++)
+        {
+            for (char* data : _depot[i])
+            {
+                _free(data, BUFFER_CLASSES[i]);
+            }
+
+            _depot[i].clear();
+        }
+    }
+
+    BufferPoolStats BufferPool::stats() const
+    {
+        BufferPoolStats stats;
+        stats.allocated = _allocated;
+        stats.in_use = _in_use;
+        return stats;
+    }
+
+    bool BufferPool::_refill(std::vector<char*>* cache, size_t index)
+    {
+        std::lock_guard<std::mutex> lock(_depot_mutex);
+
+        std::vector<char*>& depot = _depot[index];
+
+        if (depot.empty())
+            return false;
+
+        // half a thread cache at once, not one lock per buffer
+        size_t count = _cache_limit(index) / 2;
+
+        while (count-- > 0 && !depot.empty())
+        {
+            cache->push_back(depot.back());
+            depot.pop_back();
+        }
+
+        return true;
+    }
+
+    void BufferPool::_flush(std::vector<char*>* cache, size_t index, size_t keep)
+    {
+        size_t depot_limit = MemoryBudget::shared().pressure() == MemoryPressure::None
+            ? DEPOT_BYTES / BUFFER_CLASSES[index]
+            : 0;
+
+        std::lock_guard<std::mutex> lock(_depot_mutex);
+
+        std::vector<char*>& depot = _depot[index];
+
+        while (cache->size() > keep)
+        {
+            char* data = cache->back();
+            cache->pop_back();
+
+            if (depot.size() < depot_limit)
+            {
+                depot.push_back(data);
+                continue;
+            }
+
+            _free(data, BUFFER_CLASSES[index]);
+        }
+    }
+
+    void BufferPool::_free(char* data, size_t capacity)
+    {
+        delete[] data;
+
+        _allocated -= capacity;
+        MemoryBudget::shared().release(MemoryUse::Buffers, capacity);
+    }
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace s5r
+{
+    // relay buffer size classes, powers of two
+    static constexpr size_t BUFFER_CLASSES[] = {4096, 16384, 65536};
+    static constexpr size_t BUFFER_CLASS_COUNT = sizeof(BUFFER_CLASSES) / sizeof(BUFFER_CLASSES[0]);
+
+    struct BufferPoolStats
+    {
+        // bytes of every buffer currently allocated
+        size_t allocated = 0;
+
+        // bytes lent out to relays
+        size_t in_use = 0;
+    };
+
+    /**
+     * Process-wide pool of relay buffers.
+     * Every thread keeps a small cache per size class and only
+     * falls back to the shared depot (and then to the heap)
+     * when it runs dry, so borrowing per read is cheap
+     **/
+    class BufferPool
+    {
+    public:
+        static BufferPool& shared();
+
+        // buffer of the smallest class holding `size` bytes,
+        // *capacity is set to its actual size. Sizes above
+        // the largest class are allocated as is
+        char* acquire(size_t size, size_t* capacity);
+
+        // `size` is the one passed to acquire()
+        void release(char* data, size_t size);
+
+        // frees buffers idle in the depot (under memory pressure),
+        // thread caches stop keeping buffers while it lasts
+        void trim();
+
+        BufferPoolStats stats() const;
+
+    private:
+        struct ThreadCache
+        {
+            std::vector<char*> buffers[BUFFER_CLASS_COUNT];
+
+            // hands everything over to the depot on thread exit
+            ~ThreadCache();
+        };
+
+        // buffers not cached by any thread
+        std::mutex _depot_mutex;
+        std::vector<char*> _depot[BUFFER_CLASS_COUNT];
+
+        std::atomic<size_t> _allocated{0};
+        std::atomic<size_t> _in_use{0};
+
+    private:
+        static ThreadCache& _local();
+
+        // class index of `size`, BUFFER_CLASS_COUNT if none fits
+        static size_t _class_of(size_t size);
+
+        // moves buffers from the depot to `cache`, false if it's empty too
+        bool _refill(std::vector<char*>* cache, size_t index);
+
+        // moves half of `cache` to the depot, frees what doesn't fit there
+        void _flush(std::vector<char*>* cache, size_t index, size_t keep);
+
+        void _free(char* data, size_t capacity);
+    };
+
+    /**
+     * BufferPool buffer held for the lifetime of the object
+     **/
+    class PooledBuffer
+    {
+    public:
+        PooledBuffer() = default;
+
+        explicit PooledBuffer(size_t size)
+        {
+            acquire(size);
+        }
+
+        ~PooledBuffer()
+        {
+            release();
+        }
+
+        PooledBuffer(const PooledBuffer&) = delete;
+        PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+        // returns false if no memory could be borrowed
+        bool acquire(size_t size)
+        {
+            release();
+
+            size_t capacity;
+            _data = BufferPool::shared().acquire(size, &capacity);
+            _size = _data ? size : 0;
+
+            return _data != nullptr;
+        }
+
+        void release()
+        {
+            BufferPool::shared().release(_data, _size);
+            _data = nullptr;
+            _size = 0;
+        }
+
+        char* data() const
+        {
+            return _data;
+        }
+
+    private:
+        char* _data = nullptr;
+        size_t _size = 0;
+    };
+}
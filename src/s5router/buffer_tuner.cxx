@@ -0,0 +1,89 @@
+#include "buffer_tuner.hpp"
+#include "memory_budget.hpp"
+
+#include <algorithm>
+
+namespace s5r
+{
+    // throughput is judged over this long
+    static constexpr auto TUNE_WINDOW = std::chrono::milliseconds(250);
+
+    // grow once a window moves this many buffers worth of data
+    static constexpr uint64_t GROW_FILLS = 4;
+
+    static size_t _round_up_pow2(size_t value)
+    {
+        size_t result = 1;
+
+        while (result < value)
+        {
+            result <<= 1;
+        }
+
+        return result;
+    }
+
+    void BufferTuner::configure(size_t min_size, size_t max_size, size_t initial)
+    {
+        _min = _round_up_pow2(std::max<size_t>(1, min_size));
+        _max = std::max(_min, _round_up_pow2(max_size));
+        _size = std::min(std::max(_round_up_pow2(initial), _min), _max);
+
+        _window_start = Clock::now();
+        _window_bytes = 0;
+        _saturated = false;
+    }
+
+    bool BufferTuner::is_adaptive() const
+    {
+        return _min != _max;
+    }
+
+    size_t BufferTuner::on_read(int size, size_t room)
+    {
+        size_t current = _size;
+
+        if (size <= 0 || !is_adaptive())
+            return current;
+
+        // give memory back right away when it is short
+        if (MemoryBudget::shared().pressure() != MemoryPressure::None)
+        {
+            _size = _min;
+            return _min;
+        }
+
+        _window_bytes += size;
+
+        if ((size_t)size >= room)
+            _saturated = true;
+
+        auto now = Clock::now();
+
+        if (now - _window_start < TUNE_WINDOW)
+            return current;
+
+        size_t target = current;
+
+        if (_saturated && _window_bytes >= current * GROW_FILLS)
+        {
+            target = std::min(current * 2, _max);
+        }
+        else if (!_saturated && _window_bytes < current / 2)
+        {
+            target = std::max(current / 2, _min);
+        }
+
+        _window_start = now;
+        _window_bytes = 0;
+        _saturated = false;
+
+        _size = target;
+        return target;
+    }
+
+    size_t BufferTuner::size() const
+    {
+        return _size;
+    }
+}
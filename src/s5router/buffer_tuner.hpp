@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace s5r
+{
+    /**
+     * Picks the buffer size of one relay direction from its
+     * throughput. Grows while reads keep filling the buffer,
+     * shrinks while the flow moves less than the buffer holds
+     * or memory is short
+     **/
+    class BufferTuner
+    {
+    public:
+        // bounds are rounded up to powers of two,
+        // min == max turns tuning off
+        void configure(size_t min_size, size_t max_size, size_t initial);
+
+        bool is_adaptive() const;
+
+        // accounts a read of `size` bytes into `room` free bytes,
+        // returns the size the buffer should have from now on
+        size_t on_read(int size, size_t room);
+
+        // current target size, safe to read from any thread
+        size_t size() const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        std::atomic<size_t> _size{0};
+        size_t _min = 0;
+        size_t _max = 0;
+
+        // current measurement window
+        Clock::time_point _window_start;
+        uint64_t _window_bytes = 0;
+
+        // some read filled all the room it had
+        bool _saturated = false;
+    };
+}
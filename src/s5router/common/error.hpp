@@ -30,4 +30,15 @@ namespace s5r
     {
         return sock_errno;
     }
+
+    // last non-blocking socket call had nothing to do
+    static inline bool socket_would_block()
+    {
+        int error = get_last_socket_error();
+#ifdef _WIN32
+        return error == WSAEWOULDBLOCK;
+#else
+        return error == EAGAIN || error == EWOULDBLOCK;
+#endif
+    }
 }
\ No newline at end of file
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+
+namespace s5r
+{
+    class EventHandler;
+
+    /**
+     * A file descriptor watched by an event loop.
+     * Owned by the handler, must outlive its registration
+     **/
+    struct EventSource
+    {
+        int fd = -1;
+        EventHandler* handler = nullptr;
+
+        // currently registered mask
+        uint32_t events = 0;
+    };
+
+    class EventHandler
+    {
+    public:
+        virtual ~EventHandler() = default;
+
+        // `events` is a mask of EPOLL* flags
+        virtual void on_event(EventSource* source, uint32_t events) = 0;
+    };
+}
@@ -3,10 +3,19 @@
 #ifdef _WIN32
     #include <winsock2.h>
     #include <iphlpapi.h>
+
+    // no SIGPIPE on Windows
+    #define MSG_NOSIGNAL 0
 #endif
 
-// Linux is not supported yet, but is planned
 #ifdef __linux__
     #include <sys/socket.h>
     #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <netdb.h>
+    #include <unistd.h>
+
+    // Winsock names used across the codebase
+    #define SD_SEND SHUT_WR
+    #define SD_BOTH SHUT_RDWR
 #endif
\ No newline at end of file
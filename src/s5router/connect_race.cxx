@@ -0,0 +1,320 @@
+#include "connect_race.hpp"
+#include "upstream_pool.hpp"
+#include "utils.hpp"
+#include "common/error.hpp"
+
+#include <algorithm>
+
+namespace s5r
+{
+    using Clock = std::chrono::steady_clock;
+
+    ConnectRace::ConnectRace()
+        : _next{0},
+          _in_flight{0},
+          _winner{-1},
+          _winner_sent{0},
+          _fast_open_data{nullptr},
+          _fast_open_size{0},
+          _handler{nullptr},
+          _delay{0},
+          _timeout{0}
+    {
+        _bind_ip.s_addr = INADDR_ANY;
+    }
+
+    ConnectRace::~ConnectRace()
+    {
+        _close_all();
+
+        if (_winner != -1)
+        {
+            ::close(_winner);
+        }
+    }
+
+    void ConnectRace::set_fast_open(const char* data, int size)
+    {
+        _fast_open_data = data;
+        _fast_open_size = size;
+    }
+
+    void ConnectRace::start(
+        in_addr bind_ip,
+        const std::vector<Destination>& destinations,
+        uint32_t delay_ms,
+        uint32_t timeout_ms,
+        EventHandler* handler
+    ) {
+        _bind_ip = bind_ip;
+        _destinations = destinations;
+        _handler = handler;
+        _delay = std::chrono::milliseconds(delay_ms);
+        _timeout = std::chrono::milliseconds(timeout_ms);
+
+        // attempts must never move, EventSource pointers are handed out
+        _attempts.reserve(_destinations.size());
+
+        // a warm socket to the preferred destination wins right away
+        if (!_destinations.empty())
+        {
+            int sock = UpstreamPool::shared().acquire(_bind_ip, _destinations.front());
+
+            if (sock != -1)
+            {
+                _winner = sock;
+                _winner_sent = 0;
+                _next = _destinations.size();
+                return;
+            }
+        }
+
+        _start_next();
+    }
+
+    void ConnectRace::on_writable(EventSource* source)
+    {
+        if (source->fd == -1 || _winner != -1)
+            return;
+
+        ConnectAttempt* attempt = nullptr;
+
+        for (auto& candidate : _attempts)
+        {
+            if (&candidate.source == source)
+            {
+                attempt = &candidate;
+                break;
+            }
+        }
+
+        if (!attempt)
+            return;
+
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+
+        if (getsockopt(source->fd, SOL_SOCKET, SO_ERROR, (char*)&error, &error_len) == -1)
+        {
+            error = get_last_socket_error();
+        }
+
+        if (!error)
+        {
+            // source keeps the fd until take_winner(),
+            // EventLoop owners still have it registered
+            _winner = source->fd;
+            _winner_sent = attempt->fast_open_sent;
+            _in_flight--;
+            return;
+        }
+
+        _finish(attempt);
+
+        // don't wait for the delay when nothing else is in flight
+        if (_in_flight == 0)
+        {
+            _start_next();
+        }
+    }
+
+    void ConnectRace::update()
+    {
+        if (_winner != -1)
+            return;
+
+        auto now = Clock::now();
+
+        for (auto& attempt : _attempts)
+        {
+            if (attempt.source.fd != -1 && now - attempt.started >= _timeout)
+            {
+                _finish(&attempt);
+            }
+        }
+
+        if (_in_flight == 0 || now - _last_start >= _delay)
+        {
+            _start_next();
+        }
+    }
+
+    int ConnectRace::timeout_ms() const
+    {
+        if (is_done())
+            return -1;
+
+        auto now = Clock::now();
+        auto next = Clock::time_point::max();
+
+        if (_next < _destinations.size())
+        {
+            next = _last_start + _delay;
+        }
+
+        for (auto& attempt : _attempts)
+        {
+            if (attempt.source.fd != -1)
+            {
+                next = std::min(next, attempt.started + _timeout);
+            }
+        }
+
+        if (next == Clock::time_point::max())
+            return -1;
+
+        if (next <= now)
+            return 0;
+
+        // round up, update() must find the deadline passed
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(next - now);
+        return (int)left.count() + 1;
+    }
+
+    bool ConnectRace::is_done() const
+    {
+        return _winner != -1 || (_in_flight == 0 && _next >= _destinations.size());
+    }
+
+    int ConnectRace::winner() const
+    {
+        return _winner;
+    }
+
+    int ConnectRace::take_winner()
+    {
+        _close_all();
+
+        int sock = _winner;
+        _winner = -1;
+
+        return sock;
+    }
+
+    int ConnectRace::fast_open_sent() const
+    {
+        return _winner_sent;
+    }
+
+    std::vector<ConnectAttempt>& ConnectRace::attempts()
+    {
+        return _attempts;
+    }
+
+    void ConnectRace::_start_next()
+    {
+        while (_winner == -1 && _next < _destinations.size())
+        {
+            Destination& destination = _destinations[_next++];
+
+            int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+            if (sock == -1)
+            {
+                continue;
+            }
+
+            sockaddr_in addr;
+            addr.sin_family = AF_INET;
+            addr.sin_port = 0;
+            addr.sin_addr = _bind_ip;
+
+            if (set_socket_nonblocking(sock) == -1
+                || ::bind(sock, (sockaddr*)&addr, sizeof(sockaddr_in)) == -1)
+            {
+                ::close(sock);
+                continue;
+            }
+
+            addr.sin_port = destination.port;
+            addr.sin_addr = destination.address;
+
+            _last_start = Clock::now();
+
+            int fast_open_sent = 0;
+
+            if (!_connect_fast_open(sock, addr, &fast_open_sent))
+            {
+                if (!::connect(sock, (sockaddr*)&addr, sizeof(sockaddr_in)))
+                {
+                    _winner = sock;
+                    _winner_sent = 0;
+                    return;
+                }
+
+                int error = get_last_socket_error();
+
+                if (error != EINPROGRESS && !socket_would_block())
+                {
+                    ::close(sock);
+                    continue;
+                }
+            }
+
+            _attempts.emplace_back();
+
+            ConnectAttempt& attempt = _attempts.back();
+            attempt.source.fd = sock;
+            attempt.source.handler = _handler;
+            attempt.started = _last_start;
+            attempt.fast_open_sent = fast_open_sent;
+
+            _in_flight++;
+            return;
+        }
+    }
+
+    bool ConnectRace::_connect_fast_open(int sock, const sockaddr_in& addr, int* sent)
+    {
+#ifdef __linux__
+        int size = _fast_open_size;
+
+        // first attempt only
+        _fast_open_size = 0;
+
+        if (size <= 0)
+            return false;
+
+        int result = (int)::sendto(sock, _fast_open_data, size, MSG_FASTOPEN | MSG_NOSIGNAL,
+            (const sockaddr*)&addr, sizeof(sockaddr_in));
+
+        if (result >= 0)
+        {
+            *sent = result;
+            return true;
+        }
+
+        // no cookie for the destination yet, the SYN asks
+        // for one and the payload goes after the handshake
+        if (get_last_socket_error() == EINPROGRESS)
+        {
+            *sent = 0;
+            return true;
+        }
+#endif
+
+        return false;
+    }
+
+    void ConnectRace::_finish(ConnectAttempt* attempt)
+    {
+        ::close(attempt->source.fd);
+        attempt->source.fd = -1;
+        _in_flight--;
+    }
+
+    void ConnectRace::_close_all()
+    {
+        for (auto& attempt : _attempts)
+        {
+            if (attempt.source.fd == _winner)
+            {
+                attempt.source.fd = -1;
+            }
+            else if (attempt.source.fd != -1)
+            {
+                _finish(&attempt);
+            }
+        }
+    }
+}
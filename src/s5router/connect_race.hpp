@@ -0,0 +1,118 @@
+#pragma once
+
+#include "common/event.hpp"
+#include "destination.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace s5r
+{
+    struct ConnectAttempt
+    {
+        // fd is -1 once the attempt failed, timed out, was
+        // cancelled or its socket was taken as the winner
+        EventSource source;
+        std::chrono::steady_clock::time_point started;
+
+        // fast open data sent along with the SYN
+        int fast_open_sent = 0;
+    };
+
+    /**
+     * Happy Eyeballs style (RFC 8305) connection racing.
+     * Destinations are tried in order with non-blocking connects,
+     * a new attempt starts every `delay_ms` (or right away when the
+     * previous one failed) while earlier ones keep going, first
+     * socket to connect wins and the others are closed.
+     *
+     * The race doesn't wait on anything itself, the owner polls
+     * attempt sockets for writability and calls on_writable(),
+     * and calls update() after timeout_ms().
+     *
+     * Fast open data goes out with the SYN of the first attempt
+     * (TCP Fast Open, Linux only), later attempts connect plainly
+     * so a losing destination doesn't get the payload as well
+     **/
+    class ConnectRace
+    {
+    public:
+        ConnectRace();
+
+        // closes every socket except a taken winner
+        ~ConnectRace();
+
+        ConnectRace(const ConnectRace&) = delete;
+        ConnectRace& operator=(const ConnectRace&) = delete;
+
+        // payload for the first attempt's SYN, call before start().
+        // `data` has to stay valid until start() returned
+        void set_fast_open(const char* data, int size);
+
+        // `handler` is set on attempt sources for EventLoop owners,
+        // first attempt starts right away unless the upstream pool
+        // has a connected socket to the first destination
+        void start(
+            in_addr bind_ip,
+            const std::vector<Destination>& destinations,
+            uint32_t delay_ms,
+            uint32_t timeout_ms,
+            EventHandler* handler = nullptr
+        );
+
+        // attempt socket became writable (connected or failed)
+        void on_writable(EventSource* source);
+
+        // expires timed out attempts and starts due ones
+        void update();
+
+        // ms until update() has something to do, -1 if nothing
+        int timeout_ms() const;
+
+        // won or every attempt failed
+        bool is_done() const;
+
+        // connected socket or -1
+        int winner() const;
+
+        // hands over the winner and closes all other attempts
+        int take_winner();
+
+        // bytes of the fast open data the winner already sent
+        int fast_open_sent() const;
+
+        // attempts started so far, entries never move
+        std::vector<ConnectAttempt>& attempts();
+
+    private:
+        in_addr _bind_ip;
+        std::vector<Destination> _destinations;
+        size_t _next;
+
+        std::vector<ConnectAttempt> _attempts;
+        int _in_flight;
+        int _winner;
+        int _winner_sent;
+
+        const char* _fast_open_data;
+        int _fast_open_size;
+
+        EventHandler* _handler;
+        std::chrono::milliseconds _delay;
+        std::chrono::milliseconds _timeout;
+        std::chrono::steady_clock::time_point _last_start;
+
+    private:
+        // starts attempts until one is in flight or none are left
+        void _start_next();
+
+        // connects `sock` by sending the fast open data, returns false
+        // if there's none left or the kernel refused and a plain
+        // connect() is needed
+        bool _connect_fast_open(int sock, const sockaddr_in& addr, int* sent);
+
+        void _finish(ConnectAttempt* attempt);
+        void _close_all();
+    };
+}
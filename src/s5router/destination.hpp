@@ -0,0 +1,16 @@
+#pragma once
+
+#include "common/net.hpp"
+
+#include <cstdint>
+
+namespace s5r
+{
+    struct Destination {
+        in_addr address;
+        uint16_t port;
+
+        Destination(in_addr address, uint16_t port)
+            : address{address}, port{port} {}
+    };
+}
@@ -0,0 +1,496 @@
+#include "dns.hpp"
+#include "utils.hpp"
+#include "common/error.hpp"
+#include "common/poll.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+namespace s5r
+{
+    static constexpr int DNS_HEADER_SIZE = 12;
+    static constexpr uint16_t DNS_CLASS_IN = 1;
+    static constexpr uint16_t DNS_TYPE_SOA = 6;
+
+    // compression pointers followed while reading one name
+    static constexpr int DNS_MAX_POINTERS = 16;
+
+    static uint16_t _read_u16(const char* data)
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+        return (uint16_t)((bytes[0] << 8) | bytes[1]);
+    }
+
+    static uint32_t _read_u32(const char* data)
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+        return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16)
+            | ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+    }
+
+    static void _write_u16(char* data, uint16_t value)
+    {
+        data[0] = (char)(value >> 8);
+        data[1] = (char)(value & 0xFF);
+    }
+
+    /**
+     * Reads a (possibly compressed) name starting at `offset`,
+     * returns offset right after it in the record or -1
+     **/
+    static int _read_name(const char buffer[], int buffer_size, int offset, std::string* name)
+    {
+        int end = -1;
+        int pointers = 0;
+
+        if (name)
+            name->clear();
+
+        while (true)
+        {
+            if (offset >= buffer_size)
+                return -1;
+
+            uint8_t len = (uint8_t)buffer[offset];
+
+            if ((len & 0xC0) == 0xC0)
+            {
+                if (offset + 1 >= buffer_size || ++pointers > DNS_MAX_POINTERS)
+                    return -1;
+
+                if (end == -1)
+                    end = offset + 2;
+
+                offset = ((len & 0x3F) << 8) | (uint8_t)buffer[offset + 1];
+                continue;
+            }
+
+            if (len & 0xC0)
+                return -1;
+
+            if (len == 0)
+                return end == -1 ? offset + 1 : end;
+
+            if (offset + 1 + len > buffer_size)
+                return -1;
+
+            if (name)
+            {
+                if (!name->empty())
+                    name->push_back('.');
+
+                name->append(buffer + offset + 1, len);
+            }
+
+            offset += 1 + len;
+        }
+    }
+
+    static bool _same_name(const std::string& a, const std::string& b)
+    {
+        // queries may be sent with a trailing dot
+        size_t a_size = (!a.empty() && a.back() == '.') ? a.size() - 1 : a.size();
+        size_t b_size = (!b.empty() && b.back() == '.') ? b.size() - 1 : b.size();
+
+        if (a_size != b_size)
+            return false;
+
+        for (size_t i = 0; i < a_size; i++)
+        {
+            if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+                return false;
+        }
+
+        return true;
+    }
+
+    uint16_t dns_query_id()
+    {
+        thread_local std::mt19937 generator{std::random_device{}()};
+        return (uint16_t)generator();
+    }
+
+    int dns_build_query(uint16_t id, const std::string& name, DnsType type, char buffer[], int buffer_size)
+    {
+        // header + encoded name (at most 255) + type + class
+        if (buffer_size < DNS_HEADER_SIZE + 255 + 4 || name.empty() || name.size() > 253 + 1)
+            return -1;
+
+        memset(buffer, 0, DNS_HEADER_SIZE);
+        _write_u16(buffer, id);
+
+        // standard query, recursion desired
+        buffer[2] = 0x01;
+        _write_u16(buffer + 4, 1);
+
+        int offset = DNS_HEADER_SIZE;
+        size_t start = 0;
+
+        while (start < name.size())
+        {
+            size_t dot = name.find('.', start);
+
+            if (dot == std::string::npos)
+                dot = name.size();
+
+            size_t len = dot - start;
+
+            if (len == 0 || len > 63)
+                return -1;
+
+            buffer[offset++] = (char)len;
+            memcpy(buffer + offset, name.data() + start, len);
+            offset += len;
+
+            start = dot + 1;
+        }
+
+        buffer[offset++] = 0;
+
+        if (offset - DNS_HEADER_SIZE > 255)
+            return -1;
+
+        _write_u16(buffer + offset, (uint16_t)type);
+        _write_u16(buffer + offset + 2, DNS_CLASS_IN);
+
+        return offset + 4;
+    }
+
+    bool dns_parse_response(
+        const char buffer[],
+        int buffer_size,
+        uint16_t id,
+        const std::string& name,
+        DnsType type,
+        DnsAnswer* answer
+    ) {
+        if (buffer_size < DNS_HEADER_SIZE || _read_u16(buffer) != id)
+            return false;
+
+        uint8_t flags = (uint8_t)buffer[2];
+        uint8_t rcode = (uint8_t)buffer[3] & 0x0F;
+
+        // must be a response to a standard query
+        if (!(flags & 0x80) || (flags & 0x78))
+            return false;
+
+        uint16_t qdcount = _read_u16(buffer + 4);
+        uint16_t ancount = _read_u16(buffer + 6);
+        uint16_t nscount = _read_u16(buffer + 8);
+
+        if (qdcount != 1)
+            return false;
+
+        std::string question;
+        int offset = _read_name(buffer, buffer_size, DNS_HEADER_SIZE, &question);
+
+        if (offset == -1 || offset + 4 > buffer_size
+            || !_same_name(question, name)
+            || _read_u16(buffer + offset) != (uint16_t)type
+            || _read_u16(buffer + offset + 2) != DNS_CLASS_IN)
+        {
+            return false;
+        }
+
+        offset += 4;
+
+        answer->addrs.clear();
+        answer->addrs6.clear();
+        answer->ttl = UINT32_MAX;
+
+        // truncated (TC): what fit in the datagram may not be every
+        // record and there's no TCP fallback, it counts as a failure
+        if ((rcode != 0 && rcode != 3) || (flags & 0x02))
+        {
+            answer->status = DnsStatus::ServerFailure;
+            answer->ttl = 0;
+            return true;
+        }
+
+        for (int i = 0; i < ancount + nscount; i++)
+        {
+            offset = _read_name(buffer, buffer_size, offset, nullptr);
+
+            // type, class, ttl, rdlength
+            if (offset == -1 || offset + 10 > buffer_size)
+                break;
+
+            uint16_t rr_type = _read_u16(buffer + offset);
+            uint16_t rr_class = _read_u16(buffer + offset + 2);
+            uint32_t rr_ttl = _read_u32(buffer + offset + 4);
+            uint16_t rdlength = _read_u16(buffer + offset + 8);
+            offset += 10;
+
+            if (offset + rdlength > buffer_size)
+                break;
+
+            const char* rdata = buffer + offset;
+            bool is_answer = i < ancount;
+
+            if (is_answer && rr_class == DNS_CLASS_IN && rr_type == (uint16_t)type)
+            {
+                if (type == DnsType::A && rdlength == 4)
+                {
+                    in_addr addr;
+                    memcpy(&addr, rdata, 4);
+                    answer->addrs.push_back(addr);
+                    answer->ttl = std::min(answer->ttl, rr_ttl);
+                }
+                else if (type == DnsType::AAAA && rdlength == 16)
+                {
+                    answer->addrs6.emplace_back(rdata, rdata + 16);
+                    answer->ttl = std::min(answer->ttl, rr_ttl);
+                }
+            }
+            else if (!is_answer && rr_type == DNS_TYPE_SOA)
+            {
+                // negative answers live for min(SOA ttl, SOA minimum)
+                int soa = _read_name(buffer, buffer_size, offset, nullptr);
+
+                if (soa != -1)
+                    soa = _read_name(buffer, buffer_size, soa, nullptr);
+
+                if (soa != -1 && soa + 20 <= offset + rdlength)
+                {
+                    uint32_t minimum = _read_u32(buffer + soa + 16);
+                    answer->ttl = std::min(answer->ttl, std::min(rr_ttl, minimum));
+                }
+            }
+
+            offset += rdlength;
+        }
+
+        bool found = !answer->addrs.empty() || !answer->addrs6.empty();
+        answer->status = found ? DnsStatus::Ok : DnsStatus::NotFound;
+
+        if (answer->ttl == UINT32_MAX)
+            answer->ttl = 0;
+
+        return true;
+    }
+
+    void dns_load_resolv_conf(const char* path, std::vector<sockaddr_in>* servers)
+    {
+        std::ifstream file(path);
+        std::string line;
+
+        while (std::getline(file, line))
+        {
+            std::istringstream words(line);
+            std::string keyword;
+            std::string address;
+
+            if (!(words >> keyword >> address) || keyword != "nameserver")
+                continue;
+
+            sockaddr_in server;
+            memset(&server, 0, sizeof(server));
+            server.sin_family = AF_INET;
+            server.sin_port = htons(DNS_PORT);
+
+            // IPv6 nameservers are skipped
+            if (inet_pton(AF_INET, address.c_str(), &server.sin_addr) == 1)
+                servers->push_back(server);
+        }
+    }
+
+    static std::string _lower_name(const std::string& name)
+    {
+        std::string lower = name;
+
+        if (!lower.empty() && lower.back() == '.')
+            lower.pop_back();
+
+        for (auto& c : lower)
+            c = (char)tolower((unsigned char)c);
+
+        return lower;
+    }
+
+    void dns_load_hosts(const char* path, std::unordered_map<std::string, std::vector<in_addr>>* hosts)
+    {
+        std::ifstream file(path);
+        std::string line;
+
+        while (std::getline(file, line))
+        {
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream words(line);
+            std::string address;
+            in_addr addr;
+
+            if (!(words >> address) || inet_pton(AF_INET, address.c_str(), &addr) != 1)
+                continue;
+
+            std::string name;
+
+            while (words >> name)
+            {
+                (*hosts)[_lower_name(name)].push_back(addr);
+            }
+        }
+    }
+
+    static bool _lookup_literal(const std::string& name, DnsType type, DnsAnswer* answer)
+    {
+        in_addr addr;
+        uint8_t addr6[16];
+
+        bool is_ipv4 = inet_pton(AF_INET, name.c_str(), &addr) == 1;
+
+        if (!is_ipv4 && inet_pton(AF_INET6, name.c_str(), addr6) != 1)
+            return false;
+
+        answer->addrs.clear();
+        answer->addrs6.clear();
+        answer->ttl = 0;
+
+        if (is_ipv4 && type == DnsType::A)
+            answer->addrs.push_back(addr);
+        else if (!is_ipv4 && type == DnsType::AAAA)
+            answer->addrs6.emplace_back(addr6, addr6 + 16);
+
+        bool found = !answer->addrs.empty() || !answer->addrs6.empty();
+        answer->status = found ? DnsStatus::Ok : DnsStatus::NotFound;
+        return true;
+    }
+
+    bool dns_lookup_hosts(const DnsSettings& settings, const std::string& name, DnsType type, DnsAnswer* answer)
+    {
+        // a DOMAINNAME request may carry an address, it's no name to query
+        if (_lookup_literal(name, type, answer))
+            return true;
+
+        if (settings.hosts.empty())
+            return false;
+
+        auto it = settings.hosts.find(_lower_name(name));
+
+        if (it == settings.hosts.end())
+            return false;
+
+        answer->addrs.clear();
+        answer->addrs6.clear();
+        answer->ttl = 0;
+
+        // only IPv4 entries are loaded
+        if (type == DnsType::A)
+            answer->addrs = it->second;
+
+        answer->status = answer->addrs.empty() ? DnsStatus::NotFound : DnsStatus::Ok;
+        return true;
+    }
+
+    static void _resolve_getaddrinfo(const std::string& name, DnsAnswer* answer)
+    {
+        in_addr addrs[16];
+        int count = resolve_dns(name.c_str(), addrs, 16);
+
+        answer->addrs.assign(addrs, addrs + std::max(count, 0));
+        answer->ttl = 0;
+        answer->status = count > 0 ? DnsStatus::Ok : DnsStatus::NotFound;
+    }
+
+    void dns_resolve(const DnsSettings& settings, const std::string& name, DnsType type, DnsAnswer* answer)
+    {
+        answer->status = DnsStatus::Error;
+
+        if (dns_lookup_hosts(settings, name, type, answer))
+            return;
+
+        if (settings.servers.empty())
+        {
+            if (type == DnsType::A)
+                _resolve_getaddrinfo(name, answer);
+
+            return;
+        }
+
+        char query[DNS_MAX_MESSAGE_SIZE];
+        uint16_t id = dns_query_id();
+        int query_size = dns_build_query(id, name, type, query, sizeof(query));
+
+        if (query_size == -1)
+        {
+            answer->status = DnsStatus::NotFound;
+            return;
+        }
+
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (sock == -1)
+            return;
+
+        answer->status = DnsStatus::Timeout;
+
+        unsigned int tries = settings.retries + 1;
+
+        for (unsigned int attempt = 0; attempt < tries; attempt++)
+        {
+            const sockaddr_in& server = settings.servers[attempt % settings.servers.size()];
+
+            if (::sendto(sock, query, query_size, 0, (sockaddr*)&server, sizeof(sockaddr_in)) == -1)
+                continue;
+
+            auto deadline = std::chrono::steady_clock::now()
+                + std::chrono::milliseconds(settings.timeout_ms);
+
+            bool next_server = false;
+
+            while (!next_server)
+            {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()
+                ).count();
+
+                if (left <= 0)
+                    break;
+
+                pollfd fd;
+                fd.fd = sock;
+                fd.events = POLLIN;
+                fd.revents = 0;
+
+                int poll_result = poll(&fd, 1, (int)left);
+
+                if (poll_result == -1 && get_last_socket_error() != EINTR)
+                    break;
+
+                if (poll_result <= 0)
+                    continue;
+
+                char response[DNS_MAX_MESSAGE_SIZE];
+                sockaddr_in from;
+                socklen_t from_len = sizeof(sockaddr_in);
+
+                int size = ::recvfrom(sock, response, sizeof(response), 0, (sockaddr*)&from, &from_len);
+
+                // only the asked server may answer
+                if (size <= 0
+                    || from.sin_addr.s_addr != server.sin_addr.s_addr
+                    || from.sin_port != server.sin_port)
+                {
+                    continue;
+                }
+
+                if (!dns_parse_response(response, size, id, name, type, answer))
+                    continue;
+
+                if (answer->status != DnsStatus::ServerFailure)
+                {
+                    ::close(sock);
+                    return;
+                }
+
+                next_server = true;
+            }
+        }
+
+        ::close(sock);
+    }
+}
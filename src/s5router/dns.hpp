@@ -0,0 +1,84 @@
+#pragma once
+
+#include "common/net.hpp"
+#include "settings.hpp"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace s5r
+{
+    static constexpr uint16_t DNS_PORT = 53;
+
+    // plain UDP message size limit (no EDNS)
+    static constexpr int DNS_MAX_MESSAGE_SIZE = 512;
+
+    enum class DnsType : uint16_t
+    {
+        A = 1,
+        AAAA = 28
+    };
+
+    enum class DnsStatus
+    {
+        Ok,
+
+        // NXDOMAIN or no records of the requested type
+        NotFound,
+
+        // SERVFAIL, REFUSED, ... (worth asking another upstream)
+        ServerFailure,
+
+        // no usable response after all retries
+        Timeout,
+
+        // couldn't even send the query
+        Error
+    };
+
+    struct DnsAnswer
+    {
+        DnsStatus status = DnsStatus::Error;
+
+        // A records
+        std::vector<in_addr> addrs;
+
+        // AAAA records (raw network order bytes)
+        std::vector<std::vector<uint8_t>> addrs6;
+
+        // smallest TTL of the records, SOA minimum for negative answers
+        uint32_t ttl = 0;
+    };
+
+    // random query id
+    uint16_t dns_query_id();
+
+    // returns message size or -1 if name is not a valid domain name
+    int dns_build_query(uint16_t id, const std::string& name, DnsType type, char buffer[], int buffer_size);
+
+    // returns false if `buffer` isn't a response to this query (ignore it)
+    bool dns_parse_response(
+        const char buffer[],
+        int buffer_size,
+        uint16_t id,
+        const std::string& name,
+        DnsType type,
+        DnsAnswer* answer
+    );
+
+    // appends IPv4 nameservers listed in resolv.conf
+    void dns_load_resolv_conf(const char* path, std::vector<sockaddr_in>* servers);
+
+    // adds IPv4 entries of a hosts file to `hosts`
+    void dns_load_hosts(const char* path, std::unordered_map<std::string, std::vector<in_addr>>* hosts);
+
+    // answers IP literals and names from settings.hosts,
+    // returns false if name is neither
+    bool dns_lookup_hosts(const DnsSettings& settings, const std::string& name, DnsType type, DnsAnswer* answer);
+
+    // blocking lookup through settings.servers, used by threaded mode.
+    // Falls back to getaddrinfo (A only) if no servers are configured
+    void dns_resolve(const DnsSettings& settings, const std::string& name, DnsType type, DnsAnswer* answer);
+}
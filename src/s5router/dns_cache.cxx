@@ -0,0 +1,338 @@
+#include "dns_cache.hpp"
+#include "dns_flights.hpp"
+#include "memory_budget.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
+namespace s5r
+{
+    // part of the lifetime left when a hot entry gets refreshed
+    static constexpr uint32_t PREFETCH_WINDOW_DIVISOR = 10;
+
+    DnsCache::DnsCache()
+    {
+        configure(DnsSettings());
+    }
+
+    DnsCache& DnsCache::shared()
+    {
+        static DnsCache cache;
+        return cache;
+    }
+
+    void DnsCache::configure(const DnsSettings& settings)
+    {
+        _shard_capacity = std::max<size_t>(1, settings.cache_size / SHARDS);
+        _min_ttl = settings.cache_min_ttl;
+        _max_ttl = std::max(settings.cache_max_ttl, settings.cache_min_ttl);
+        _negative_ttl = settings.cache_negative_ttl;
+        _failure_ttl = settings.cache_failure_ttl;
+        _prefetch_hits = settings.prefetch_hits;
+        _prefetch_rate = settings.prefetch_rate;
+
+        if (settings.cache_size == 0)
+        {
+            _shard_capacity = 0;
+        }
+    }
+
+    bool DnsCache::lookup(const std::string& name, DnsType type, DnsAnswer* answer, bool* refresh)
+    {
+        std::string key = dns_cache_key(name, type);
+        Shard& shard = _shard(key);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto it = shard.entries.find(key);
+        auto now = Clock::now();
+
+        if (it == shard.entries.end() || it->second.expires <= now)
+        {
+            if (it != shard.entries.end())
+            {
+                _erase(shard, it);
+            }
+
+            _misses++;
+            return false;
+        }
+
+        Entry& entry = it->second;
+        shard.lru.splice(shard.lru.begin(), shard.lru, entry.lru);
+
+        *answer = entry.answer;
+        answer->ttl = (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(entry.expires - now).count();
+
+        _hits++;
+
+        if (answer->status != DnsStatus::Ok)
+            _negative_hits++;
+
+        entry.hits++;
+
+        if (refresh && _should_refresh(entry, now))
+        {
+            entry.refreshing = true;
+            *refresh = true;
+            _prefetches++;
+        }
+
+        return true;
+    }
+
+    void DnsCache::insert(const std::string& name, DnsType type, const DnsAnswer& answer)
+    {
+        uint32_t lifetime = _lifetime(answer);
+
+        if (lifetime == 0 || _shard_capacity == 0)
+            return;
+
+        std::string key = dns_cache_key(name, type);
+        Shard& shard = _shard(key);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto it = shard.entries.find(key);
+
+        if (it == shard.entries.end())
+        {
+            shard.lru.push_front(key);
+
+            Entry& entry = shard.entries[key];
+            entry.lru = shard.lru.begin();
+            entry.bytes = 0;
+            it = shard.entries.find(key);
+        }
+        else
+        {
+            Entry& entry = it->second;
+
+            if (answer.status != DnsStatus::Ok
+                && entry.answer.status == DnsStatus::Ok
+                && entry.expires > Clock::now())
+            {
+                // failed refresh, the answer we have is still good
+                entry.refreshing = false;
+                return;
+            }
+
+            shard.lru.splice(shard.lru.begin(), shard.lru, entry.lru);
+        }
+
+        it->second.answer = answer;
+        it->second.expires = Clock::now() + std::chrono::seconds(lifetime);
+        it->second.lifetime = lifetime;
+        it->second.hits = 0;
+        it->second.refreshing = false;
+
+        // rough: both key copies, the entry, the addresses and node overhead
+        size_t bytes = 2 * key.size() + sizeof(Entry) + 64
+            + answer.addrs.size() * sizeof(in_addr)
+            + answer.addrs6.size() * (16 + sizeof(std::vector<uint8_t>));
+
+        MemoryBudget& budget = MemoryBudget::shared();
+        budget.release(MemoryUse::DnsCache, it->second.bytes);
+        budget.charge(MemoryUse::DnsCache, bytes);
+        it->second.bytes = bytes;
+
+        _inserts++;
+
+        while (shard.entries.size() > _shard_capacity)
+        {
+            _erase(shard, shard.entries.find(shard.lru.back()));
+            _evictions++;
+        }
+    }
+
+    void DnsCache::clear()
+    {
+        for (auto& shard : _shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            while (!shard.lru.empty())
+            {
+                _erase(shard, shard.entries.find(shard.lru.back()));
+            }
+        }
+    }
+
+    void DnsCache::trim()
+    {
+        for (auto& shard : _shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            size_t keep = shard.entries.size() / 2;
+
+            while (shard.entries.size() > keep)
+            {
+                _erase(shard, shard.entries.find(shard.lru.back()));
+                _evictions++;
+            }
+        }
+    }
+
+    void DnsCache::_erase(Shard& shard, std::unordered_map<std::string, Entry>::iterator it)
+    {
+        MemoryBudget::shared().release(MemoryUse::DnsCache, it->second.bytes);
+
+        shard.lru.erase(it->second.lru);
+        shard.entries.erase(it);
+    }
+
+    DnsCacheStats DnsCache::stats() const
+    {
+        DnsCacheStats stats;
+        stats.hits = _hits;
+        stats.misses = _misses;
+        stats.negative_hits = _negative_hits;
+        stats.inserts = _inserts;
+        stats.evictions = _evictions;
+        stats.prefetches = _prefetches;
+
+        for (auto& shard : _shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            stats.size += shard.entries.size();
+        }
+
+        return stats;
+    }
+
+    std::string dns_cache_key(const std::string& name, DnsType type)
+    {
+        std::string key;
+        key.reserve(name.size() + 2);
+
+        for (char c : name)
+            key.push_back((char)tolower((unsigned char)c));
+
+        if (!key.empty() && key.back() == '.')
+            key.pop_back();
+
+        key.push_back('/');
+        key.push_back(type == DnsType::A ? '4' : '6');
+
+        return key;
+    }
+
+    DnsCache::Shard& DnsCache::_shard(const std::string& key)
+    {
+        return _shards[std::hash<std::string>()(key) % SHARDS];
+    }
+
+    bool dns_lookup_local(
+        const DnsSettings& settings,
+        const std::string& name,
+        DnsType type,
+        DnsAnswer* answer,
+        bool* refresh
+    ) {
+        return dns_lookup_hosts(settings, name, type, answer)
+            || DnsCache::shared().lookup(name, type, answer, refresh);
+    }
+
+    void dns_resolve_cached(const DnsSettings& settings, const std::string& name, DnsType type, DnsAnswer* answer)
+    {
+        bool refresh = false;
+
+        if (dns_lookup_local(settings, name, type, answer, &refresh))
+        {
+            if (refresh)
+            {
+                // settings are copied, the thread may outlive the router
+                std::thread([settings, name, type]() -> void {
+                    if (!DnsFlights::shared().join(name, type, [](const DnsAnswer&) -> void {}))
+                        return;
+
+                    DnsAnswer fresh;
+                    dns_resolve(settings, name, type, &fresh);
+
+                    DnsCache::shared().insert(name, type, fresh);
+                    DnsFlights::shared().complete(name, type, fresh);
+                }).detach();
+            }
+
+            return;
+        }
+
+        DnsFlights& flights = DnsFlights::shared();
+
+        std::mutex mutex;
+        std::condition_variable answered;
+        bool done = false;
+
+        bool leader = flights.join(name, type, [&](const DnsAnswer& result) -> void {
+            std::lock_guard<std::mutex> lock(mutex);
+            *answer = result;
+            done = true;
+            answered.notify_one();
+        });
+
+        if (!leader)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            answered.wait(lock, [&done]() -> bool { return done; });
+            return;
+        }
+
+        dns_resolve(settings, name, type, answer);
+
+        // getaddrinfo fallback has no TTL, the minimum applies
+        DnsCache::shared().insert(name, type, *answer);
+        flights.complete(name, type, *answer);
+    }
+
+    bool DnsCache::_should_refresh(Entry& entry, Clock::time_point now)
+    {
+        if (_prefetch_hits == 0 || entry.refreshing || entry.hits < _prefetch_hits)
+            return false;
+
+        if (entry.answer.status != DnsStatus::Ok)
+            return false;
+
+        auto window = std::chrono::seconds(std::max<uint32_t>(1, entry.lifetime / PREFETCH_WINDOW_DIVISOR));
+
+        if (entry.expires - now > window)
+            return false;
+
+        std::lock_guard<std::mutex> lock(_prefetch_mutex);
+
+        if (now - _prefetch_window >= std::chrono::seconds(1))
+        {
+            _prefetch_window = now;
+            _prefetch_started = 0;
+        }
+
+        if (_prefetch_started >= _prefetch_rate)
+            return false;
+
+        _prefetch_started++;
+        return true;
+    }
+
+    uint32_t DnsCache::_lifetime(const DnsAnswer& answer) const
+    {
+        switch (answer.status)
+        {
+        case DnsStatus::Ok:
+            return std::min(std::max(answer.ttl, _min_ttl), _max_ttl);
+        case DnsStatus::NotFound:
+            // no SOA in the response, keep it as long as allowed
+            if (answer.ttl == 0)
+                return _negative_ttl;
+
+            return std::min(std::max(answer.ttl, _min_ttl), _negative_ttl);
+        case DnsStatus::ServerFailure:
+        case DnsStatus::Timeout:
+            return _failure_ttl;
+        default:
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "dns.hpp"
+#include "settings.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace s5r
+{
+    struct DnsCacheStats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+
+        // hits that returned a negative answer
+        uint64_t negative_hits = 0;
+
+        uint64_t inserts = 0;
+
+        // entries dropped to stay within capacity
+        uint64_t evictions = 0;
+
+        // hot entries handed out for refresh before they expired
+        uint64_t prefetches = 0;
+
+        size_t size = 0;
+    };
+
+    /**
+     * Process-wide DNS answer cache shared by every worker and
+     * tunnel thread. Split into independently locked shards,
+     * each one evicting its least recently used entries.
+     * Hot answers close to expiry are handed out for a background
+     * refresh so that lookups keep hitting
+     **/
+    class DnsCache
+    {
+    public:
+        static DnsCache& shared();
+
+        // applies cache_* limits of `settings`, call before serving
+        void configure(const DnsSettings& settings);
+
+        // returns false on miss or expired entry,
+        // answer->ttl is set to the seconds left.
+        // *refresh is set if the caller should refresh the entry now,
+        // only one caller gets it per entry lifetime
+        bool lookup(const std::string& name, DnsType type, DnsAnswer* answer, bool* refresh = nullptr);
+
+        // stores answer for its TTL clamped by the configured limits,
+        // failures are kept for cache_failure_ttl but never replace
+        // a positive answer that hasn't expired yet
+        void insert(const std::string& name, DnsType type, const DnsAnswer& answer);
+
+        void clear();
+
+        // drops the least recently used half of every shard
+        void trim();
+
+        DnsCacheStats stats() const;
+
+    private:
+        static constexpr size_t SHARDS = 16;
+
+        using Clock = std::chrono::steady_clock;
+
+        struct Entry
+        {
+            DnsAnswer answer;
+            Clock::time_point expires;
+            std::list<std::string>::iterator lru;
+
+            // cached for (seconds)
+            uint32_t lifetime;
+
+            // since inserted
+            uint32_t hits;
+            bool refreshing;
+
+            // charged to MemoryBudget
+            size_t bytes;
+        };
+
+        struct Shard
+        {
+            mutable std::mutex mutex;
+
+            // most recently used first
+            std::list<std::string> lru;
+            std::unordered_map<std::string, Entry> entries;
+        };
+
+        Shard _shards[SHARDS];
+
+        size_t _shard_capacity = 1024;
+        uint32_t _min_ttl = 0;
+        uint32_t _max_ttl = 0;
+        uint32_t _negative_ttl = 0;
+        uint32_t _failure_ttl = 0;
+        uint32_t _prefetch_hits = 0;
+        uint32_t _prefetch_rate = 0;
+
+        // refresh budget of the current second
+        std::mutex _prefetch_mutex;
+        Clock::time_point _prefetch_window;
+        uint32_t _prefetch_started = 0;
+
+        std::atomic<uint64_t> _hits{0};
+        std::atomic<uint64_t> _misses{0};
+        std::atomic<uint64_t> _negative_hits{0};
+        std::atomic<uint64_t> _inserts{0};
+        std::atomic<uint64_t> _evictions{0};
+        std::atomic<uint64_t> _prefetches{0};
+
+    private:
+        DnsCache();
+
+        Shard& _shard(const std::string& key);
+
+        // seconds the answer may be cached, 0 to skip it
+        uint32_t _lifetime(const DnsAnswer& answer) const;
+
+        // unlinks entry and gives its memory back, shard must be locked
+        void _erase(Shard& shard, std::unordered_map<std::string, Entry>::iterator it);
+
+        // entry is hot, about to expire and the rate allows it
+        bool _should_refresh(Entry& entry, Clock::time_point now);
+    };
+
+    // case-insensitive key of a name and record type
+    std::string dns_cache_key(const std::string& name, DnsType type);
+
+    // answers from the hosts file or the shared cache without any
+    // query, returns false if the name has to be resolved.
+    // *refresh is set like with DnsCache::lookup()
+    bool dns_lookup_local(
+        const DnsSettings& settings,
+        const std::string& name,
+        DnsType type,
+        DnsAnswer* answer,
+        bool* refresh = nullptr
+    );
+
+    // dns_resolve() behind the shared cache (blocking),
+    // concurrent lookups of one name share a single query,
+    // hot entries are refreshed by a detached thread
+    void dns_resolve_cached(const DnsSettings& settings, const std::string& name, DnsType type, DnsAnswer* answer);
+}
@@ -0,0 +1,61 @@
+#include "dns_flights.hpp"
+#include "dns_cache.hpp"
+
+namespace s5r
+{
+    DnsFlights& DnsFlights::shared()
+    {
+        static DnsFlights flights;
+        return flights;
+    }
+
+    bool DnsFlights::join(const std::string& name, DnsType type, Waiter waiter)
+    {
+        std::string key = dns_cache_key(name, type);
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto it = _flights.find(key);
+
+        if (it == _flights.end())
+        {
+            _flights[key];
+            _leaders++;
+            return true;
+        }
+
+        it->second.push_back(std::move(waiter));
+        _coalesced++;
+        return false;
+    }
+
+    void DnsFlights::complete(const std::string& name, DnsType type, const DnsAnswer& answer)
+    {
+        std::string key = dns_cache_key(name, type);
+        std::vector<Waiter> waiters;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            auto it = _flights.find(key);
+
+            if (it == _flights.end())
+                return;
+
+            waiters.swap(it->second);
+            _flights.erase(it);
+        }
+
+        for (auto& waiter : waiters)
+        {
+            waiter(answer);
+        }
+    }
+
+    DnsFlightStats DnsFlights::stats() const
+    {
+        DnsFlightStats stats;
+        stats.flights = _leaders;
+        stats.coalesced = _coalesced;
+        return stats;
+    }
+}
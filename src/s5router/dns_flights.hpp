@@ -0,0 +1,54 @@
+#pragma once
+
+#include "dns.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace s5r
+{
+    struct DnsFlightStats
+    {
+        // lookups that went to an upstream
+        uint64_t flights = 0;
+
+        // lookups that waited for another one's answer instead
+        uint64_t coalesced = 0;
+    };
+
+    /**
+     * Process-wide single-flight table of DNS lookups.
+     * First lookup of a name becomes the leader and queries
+     * the upstream, lookups joining while it is in flight just
+     * wait for its answer
+     **/
+    class DnsFlights
+    {
+    public:
+        // runs on the leader's thread, must not block
+        using Waiter = std::function<void(const DnsAnswer& answer)>;
+
+        static DnsFlights& shared();
+
+        // returns true if the caller leads the lookup and must call
+        // complete(), otherwise `waiter` gets the leader's answer
+        bool join(const std::string& name, DnsType type, Waiter waiter);
+
+        // hands answer to every waiter and ends the flight
+        void complete(const std::string& name, DnsType type, const DnsAnswer& answer);
+
+        DnsFlightStats stats() const;
+
+    private:
+        std::mutex _mutex;
+        std::unordered_map<std::string, std::vector<Waiter>> _flights;
+
+        std::atomic<uint64_t> _leaders{0};
+        std::atomic<uint64_t> _coalesced{0};
+    };
+}
@@ -0,0 +1,127 @@
+#include "listener.hpp"
+#include "reactor.hpp"
+#include "common/error.hpp"
+
+#include <iostream>
+#include <unistd.h>
+
+namespace s5r
+{
+    // connections accepted per wake-up before yielding to sessions
+    static constexpr int ACCEPT_BATCH = 64;
+
+    // pause of accepting when the process or system is out of descriptors
+    static constexpr uint32_t ACCEPT_BACKOFF_MS = 100;
+
+    Listener::Listener(int sock, EventLoop* loop, AcceptCallback on_accept)
+        : _loop{loop}, _on_accept{std::move(on_accept)}, _resume_timer{0}, _errors_not_logged{0}
+    {
+        _source.fd = sock;
+        _source.handler = this;
+    }
+
+    Listener::~Listener()
+    {
+        if (_resume_timer)
+        {
+            _loop->cancel_timer(_resume_timer);
+        }
+
+        ::close(_source.fd);
+    }
+
+    bool Listener::start()
+    {
+        if (!_loop->add(&_source, EPOLLIN))
+        {
+            std::cerr << "Couldn't register listening socket" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    void Listener::on_event(EventSource* source, uint32_t events)
+    {
+        if (events & EPOLLERR)
+        {
+            // reading the pending error clears it, the socket is
+            // level triggered and would be reported again otherwise
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            getsockopt(source->fd, SOL_SOCKET, SO_ERROR, (char*)&error, &error_len);
+
+            std::cerr << "Socket error when polling: " << error << std::endl;
+        }
+
+        for (int i = 0; i < ACCEPT_BATCH; i++)
+        {
+            sockaddr_in addr;
+            socklen_t addr_len = sizeof(sockaddr_in);
+
+            int cl_sock = ::accept4(
+                _source.fd,
+                (sockaddr*)&addr,
+                &addr_len,
+                SOCK_NONBLOCK | SOCK_CLOEXEC
+            );
+
+            if (cl_sock == -1)
+            {
+                int error = get_last_socket_error();
+
+                if (error == EMFILE || error == ENFILE)
+                {
+                    _log_error(error);
+                    _back_off();
+                }
+                else if (error != EAGAIN && error != EWOULDBLOCK && error != EINTR)
+                {
+                    _log_error(error);
+                }
+
+                break;
+            }
+
+            _on_accept(addr, cl_sock, _loop);
+        }
+    }
+
+    void Listener::_back_off()
+    {
+        if (_resume_timer || !_loop->modify(&_source, 0))
+            return;
+
+        _resume_timer = _loop->add_timer(ACCEPT_BACKOFF_MS, [this]() -> void {
+            _resume_timer = 0;
+
+            if (!_loop->modify(&_source, EPOLLIN))
+            {
+                std::cerr << "Couldn't resume listening socket" << std::endl;
+            }
+        });
+    }
+
+    void Listener::_log_error(int error)
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        if (now - _last_error_log < std::chrono::seconds(1))
+        {
+            _errors_not_logged++;
+            return;
+        }
+
+        std::cerr << "Couldn't accept socket connection: " << error;
+
+        if (_errors_not_logged > 0)
+        {
+            std::cerr << " (" << _errors_not_logged << " more not logged)";
+        }
+
+        std::cerr << std::endl;
+
+        _last_error_log = now;
+        _errors_not_logged = 0;
+    }
+}
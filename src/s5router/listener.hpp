@@ -0,0 +1,51 @@
+#pragma once
+
+#include "common/event.hpp"
+#include "common/net.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace s5r
+{
+    class EventLoop;
+
+    /**
+     * Non-blocking listening socket accepting on an EventLoop.
+     * Accepted sockets are already non-blocking
+     **/
+    class Listener : public EventHandler
+    {
+    public:
+        using AcceptCallback = std::function<void(const sockaddr_in& addr, int cl_sock, EventLoop* loop)>;
+
+        // takes ownership of `sock`
+        Listener(int sock, EventLoop* loop, AcceptCallback on_accept);
+        ~Listener();
+
+        // registers the socket, must be called on the loop thread
+        bool start();
+
+        void on_event(EventSource* source, uint32_t events) override;
+
+    private:
+        EventSource _source;
+        EventLoop* _loop;
+        AcceptCallback _on_accept;
+
+        // re-arms the socket after running out of descriptors, 0 if armed
+        uint64_t _resume_timer;
+
+        std::chrono::steady_clock::time_point _last_error_log;
+        uint64_t _errors_not_logged;
+
+    private:
+        // stops polling the socket for a while, the pending connections
+        // would wake the loop up again right away
+        void _back_off();
+
+        // at most one line per second
+        void _log_error(int error);
+    };
+}
@@ -0,0 +1,104 @@
+#include "memory_budget.hpp"
+#include "buffer_pool.hpp"
+#include "dns_cache.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+namespace s5r
+{
+    // share of the budget above which memory is reclaimed (percent)
+    static constexpr size_t MEMORY_HIGH_PERCENT = 80;
+
+    // caches are trimmed at most this often
+    static constexpr auto RECLAIM_INTERVAL = std::chrono::seconds(1);
+
+    MemoryBudget& MemoryBudget::shared()
+    {
+        static MemoryBudget budget;
+        return budget;
+    }
+
+    void MemoryBudget::configure(size_t budget)
+    {
+        _budget = budget;
+    }
+
+    void MemoryBudget::charge(MemoryUse use, size_t bytes)
+    {
+        _used[(size_t)use] += bytes;
+        _total += bytes;
+    }
+
+    void MemoryBudget::release(MemoryUse use, size_t bytes)
+    {
+        _used[(size_t)use] -= bytes;
+        _total -= bytes;
+    }
+
+    MemoryPressure MemoryBudget::pressure() const
+    {
+        size_t budget = _budget;
+        size_t total = _total;
+
+        if (budget == 0)
+            return MemoryPressure::None;
+
+        if (total >= budget)
+            return MemoryPressure::Exhausted;
+
+        if (total >= budget / 100 * MEMORY_HIGH_PERCENT)
+            return MemoryPressure::High;
+
+        return MemoryPressure::None;
+    }
+
+    bool MemoryBudget::admit()
+    {
+        if (pressure() == MemoryPressure::None)
+            return true;
+
+        _reclaim();
+
+        if (pressure() != MemoryPressure::Exhausted)
+            return true;
+
+        _refused++;
+        return false;
+    }
+
+    MemoryStats MemoryBudget::stats() const
+    {
+        MemoryStats stats;
+        stats.budget = _budget;
+        stats.refused = _refused;
+
+        for (size_t i = 0; i < (size_t)MemoryUse::Count; i++)
+        {
+            stats.used[i] = _used[i];
+        }
+
+        return stats;
+    }
+
+    void MemoryBudget::_reclaim()
+    {
+        int64_t now = Clock::now().time_since_epoch().count();
+        int64_t last = _reclaimed_at;
+
+        if (now - last < std::chrono::duration_cast<Clock::duration>(RECLAIM_INTERVAL).count())
+            return;
+
+        // one thread reclaims, the rest go on
+        if (!_reclaimed_at.compare_exchange_strong(last, now))
+            return;
+
+        size_t before = _total;
+
+        BufferPool::shared().trim();
+        DnsCache::shared().trim();
+
+        std::cerr << "Memory pressure, reclaimed "
+            << (before - std::min(before, (size_t)_total)) / 1024 << " KiB" << std::endl;
+    }
+}
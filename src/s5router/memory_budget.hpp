@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace s5r
+{
+    enum class MemoryUse
+    {
+        Sessions,
+        Buffers,
+        DnsCache,
+        Udp,
+        Count
+    };
+
+    enum class MemoryPressure
+    {
+        None,
+
+        // caches are trimmed, relay buffers shrink
+        High,
+
+        // budget used up, new requests are refused
+        Exhausted
+    };
+
+    struct MemoryStats
+    {
+        size_t budget = 0;
+        size_t used[(size_t)MemoryUse::Count] = {};
+
+        // requests refused for lack of memory
+        uint64_t refused = 0;
+    };
+
+    /**
+     * Process-wide accounting of the memory the router itself
+     * holds (sessions, relay buffers, DNS cache, queued UDP).
+     * Charges are plain atomic adds, reclaiming happens
+     * only when a new request is admitted
+     **/
+    class MemoryBudget
+    {
+    public:
+        static MemoryBudget& shared();
+
+        // 0 disables the budget
+        void configure(size_t budget);
+
+        void charge(MemoryUse use, size_t bytes);
+        void release(MemoryUse use, size_t bytes);
+
+        MemoryPressure pressure() const;
+
+        // call before serving a request (no locks held): trims caches
+        // under pressure, returns false if the budget is still exceeded
+        bool admit();
+
+        MemoryStats stats() const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        std::atomic<size_t> _budget{0};
+        std::atomic<size_t> _total{0};
+        std::atomic<size_t> _used[(size_t)MemoryUse::Count] = {};
+
+        std::atomic<uint64_t> _refused{0};
+
+        // last reclaim, in Clock ticks
+        std::atomic<int64_t> _reclaimed_at{0};
+
+    private:
+        // trims the DNS cache and idle buffers (rate limited)
+        void _reclaim();
+    };
+}
@@ -0,0 +1,76 @@
+#include "pipe_pool.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace s5r
+{
+    // idle pipes kept per thread
+    static constexpr size_t PIPE_POOL_MAX = 64;
+
+    static void _close_pipe(Pipe* pipe)
+    {
+        if (pipe->read_fd != -1) ::close(pipe->read_fd);
+        if (pipe->write_fd != -1) ::close(pipe->write_fd);
+
+        *pipe = Pipe();
+    }
+
+    PipePool::~PipePool()
+    {
+        for (auto& pipe : _pipes)
+        {
+            _close_pipe(&pipe);
+        }
+    }
+
+    PipePool& PipePool::local()
+    {
+        thread_local PipePool pool;
+        return pool;
+    }
+
+    bool PipePool::acquire(Pipe* pipe)
+    {
+        if (!_pipes.empty())
+        {
+            *pipe = _pipes.back();
+            _pipes.pop_back();
+            return true;
+        }
+
+        int fds[2];
+
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1)
+        {
+            return false;
+        }
+
+        pipe->read_fd = fds[0];
+        pipe->write_fd = fds[1];
+        pipe->size = 0;
+        pipe->capacity = fcntl(fds[1], F_GETPIPE_SZ);
+
+        if (pipe->capacity <= 0)
+        {
+            pipe->capacity = 65536;
+        }
+
+        return true;
+    }
+
+    void PipePool::release(Pipe* pipe)
+    {
+        if (pipe->read_fd == -1)
+            return;
+
+        if (pipe->size != 0 || _pipes.size() >= PIPE_POOL_MAX)
+        {
+            _close_pipe(pipe);
+            return;
+        }
+
+        _pipes.push_back(*pipe);
+        *pipe = Pipe();
+    }
+}
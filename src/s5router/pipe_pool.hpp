@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+
+namespace s5r
+{
+    struct Pipe
+    {
+        int read_fd = -1;
+        int write_fd = -1;
+
+        // bytes currently held by the pipe
+        int size = 0;
+
+        // pipe buffer capacity
+        int capacity = 0;
+    };
+
+    /**
+     * Per-thread cache of pipes used for splice() relaying,
+     * saves pipe2() + 2 close() per tunnel
+     **/
+    class PipePool
+    {
+    public:
+        ~PipePool();
+
+        // pool of the calling thread
+        static PipePool& local();
+
+        // returns false if no pipe could be created
+        bool acquire(Pipe* pipe);
+
+        // pipes still holding data are closed instead of pooled
+        void release(Pipe* pipe);
+
+    private:
+        std::vector<Pipe> _pipes;
+    };
+}
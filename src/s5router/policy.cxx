@@ -0,0 +1,859 @@
+#include "policy.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace s5r
+{
+    static uint32_t _prefix_mask(uint8_t length)
+    {
+        return length == 0 ? 0 : ~0u << (32 - length);
+    }
+
+    // leading bits `a` and `b` share
+    static uint8_t _common_length(uint32_t a, uint32_t b)
+    {
+        uint32_t diff = a ^ b;
+        uint8_t length = 0;
+
+        while (length < 32 && !(diff & (0x80000000u >> length)))
+            length++;
+
+        return length;
+    }
+
+    // domains are ASCII, tolower() would consult the locale
+    static char _lower(char c)
+    {
+        return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+    }
+
+    // hash chain of the domain trie starts from the root's
+    static constexpr uint64_t DOMAIN_ROOT_HASH = 14695981039346656037ull;
+
+    static std::string _lower_domain(const std::string& domain)
+    {
+        std::string lower = domain;
+
+        if (!lower.empty() && lower.back() == '.')
+            lower.pop_back();
+
+        for (auto& c : lower)
+            c = _lower(c);
+
+        return lower;
+    }
+
+    // decimal number making up all of word[start, end)
+    static bool _parse_number(const std::string& word, size_t start, size_t end, unsigned long* value)
+    {
+        // strtoul() would take a sign or leading spaces as well
+        if (start >= end || !isdigit((unsigned char)word[start]))
+            return false;
+
+        char* parsed;
+        *value = std::strtoul(word.c_str() + start, &parsed, 10);
+
+        return parsed == word.c_str() + end;
+    }
+
+    // "a.b.c.d/len" or a single address
+    static bool _parse_network(const std::string& word, in_addr* address, uint8_t* length)
+    {
+        size_t slash = word.find('/');
+        unsigned long bits = 32;
+
+        if (slash != std::string::npos)
+        {
+            if (!_parse_number(word, slash + 1, word.size(), &bits) || bits > 32)
+                return false;
+        }
+
+        if (inet_pton(AF_INET, word.substr(0, slash).c_str(), address) != 1)
+            return false;
+
+        *length = (uint8_t)bits;
+        address->s_addr = htonl(ntohl(address->s_addr) & _prefix_mask(*length));
+        return true;
+    }
+
+    // "port" or "first-last"
+    static bool _parse_ports(const std::string& word, PortRange* range)
+    {
+        size_t dash = word.find('-');
+        unsigned long first;
+        unsigned long last;
+
+        if (!_parse_number(word, 0, std::min(dash, word.size()), &first))
+            return false;
+
+        if (dash == std::string::npos)
+            last = first;
+        else if (!_parse_number(word, dash + 1, word.size(), &last))
+            return false;
+
+        if (first == 0 || last < first || last > 65535)
+            return false;
+
+        range->first = (uint16_t)first;
+        range->last = (uint16_t)last;
+        return true;
+    }
+
+    PolicyTable::PolicyTable()
+    {
+        clear();
+    }
+
+    PolicyTable& PolicyTable::shared()
+    {
+        static PolicyTable table;
+        return table;
+    }
+
+    bool PolicyTable::load(const char* path, const std::vector<NetworkInterface>& netifaces)
+    {
+        std::ifstream file(path);
+
+        if (!file)
+        {
+            std::cerr << "Couldn't open rules file " << path << std::endl;
+            return false;
+        }
+
+        std::string line;
+        uint32_t number = 0;
+
+        while (std::getline(file, line))
+        {
+            number++;
+            line = line.substr(0, line.find('#'));
+
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+
+            PolicyRule rule;
+
+            if (!_parse_rule(line, netifaces, &rule))
+            {
+                std::cerr << "Invalid rule at " << path << ":" << number << std::endl;
+                clear();
+                return false;
+            }
+
+            rule.line = number;
+            add(rule);
+        }
+
+        index();
+        return true;
+    }
+
+    void PolicyTable::add(const PolicyRule& rule)
+    {
+        uint32_t index = (uint32_t)_rules.size();
+        _rules.push_back(rule);
+
+        RuleCheck check;
+        check.source = ntohl(rule.source.s_addr);
+        check.source_mask = _prefix_mask(rule.source_length);
+        check.destination = ntohl(rule.destination.s_addr);
+        check.destination_mask = _prefix_mask(rule.destination_length);
+        check.ports = rule.ports;
+        _checks.push_back(check);
+
+        bool unconditional = rule.source_length == 0 && rule.ports.first == 0;
+        _slots.clear();
+
+        if (!rule.domain.empty())
+        {
+            _insert_domain(rule.domain, index, unconditional && rule.destination_length == 0);
+        }
+        else if (rule.destination_length > 0)
+        {
+            _insert_prefix(check.destination, rule.destination_length, index, unconditional);
+            _first_prefix_rule = std::min(_first_prefix_rule, index);
+        }
+        else
+        {
+            _attach(&_generic, index, unconditional);
+        }
+    }
+
+    void PolicyTable::index()
+    {
+        _slots.assign(65536, PrefixSlot{NONE, NONE});
+        _index_prefixes(0, NONE);
+    }
+
+    void PolicyTable::clear()
+    {
+        _rules.clear();
+        _checks.clear();
+        _rule_lists.clear();
+        _slots.clear();
+        _generic = RuleList();
+        _first_prefix_rule = NONE;
+
+        _prefixes.clear();
+        _prefixes.emplace_back();
+        _prefixes[0].prefix = 0;
+        _prefixes[0].length = 0;
+
+        _domains.clear();
+        _domains.emplace_back();
+        _domains[0].parent = NONE;
+        _domain_edges.assign(16, DomainEdge());
+    }
+
+    bool PolicyTable::empty() const
+    {
+        return _rules.empty();
+    }
+
+    const PolicyRule* PolicyTable::match(
+        in_addr source,
+        in_addr destination,
+        uint16_t port,
+        const std::string* domain
+    ) const {
+        if (_rules.empty())
+            return nullptr;
+
+        uint32_t from = ntohl(source.s_addr);
+        uint32_t address = ntohl(destination.s_addr);
+        uint32_t best = NONE;
+
+        // the domain's trie edges load while the prefixes are walked
+        DomainPath path;
+
+        if (domain && _domains.size() > 1)
+            _hash_suffixes(*domain, &path);
+
+        _scan(_generic, from, address, port, &best);
+
+        uint32_t node = 0;
+
+        if (!_slots.empty())
+        {
+            const PrefixSlot& slot = _slots[address >> 16];
+            _scan(slot.rules, from, address, port, &best);
+            node = slot.node;
+        }
+
+        // every node on the way holds a prefix of the address
+        while (node != NONE)
+        {
+            const PrefixNode& prefix = _prefixes[node];
+
+            if ((address ^ prefix.prefix) & _prefix_mask(prefix.length))
+                break;
+
+            _scan(prefix.rules, from, address, port, &best);
+
+            if (prefix.length == 32)
+                break;
+
+            node = prefix.children[(address >> (31 - prefix.length)) & 1];
+        }
+
+        if (path.levels > 0)
+        {
+            uint32_t nodes[MAX_DOMAIN_LEVELS];
+            size_t found = _find_suffixes(*domain, path, nodes);
+
+            for (size_t i = 0; i < found; i++)
+            {
+                _scan(_domains[nodes[i]].rules, from, address, port, &best);
+            }
+        }
+
+        return best == NONE ? nullptr : &_rules[best];
+    }
+
+    bool PolicyTable::match_name(
+        in_addr source,
+        uint16_t port,
+        const std::string& domain,
+        const PolicyRule** rule
+    ) const {
+        *rule = nullptr;
+
+        if (_rules.empty())
+            return true;
+
+        uint32_t from = ntohl(source.s_addr);
+        uint32_t best = NONE;
+
+        // every destination network rule may match an unknown address
+        uint32_t pending = _first_prefix_rule;
+
+        _scan_name(_generic, from, port, &best, &pending);
+
+        if (_domains.size() > 1)
+        {
+            DomainPath path;
+            _hash_suffixes(domain, &path);
+
+            uint32_t nodes[MAX_DOMAIN_LEVELS];
+            size_t found = _find_suffixes(domain, path, nodes);
+
+            for (size_t i = 0; i < found; i++)
+            {
+                _scan_name(_domains[nodes[i]].rules, from, port, &best, &pending);
+            }
+        }
+
+        if (pending < best)
+            return false;
+
+        if (best != NONE)
+            *rule = &_rules[best];
+
+        return true;
+    }
+
+    void PolicyTable::count(const PolicyRule* rule)
+    {
+        if (!rule)
+        {
+            _unmatched.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        switch (rule->action)
+        {
+        case PolicyAction::Route:
+            _routed.fetch_add(1, std::memory_order_relaxed);
+            break;
+        case PolicyAction::Reject:
+            _rejected.fetch_add(1, std::memory_order_relaxed);
+            break;
+        case PolicyAction::Direct:
+            _direct.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+    }
+
+    PolicyStats PolicyTable::stats() const
+    {
+        PolicyStats stats;
+        stats.rules = _rules.size();
+        stats.routed = _routed.load(std::memory_order_relaxed);
+        stats.rejected = _rejected.load(std::memory_order_relaxed);
+        stats.direct = _direct.load(std::memory_order_relaxed);
+        stats.unmatched = _unmatched.load(std::memory_order_relaxed);
+
+        return stats;
+    }
+
+    void PolicyTable::_attach(RuleList* rules, uint32_t rule, bool unconditional)
+    {
+        if (rules->first == NONE)
+        {
+            rules->first = unconditional ? rule | UNCONDITIONAL : rule;
+            return;
+        }
+
+        if (rules->more == NONE)
+        {
+            rules->more = (uint32_t)_rule_lists.size();
+            _rule_lists.emplace_back();
+        }
+
+        _rule_lists[rules->more].push_back(rule);
+    }
+
+    void PolicyTable::_insert_prefix(uint32_t prefix, uint8_t length, uint32_t rule, bool unconditional)
+    {
+        uint32_t node = 0;
+
+        // nodes are taken by index, emplace_back() moves them
+        while (true)
+        {
+            if (_prefixes[node].length == length)
+            {
+                _attach(&_prefixes[node].rules, rule, unconditional);
+                return;
+            }
+
+            int bit = (prefix >> (31 - _prefixes[node].length)) & 1;
+            uint32_t child = _prefixes[node].children[bit];
+
+            if (child == NONE)
+            {
+                uint32_t leaf = (uint32_t)_prefixes.size();
+                _prefixes.emplace_back();
+                _prefixes[leaf].prefix = prefix;
+                _prefixes[leaf].length = length;
+                _attach(&_prefixes[leaf].rules, rule, unconditional);
+
+                _prefixes[node].children[bit] = leaf;
+                return;
+            }
+
+            uint32_t child_prefix = _prefixes[child].prefix;
+            uint8_t child_length = _prefixes[child].length;
+            uint8_t common = std::min({length, child_length, _common_length(prefix, child_prefix)});
+
+            if (common == child_length)
+            {
+                node = child;
+                continue;
+            }
+
+            // the child's prefix diverges, a node for the common part
+            // takes its place with both below it
+            uint32_t split = (uint32_t)_prefixes.size();
+            _prefixes.emplace_back();
+            _prefixes[split].prefix = prefix & _prefix_mask(common);
+            _prefixes[split].length = common;
+            _prefixes[split].children[(child_prefix >> (31 - common)) & 1] = child;
+            _prefixes[node].children[bit] = split;
+
+            if (common == length)
+            {
+                _attach(&_prefixes[split].rules, rule, unconditional);
+                return;
+            }
+
+            node = split;
+        }
+    }
+
+    void PolicyTable::_insert_domain(const std::string& domain, uint32_t rule, bool unconditional)
+    {
+        uint32_t node = 0;
+        uint64_t hash = DOMAIN_ROOT_HASH;
+        size_t end = domain.size();
+
+        while (end > 0)
+        {
+            size_t dot = domain.rfind('.', end - 1);
+            size_t start = dot == std::string::npos ? 0 : dot + 1;
+
+            hash = _hash_label(hash, domain, start, end);
+            uint32_t child = _find_domain(node, hash, domain, start, end);
+
+            if (child == NONE)
+            {
+                child = (uint32_t)_domains.size();
+                _domains.emplace_back();
+                _domains[child].label = domain.substr(start, end - start);
+                _domains[child].parent = node;
+                _domains[node].children++;
+
+                // rehashed before the table gets more than half full
+                if ((_domains.size() - 1) * 2 > _domain_edges.size())
+                {
+                    std::vector<DomainEdge> edges(_domain_edges.size() * 2);
+                    size_t mask = edges.size() - 1;
+
+                    for (auto& edge : _domain_edges)
+                    {
+                        if (edge.child == NONE)
+                            continue;
+
+                        size_t i = edge.hash & mask;
+
+                        while (edges[i].child != NONE)
+                            i = (i + 1) & mask;
+
+                        edges[i] = edge;
+                    }
+
+                    _domain_edges.swap(edges);
+                }
+
+                size_t mask = _domain_edges.size() - 1;
+                size_t i = hash & mask;
+
+                while (_domain_edges[i].child != NONE)
+                    i = (i + 1) & mask;
+
+                _domain_edges[i].hash = hash;
+                _domain_edges[i].child = child;
+            }
+
+            node = child;
+
+            if (dot == std::string::npos)
+                break;
+
+            end = dot;
+        }
+
+        _attach(&_domains[node].rules, rule, unconditional);
+    }
+
+    uint32_t PolicyTable::_find_domain(
+        uint32_t parent,
+        uint64_t hash,
+        const std::string& name,
+        size_t start,
+        size_t end
+    ) const {
+        size_t mask = _domain_edges.size() - 1;
+
+        for (size_t i = hash & mask; _domain_edges[i].child != NONE; i = (i + 1) & mask)
+        {
+            const DomainEdge& edge = _domain_edges[i];
+
+            if (edge.hash != hash)
+                continue;
+
+            const DomainNode& node = _domains[edge.child];
+
+            if (node.parent != parent || node.label.size() != end - start)
+                continue;
+
+            bool equal = true;
+
+            for (size_t j = 0; j < node.label.size() && equal; j++)
+            {
+                equal = node.label[j] == _lower(name[start + j]);
+            }
+
+            if (equal)
+                return edge.child;
+        }
+
+        return NONE;
+    }
+
+    void PolicyTable::_hash_suffixes(const std::string& name, DomainPath* path) const
+    {
+        size_t end = name.size();
+        uint64_t hash = DOMAIN_ROOT_HASH;
+        size_t mask = _domain_edges.size() - 1;
+
+        path->levels = 0;
+
+        // a trailing dot is the root
+        if (end > 0 && name[end - 1] == '.')
+            end--;
+
+        while (end > 0 && path->levels < MAX_DOMAIN_LEVELS)
+        {
+            size_t dot = name.rfind('.', end - 1);
+            size_t start = dot == std::string::npos ? 0 : dot + 1;
+
+            hash = _hash_label(hash, name, start, end);
+
+            path->starts[path->levels] = start;
+            path->ends[path->levels] = end;
+            path->hashes[path->levels] = hash;
+            path->levels++;
+
+#if defined(__GNUC__)
+            __builtin_prefetch(&_domain_edges[hash & mask]);
+#endif
+
+            if (dot == std::string::npos)
+                break;
+
+            end = dot;
+        }
+    }
+
+    size_t PolicyTable::_find_suffixes(
+        const std::string& name,
+        const DomainPath& path,
+        uint32_t nodes[MAX_DOMAIN_LEVELS]
+    ) const {
+        uint32_t node = 0;
+        size_t found = 0;
+
+        // each node reached is a suffix
+        while (found < path.levels && _domains[node].children > 0)
+        {
+            node = _find_domain(node, path.hashes[found], name, path.starts[found], path.ends[found]);
+
+            if (node == NONE)
+                break;
+
+            nodes[found++] = node;
+        }
+
+        return found;
+    }
+
+    uint64_t PolicyTable::_hash_label(uint64_t parent_hash, const std::string& name, size_t start, size_t end)
+    {
+        // FNV-1a of the lowercase label, seeded with the parent's
+        uint64_t hash = parent_hash * 0x9E3779B97F4A7C15ull;
+
+        for (size_t i = start; i < end; i++)
+        {
+            hash ^= (uint8_t)_lower(name[i]);
+            hash *= 1099511628211ull;
+        }
+
+        // the low bits pick the slot
+        return hash ^ (hash >> 32);
+    }
+
+    void PolicyTable::_index_prefixes(uint32_t node, uint32_t covering)
+    {
+        const PrefixNode& prefix = _prefixes[node];
+
+        if (prefix.rules.first != NONE)
+        {
+            std::vector<uint32_t> rules;
+
+            if (covering != NONE)
+                rules = _rule_lists[covering];
+
+            rules.push_back(prefix.rules.first & ~UNCONDITIONAL);
+
+            if (prefix.rules.more != NONE)
+            {
+                const std::vector<uint32_t>& more = _rule_lists[prefix.rules.more];
+                rules.insert(rules.end(), more.begin(), more.end());
+            }
+
+            std::sort(rules.begin(), rules.end());
+
+            covering = (uint32_t)_rule_lists.size();
+            _rule_lists.push_back(std::move(rules));
+        }
+
+        uint32_t first = prefix.prefix >> 16;
+        uint32_t count = 1u << (16 - prefix.length);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            _slots[first + i] = PrefixSlot{NONE, covering};
+        }
+
+        // children split by one of the first 16 bits, so each
+        // /16 or longer one takes a slot of its own
+        for (uint32_t child : prefix.children)
+        {
+            if (child == NONE)
+                continue;
+
+            if (_prefixes[child].length < 16)
+            {
+                _index_prefixes(child, covering);
+            }
+            else
+            {
+                _slots[_prefixes[child].prefix >> 16] = PrefixSlot{child, covering};
+            }
+        }
+    }
+
+    bool PolicyTable::_matches(uint32_t rule, uint32_t source, uint32_t destination, uint16_t port) const
+    {
+        const RuleCheck& check = _checks[rule];
+
+        if ((source ^ check.source) & check.source_mask)
+            return false;
+
+        if ((destination ^ check.destination) & check.destination_mask)
+            return false;
+
+        if (check.ports.first != 0 && (port < check.ports.first || port > check.ports.last))
+            return false;
+
+        return true;
+    }
+
+    void PolicyTable::_scan(
+        const RuleList& rules,
+        uint32_t source,
+        uint32_t destination,
+        uint16_t port,
+        uint32_t* best
+    ) const {
+        if (rules.first == NONE)
+            return;
+
+        uint32_t rule = rules.first & ~UNCONDITIONAL;
+
+        // the rest come later than what matched
+        if (rule >= *best)
+            return;
+
+        if ((rules.first & UNCONDITIONAL) || _matches(rule, source, destination, port))
+        {
+            *best = rule;
+            return;
+        }
+
+        _scan(rules.more, source, destination, port, best);
+    }
+
+    void PolicyTable::_scan(
+        uint32_t list,
+        uint32_t source,
+        uint32_t destination,
+        uint16_t port,
+        uint32_t* best
+    ) const {
+        if (list == NONE)
+            return;
+
+        for (uint32_t rule : _rule_lists[list])
+        {
+            if (rule >= *best)
+                return;
+
+            if (_matches(rule, source, destination, port))
+            {
+                *best = rule;
+                return;
+            }
+        }
+    }
+
+    bool PolicyTable::_matches_name(uint32_t rule, uint32_t source, uint16_t port) const
+    {
+        const RuleCheck& check = _checks[rule];
+
+        if ((source ^ check.source) & check.source_mask)
+            return false;
+
+        if (check.ports.first != 0 && (port < check.ports.first || port > check.ports.last))
+            return false;
+
+        return true;
+    }
+
+    void PolicyTable::_scan_name(
+        const RuleList& rules,
+        uint32_t source,
+        uint16_t port,
+        uint32_t* best,
+        uint32_t* pending
+    ) const {
+        if (rules.first == NONE)
+            return;
+
+        _scan_name(rules.first & ~UNCONDITIONAL, source, port, best, pending);
+
+        if (rules.more == NONE)
+            return;
+
+        for (uint32_t rule : _rule_lists[rules.more])
+        {
+            _scan_name(rule, source, port, best, pending);
+        }
+    }
+
+    void PolicyTable::_scan_name(
+        uint32_t rule,
+        uint32_t source,
+        uint16_t port,
+        uint32_t* best,
+        uint32_t* pending
+    ) const {
+        if (rule >= *best || rule >= *pending || !_matches_name(rule, source, port))
+            return;
+
+        if (_checks[rule].destination_mask)
+            *pending = rule;
+        else
+            *best = rule;
+    }
+
+    bool PolicyTable::_parse_rule(
+        const std::string& line,
+        const std::vector<NetworkInterface>& netifaces,
+        PolicyRule* rule
+    ) {
+        std::istringstream words(line);
+        std::string key;
+
+        while (words >> key)
+        {
+            std::string value;
+
+            if (key == "reject" || key == "direct")
+            {
+                rule->action = key == "reject" ? PolicyAction::Reject : PolicyAction::Direct;
+
+                // the action ends a rule
+                return !(words >> value);
+            }
+
+            if (!(words >> value))
+                return false;
+
+            if (key == "dst")
+            {
+                if (!_parse_network(value, &rule->destination, &rule->destination_length))
+                    return false;
+            }
+            else if (key == "src")
+            {
+                if (!_parse_network(value, &rule->source, &rule->source_length))
+                    return false;
+            }
+            else if (key == "domain")
+            {
+                rule->domain = _lower_domain(value);
+
+                if (rule->domain.empty())
+                    return false;
+            }
+            else if (key == "port")
+            {
+                if (!_parse_ports(value, &rule->ports))
+                    return false;
+            }
+            else if (key == "route")
+            {
+                rule->action = PolicyAction::Route;
+
+                bool found = false;
+
+                for (auto& netiface : netifaces)
+                {
+                    if (netiface.addrs.empty())
+                        continue;
+
+                    if (netiface.name == value)
+                    {
+                        rule->route_ip = netiface.addrs[0];
+                        found = true;
+                        break;
+                    }
+
+                    for (auto addr : netiface.addrs)
+                    {
+                        if (inet_ntoa(addr) == value)
+                        {
+                            rule->route_ip = addr;
+                            found = true;
+                            break;
+                        }
+                    }
+
+                    if (found)
+                        break;
+                }
+
+                if (!found)
+                {
+                    std::cerr << "No network interface " << value << std::endl;
+                    return false;
+                }
+
+                return !(words >> value);
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        // no action
+        return false;
+    }
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include "common/net.hpp"
+#include "settings.hpp"
+#include "utils.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace s5r
+{
+    enum class PolicyAction
+    {
+        // connect from the rule's interface address
+        Route,
+
+        // refuse the request (reply 0x02)
+        Reject,
+
+        // leave the source address to the kernel's routing table
+        Direct
+    };
+
+    struct PolicyRule
+    {
+        // destination network, length 0 matches any address
+        in_addr destination = {};
+        uint8_t destination_length = 0;
+
+        // destination name and its subdomains (lowercase),
+        // empty matches any request
+        std::string domain;
+
+        // destination ports (host order), 0-0 matches any
+        PortRange ports;
+
+        // client network, length 0 matches any client
+        in_addr source = {};
+        uint8_t source_length = 0;
+
+        PolicyAction action = PolicyAction::Route;
+
+        // address connects are made from with PolicyAction::Route
+        in_addr route_ip = {};
+
+        // 1-based line in the rules file, 0 if added otherwise
+        uint32_t line = 0;
+    };
+
+    struct PolicyStats
+    {
+        size_t rules = 0;
+
+        // requests per action of the rule they matched
+        uint64_t routed = 0;
+        uint64_t rejected = 0;
+        uint64_t direct = 0;
+
+        // requests no rule matched, served from the route address
+        uint64_t unmatched = 0;
+    };
+
+    /**
+     * Rules deciding how a CONNECT leaves the router, the first
+     * matching rule in file order wins. Rules are indexed by their
+     * most selective part: domain rules in a trie of reversed labels,
+     * destination networks in a path compressed binary trie whose
+     * top 16 bits are a direct table. A lookup walks both along the
+     * request and checks the rules found on the way, only rules with
+     * neither part are scanned as they are.
+     * Built before serving, lookups don't lock
+     **/
+    class PolicyTable
+    {
+    public:
+        PolicyTable();
+
+        static PolicyTable& shared();
+
+        // rule file lines: matchers followed by an action, e.g.
+        //   dst 10.0.0.0/8 port 443 src 192.168.0.0/16 route eth1
+        //   domain example.com reject
+        //   port 25-26 direct
+        // Interfaces are found by name or address in `netifaces`.
+        // UDP datagrams are only dropped by reject, their association
+        // sockets are bound before the first one is sent.
+        // Returns false (and keeps no rules) if a line is invalid
+        bool load(const char* path, const std::vector<NetworkInterface>& netifaces);
+
+        void add(const PolicyRule& rule);
+
+        // builds the direct table lookups start from, load() does it
+        // by itself. Until then (after add()) lookups walk from the root
+        void index();
+
+        void clear();
+
+        bool empty() const;
+
+        // first rule matching a CONNECT, nullptr if none does.
+        // `port` is in host order, `domain` is nullptr for addresses
+        const PolicyRule* match(
+            in_addr source,
+            in_addr destination,
+            uint16_t port,
+            const std::string* domain
+        ) const;
+
+        // decides a CONNECT to `domain` before it's resolved, by the
+        // rules that don't look at the destination address. False if
+        // one that does may come first, match() then has to be asked
+        // once the address is known. `*rule` is nullptr if none matched
+        bool match_name(
+            in_addr source,
+            uint16_t port,
+            const std::string& domain,
+            const PolicyRule** rule
+        ) const;
+
+        // counts a request served by `rule` (nullptr: unmatched)
+        void count(const PolicyRule* rule);
+
+        PolicyStats stats() const;
+
+    private:
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        // on RuleList::first, the rule needs no check past the index
+        static constexpr uint32_t UNCONDITIONAL = 0x80000000;
+
+        // what a lookup checks of a rule, host order
+        struct RuleCheck
+        {
+            uint32_t source;
+            uint32_t source_mask;
+            uint32_t destination;
+            uint32_t destination_mask;
+            PortRange ports;
+        };
+
+        // rules of one trie node, ascending. Most nodes have one,
+        // kept inline so a lookup doesn't fetch a list for it
+        struct RuleList
+        {
+            uint32_t first = NONE;
+
+            // index into _rule_lists
+            uint32_t more = NONE;
+        };
+
+        struct PrefixNode
+        {
+            // host order, bits past `length` are zero
+            uint32_t prefix;
+            uint8_t length;
+
+            uint32_t children[2] = {NONE, NONE};
+            RuleList rules;
+        };
+
+        // lookup start for addresses with the same top 16 bits
+        struct PrefixSlot
+        {
+            // first node of /16 or longer on the way, NONE if there's none
+            uint32_t node;
+
+            // rules of the shorter nodes on the way (_rule_lists)
+            uint32_t rules;
+        };
+
+        struct DomainNode
+        {
+            // lowercase, a lookup compares it on a hash match
+            std::string label;
+            uint32_t parent;
+
+            // a lookup stops at nodes without children
+            uint32_t children = 0;
+
+            RuleList rules;
+        };
+
+        // entry of the open addressing table of trie edges
+        struct DomainEdge
+        {
+            // of the suffix the child stands for, see _hash_label()
+            uint64_t hash;
+            uint32_t child = NONE;
+        };
+
+        // labels of the longest names (255 characters)
+        static constexpr size_t MAX_DOMAIN_LEVELS = 128;
+
+        // labels of a looked up name, top level domain first,
+        // with the hashes of the suffixes they end
+        struct DomainPath
+        {
+            size_t levels = 0;
+            size_t starts[MAX_DOMAIN_LEVELS];
+            size_t ends[MAX_DOMAIN_LEVELS];
+            uint64_t hashes[MAX_DOMAIN_LEVELS];
+        };
+
+        std::vector<PolicyRule> _rules;
+        std::vector<RuleCheck> _checks;
+
+        std::vector<std::vector<uint32_t>> _rule_lists;
+
+        // node 0 is the root (0.0.0.0/0)
+        std::vector<PrefixNode> _prefixes;
+
+        // 65536 once indexed, empty if rules were added since
+        std::vector<PrefixSlot> _slots;
+
+        // node 0 is the root, its children are top level domains
+        std::vector<DomainNode> _domains;
+
+        // size is a power of two, kept at most half full
+        std::vector<DomainEdge> _domain_edges;
+
+        // rules with neither a domain nor a destination network
+        RuleList _generic;
+
+        // first rule in the prefix trie, NONE if there's none
+        uint32_t _first_prefix_rule;
+
+        std::atomic<uint64_t> _routed{0};
+        std::atomic<uint64_t> _rejected{0};
+        std::atomic<uint64_t> _direct{0};
+        std::atomic<uint64_t> _unmatched{0};
+
+    private:
+        // `unconditional` if the index is all there's to check
+        void _attach(RuleList* rules, uint32_t rule, bool unconditional);
+
+        void _insert_prefix(uint32_t prefix, uint8_t length, uint32_t rule, bool unconditional);
+        void _insert_domain(const std::string& domain, uint32_t rule, bool unconditional);
+
+        // child of `parent` labeled name[start, end) in any case, NONE if
+        // none. `hash` is _hash_label() of the label under `parent`
+        uint32_t _find_domain(uint32_t parent, uint64_t hash, const std::string& name, size_t start, size_t end) const;
+
+        // splits `name` into `path` and prefetches the trie edges of every
+        // level, their misses overlap with whatever is done until
+        // _find_suffixes() instead of adding up one after another
+        void _hash_suffixes(const std::string& name, DomainPath* path) const;
+
+        // nodes of the suffixes in `path` that are in the trie, top level
+        // domain first, returns how many
+        size_t _find_suffixes(const std::string& name, const DomainPath& path, uint32_t nodes[MAX_DOMAIN_LEVELS]) const;
+
+        // chained from the hash of the parent's suffix (`parent_hash`),
+        // so the hashes of all suffixes of a name are known before
+        // any node of it is looked up
+        static uint64_t _hash_label(uint64_t parent_hash, const std::string& name, size_t start, size_t end);
+
+        // fills _slots under `node`, `covering` lists the rules above it
+        void _index_prefixes(uint32_t node, uint32_t covering);
+
+        bool _matches(uint32_t rule, uint32_t source, uint32_t destination, uint16_t port) const;
+
+        // lower `*best` to the first matching rule
+        void _scan(const RuleList& rules, uint32_t source, uint32_t destination, uint16_t port, uint32_t* best) const;
+        void _scan(uint32_t list, uint32_t source, uint32_t destination, uint16_t port, uint32_t* best) const;
+
+        // `rule` matches except maybe for its destination network
+        bool _matches_name(uint32_t rule, uint32_t source, uint16_t port) const;
+
+        // lower `*best` to the first matching rule without a destination
+        // network and `*pending` to the first one with one before it
+        void _scan_name(const RuleList& rules, uint32_t source, uint16_t port, uint32_t* best, uint32_t* pending) const;
+        void _scan_name(uint32_t rule, uint32_t source, uint16_t port, uint32_t* best, uint32_t* pending) const;
+
+        // parses one rules file line, false if it's invalid
+        static bool _parse_rule(
+            const std::string& line,
+            const std::vector<NetworkInterface>& netifaces,
+            PolicyRule* rule
+        );
+    };
+}
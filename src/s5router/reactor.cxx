@@ -0,0 +1,301 @@
+#include "reactor.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <iostream>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace s5r
+{
+    static constexpr int MAX_EVENTS = 256;
+
+    EventLoop::EventLoop()
+        : _epoll_fd{-1}, _wake_fd{-1}, _running{true}, _next_timer_id{1}
+    {
+        _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (_epoll_fd == -1 || _wake_fd == -1)
+        {
+            return;
+        }
+
+        // handler-less source, recognized by the loop itself
+        _wake_source.fd = _wake_fd;
+        _wake_source.handler = nullptr;
+
+        add(&_wake_source, EPOLLIN);
+    }
+
+    EventLoop::~EventLoop()
+    {
+        if (_wake_fd != -1) ::close(_wake_fd);
+        if (_epoll_fd != -1) ::close(_epoll_fd);
+    }
+
+    bool EventLoop::is_valid() const
+    {
+        return _epoll_fd != -1 && _wake_fd != -1;
+    }
+
+    bool EventLoop::add(EventSource* source, uint32_t events)
+    {
+        source->events = events;
+
+        epoll_event event;
+        event.events = events;
+        event.data.ptr = source;
+
+        return epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, source->fd, &event) == 0;
+    }
+
+    bool EventLoop::modify(EventSource* source, uint32_t events)
+    {
+        if (source->events == events)
+            return true;
+
+        source->events = events;
+
+        epoll_event event;
+        event.events = events;
+        event.data.ptr = source;
+
+        return epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, source->fd, &event) == 0;
+    }
+
+    void EventLoop::remove(EventSource* source)
+    {
+        if (source->fd == -1)
+            return;
+
+        epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, source->fd, nullptr);
+    }
+
+    void EventLoop::post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_posted_mutex);
+            _posted.push_back(std::move(task));
+        }
+
+        _wake();
+    }
+
+    void EventLoop::defer(std::function<void()> task)
+    {
+        _deferred.push_back(std::move(task));
+    }
+
+    uint64_t EventLoop::add_timer(uint32_t timeout_ms, std::function<void()> callback)
+    {
+        uint64_t id = _next_timer_id++;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+        _timers.emplace(TimerKey(deadline, id), std::move(callback));
+        _timer_deadlines.emplace(id, deadline);
+
+        return id;
+    }
+
+    void EventLoop::cancel_timer(uint64_t id)
+    {
+        auto it = _timer_deadlines.find(id);
+
+        if (it == _timer_deadlines.end())
+            return;
+
+        _timers.erase(TimerKey(it->second, id));
+        _timer_deadlines.erase(it);
+    }
+
+    void EventLoop::run()
+    {
+        epoll_event events[MAX_EVENTS];
+
+        while (_running)
+        {
+            int count = epoll_wait(_epoll_fd, events, MAX_EVENTS, _next_timeout());
+
+            if (count == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                std::cerr << "epoll_wait error" << std::endl;
+                break;
+            }
+
+            for (int i = 0; i < count; i++)
+            {
+                EventSource* source = static_cast<EventSource*>(events[i].data.ptr);
+
+                if (source == &_wake_source)
+                {
+                    uint64_t value;
+                    while (::read(_wake_fd, &value, sizeof(value)) > 0);
+
+                    _run_posted();
+                }
+                else if (source->handler)
+                {
+                    source->handler->on_event(source, events[i].events);
+                }
+            }
+
+            _run_timers();
+            _run_deferred();
+        }
+    }
+
+    void EventLoop::stop()
+    {
+        _running = false;
+        _wake();
+    }
+
+    void EventLoop::_wake()
+    {
+        uint64_t value = 1;
+        ::write(_wake_fd, &value, sizeof(value));
+    }
+
+    void EventLoop::_run_posted()
+    {
+        std::vector<std::function<void()>> posted;
+
+        {
+            std::lock_guard<std::mutex> lock(_posted_mutex);
+            posted.swap(_posted);
+        }
+
+        for (auto& task : posted)
+        {
+            task();
+        }
+    }
+
+    void EventLoop::_run_deferred()
+    {
+        // tasks may defer more tasks
+        while (!_deferred.empty())
+        {
+            std::vector<std::function<void()>> deferred;
+            deferred.swap(_deferred);
+
+            for (auto& task : deferred)
+            {
+                task();
+            }
+        }
+    }
+
+    void EventLoop::_run_timers()
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        // callbacks may add or cancel timers, take them one by one
+        while (!_timers.empty() && _timers.begin()->first.first <= now)
+        {
+            auto it = _timers.begin();
+            std::function<void()> callback = std::move(it->second);
+
+            _timer_deadlines.erase(it->first.second);
+            _timers.erase(it);
+
+            callback();
+        }
+    }
+
+    int EventLoop::_next_timeout() const
+    {
+        if (_timers.empty())
+            return -1;
+
+        auto left = _timers.begin()->first.first - std::chrono::steady_clock::now();
+
+        if (left.count() <= 0)
+            return 0;
+
+        // round up so the timer is already due when epoll_wait returns
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(left) + std::chrono::milliseconds(1);
+        return (int)std::min<int64_t>(ms.count(), INT32_MAX);
+    }
+
+    Reactor::Reactor(unsigned int workers)
+        : _next{0}
+    {
+        if (workers == 0)
+        {
+            workers = std::thread::hardware_concurrency();
+        }
+
+        if (workers == 0)
+        {
+            workers = 1;
+        }
+
+        for (unsigned int i = 0; i < workers; i++)
+        {
+            _loops.push_back(std::make_unique<EventLoop>());
+        }
+    }
+
+    Reactor::~Reactor()
+    {
+        stop();
+    }
+
+    bool Reactor::start()
+    {
+        for (auto& loop : _loops)
+        {
+            if (!loop->is_valid())
+            {
+                return false;
+            }
+        }
+
+        for (auto& loop : _loops)
+        {
+            EventLoop* _loop = loop.get();
+            _threads.emplace_back([_loop]() -> void {
+                _loop->run();
+            });
+        }
+
+        return true;
+    }
+
+    void Reactor::stop()
+    {
+        for (auto& loop : _loops)
+        {
+            loop->stop();
+        }
+
+        for (auto& thread : _threads)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+
+        _threads.clear();
+    }
+
+    EventLoop* Reactor::next_loop()
+    {
+        return _loops[_next++ % _loops.size()].get();
+    }
+
+    EventLoop* Reactor::loop(size_t index)
+    {
+        return _loops[index].get();
+    }
+
+    size_t Reactor::size() const
+    {
+        return _loops.size();
+    }
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "common/event.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/epoll.h>
+
+namespace s5r
+{
+    /**
+     * Single threaded epoll loop.
+     * Everything except post() and stop() must be
+     * called from the thread running the loop
+     **/
+    class EventLoop
+    {
+    public:
+        EventLoop();
+        ~EventLoop();
+
+        // false if epoll/eventfd couldn't be created
+        bool is_valid() const;
+
+        bool add(EventSource* source, uint32_t events);
+        bool modify(EventSource* source, uint32_t events);
+        void remove(EventSource* source);
+
+        // queues task to run on the loop thread (thread-safe)
+        void post(std::function<void()> task);
+
+        // runs task after the current batch of events is dispatched,
+        // used to free handlers that may still have pending events
+        void defer(std::function<void()> task);
+
+        // runs callback once on the loop thread after timeout_ms,
+        // returns id for cancel_timer() (never 0)
+        uint64_t add_timer(uint32_t timeout_ms, std::function<void()> callback);
+
+        // no-op if the timer already fired or was cancelled
+        void cancel_timer(uint64_t id);
+
+        // runs the loop (blocking) until stop() is called
+        void run();
+
+        // thread-safe
+        void stop();
+
+    private:
+        int _epoll_fd;
+        int _wake_fd;
+        EventSource _wake_source;
+
+        std::atomic<bool> _running;
+
+        std::mutex _posted_mutex;
+        std::vector<std::function<void()>> _posted;
+        std::vector<std::function<void()>> _deferred;
+
+        using TimerKey = std::pair<std::chrono::steady_clock::time_point, uint64_t>;
+
+        // ordered by deadline, id breaks ties
+        std::map<TimerKey, std::function<void()>> _timers;
+        std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> _timer_deadlines;
+        uint64_t _next_timer_id;
+
+    private:
+        void _wake();
+        void _run_posted();
+        void _run_deferred();
+        void _run_timers();
+
+        // epoll_wait timeout until the closest timer, -1 if none
+        int _next_timeout() const;
+    };
+
+    /**
+     * Fixed pool of worker threads, each running its own EventLoop
+     **/
+    class Reactor
+    {
+    public:
+        // 0 workers picks the number of cores
+        explicit Reactor(unsigned int workers = 0);
+        ~Reactor();
+
+        // spawns worker threads
+        // returns false if any loop couldn't be created
+        bool start();
+
+        // stops all loops and joins worker threads
+        void stop();
+
+        // picks a loop for a new session (round robin)
+        EventLoop* next_loop();
+
+        EventLoop* loop(size_t index);
+
+        size_t size() const;
+
+    private:
+        std::vector<std::unique_ptr<EventLoop>> _loops;
+        std::vector<std::thread> _threads;
+        std::atomic<size_t> _next;
+    };
+}
@@ -0,0 +1,389 @@
+#include "resolver.hpp"
+#include "dns_cache.hpp"
+#include "dns_flights.hpp"
+#include "reactor.hpp"
+#include "utils.hpp"
+#include "common/error.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+
+namespace s5r
+{
+    // datagrams read per wake-up before yielding to other sources
+    static constexpr int DNS_DRAIN_LIMIT = 64;
+
+    // queries in flight per resolver, each leader holds a socket
+    // (or a helper thread), and a free id is always close at hand
+    static constexpr size_t DNS_MAX_QUERIES = 4096;
+
+    Resolver::Resolver(EventLoop* loop, const DnsSettings* settings)
+        : _loop{loop}, _settings{settings}, _liveness{std::make_shared<Liveness>()}, _next_generation{1}
+    {
+    }
+
+    Resolver::~Resolver()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_liveness->mutex);
+            _liveness->alive = false;
+        }
+
+        DnsAnswer failed;
+        failed.status = DnsStatus::Error;
+
+        for (auto& entry : _queries)
+        {
+            _loop->cancel_timer(entry.second.timer);
+
+            // the loop is done, nothing is pending for the socket
+            if (EventSource* source = entry.second.source)
+            {
+                _loop->remove(source);
+                ::close(source->fd);
+                delete source;
+            }
+
+            // don't leave waiters of other loops hanging
+            if (entry.second.leader)
+                DnsFlights::shared().complete(entry.second.name, entry.second.type, failed);
+        }
+    }
+
+    Resolver& Resolver::local(EventLoop* loop, const DnsSettings* settings)
+    {
+        thread_local std::unique_ptr<Resolver> resolver;
+
+        if (!resolver)
+        {
+            resolver.reset(new Resolver(loop, settings));
+        }
+
+        return *resolver;
+    }
+
+    bool Resolver::lookup(const std::string& name, DnsType type, DnsAnswer* answer)
+    {
+        bool refresh = false;
+
+        if (!dns_lookup_local(*_settings, name, type, answer, &refresh))
+            return false;
+
+        // nobody waits for it, the answer just lands in the cache
+        if (refresh)
+            resolve(name, type, nullptr);
+
+        return true;
+    }
+
+    uint64_t Resolver::resolve(const std::string& name, DnsType type, ResolveCallback callback)
+    {
+        if (_queries.size() >= DNS_MAX_QUERIES)
+        {
+            std::cerr << "Too many DNS queries in flight, not resolving " << name << std::endl;
+            return 0;
+        }
+
+        uint16_t dns_id;
+
+        do
+        {
+            dns_id = dns_query_id();
+        } while (_queries.count(dns_id));
+
+        // low 16 bits find the query, the rest tells apart reused ids
+        uint64_t id = (_next_generation++ << 16) | dns_id;
+
+        Query& query = _queries[dns_id];
+        query.id = id;
+        query.name = name;
+        query.type = type;
+        query.callback = std::move(callback);
+        query.leader = false;
+        query.attempt = 0;
+        query.timer = 0;
+        query.source = nullptr;
+        query.message_size = dns_build_query(dns_id, name, type, query.message, sizeof(query.message));
+
+        DnsAnswer answer;
+        bool answered = dns_lookup_hosts(*_settings, name, type, &answer);
+
+        if (query.message_size == -1 && !answered)
+        {
+            answer.status = DnsStatus::NotFound;
+            answered = true;
+        }
+
+        if (answered)
+        {
+            // report on the loop, never from inside resolve()
+            _loop->defer([this, dns_id, id, answer]() -> void {
+                auto it = _queries.find(dns_id);
+
+                if (it == _queries.end() || it->second.id != id)
+                    return;
+
+                _finish(dns_id, answer);
+            });
+
+            return id;
+        }
+
+        // answer comes back posted to this loop, the query is
+        // only kept here so that cancel() works the same way
+        EventLoop* loop = _loop;
+
+        query.leader = DnsFlights::shared().join(name, type, [this, loop, dns_id, id](const DnsAnswer& answer) -> void {
+            loop->post([this, dns_id, id, answer]() -> void {
+                auto it = _queries.find(dns_id);
+
+                if (it == _queries.end() || it->second.id != id)
+                    return;
+
+                _finish(dns_id, answer);
+            });
+        });
+
+        if (query.leader)
+        {
+            if (_settings->servers.empty())
+                _resolve_blocking(&query);
+            else
+                _send(&query);
+        }
+
+        return id;
+    }
+
+    void Resolver::cancel(uint64_t id)
+    {
+        auto it = _queries.find((uint16_t)(id & 0xFFFF));
+
+        if (it == _queries.end() || it->second.id != id)
+            return;
+
+        if (it->second.leader)
+        {
+            it->second.callback = nullptr;
+            return;
+        }
+
+        _loop->cancel_timer(it->second.timer);
+        _queries.erase(it);
+    }
+
+    void Resolver::on_event(EventSource* source, uint32_t)
+    {
+        // closed while its events were pending
+        if (source->fd == -1)
+            return;
+
+        for (int i = 0; i < DNS_DRAIN_LIMIT; i++)
+        {
+            char buffer[DNS_MAX_MESSAGE_SIZE];
+            sockaddr_in from;
+            socklen_t from_len = sizeof(sockaddr_in);
+
+            int size = ::recvfrom(source->fd, buffer, sizeof(buffer), 0, (sockaddr*)&from, &from_len);
+
+            if (size == -1)
+            {
+                if (!socket_would_block())
+                    std::cerr << "Resolver socket recv == -1" << std::endl;
+
+                return;
+            }
+
+            if (size < 2)
+                continue;
+
+            uint16_t dns_id = (uint16_t)(((uint8_t)buffer[0] << 8) | (uint8_t)buffer[1]);
+            auto it = _queries.find(dns_id);
+
+            // answers only count on the socket their query went out on
+            if (it == _queries.end() || it->second.source != source)
+                continue;
+
+            // late answers of earlier attempts are fine, strangers aren't
+            bool known = false;
+
+            for (auto& server : _settings->servers)
+            {
+                if (server.sin_addr.s_addr == from.sin_addr.s_addr && server.sin_port == from.sin_port)
+                {
+                    known = true;
+                    break;
+                }
+            }
+
+            Query& query = it->second;
+            DnsAnswer answer;
+
+            if (!known || !dns_parse_response(buffer, size, dns_id, query.name, query.type, &answer))
+                continue;
+
+            if (answer.status == DnsStatus::ServerFailure
+                && query.attempt < _settings->retries + 1)
+            {
+                // ask the next upstream right away
+                _loop->cancel_timer(query.timer);
+                _send(&query);
+                continue;
+            }
+
+            // the socket is closed along with the query
+            _complete(dns_id, answer);
+            return;
+        }
+    }
+
+    void Resolver::_send(Query* query)
+    {
+        const sockaddr_in& server = _settings->servers[query->attempt % _settings->servers.size()];
+        query->attempt++;
+
+        // failed sends are retried like lost datagrams
+        if (query->source || _open_socket(query))
+        {
+            ::sendto(query->source->fd, query->message, query->message_size, 0, (sockaddr*)&server, sizeof(sockaddr_in));
+        }
+
+        uint16_t dns_id = (uint16_t)(query->id & 0xFFFF);
+        query->timer = _loop->add_timer(_settings->timeout_ms, [this, dns_id]() -> void {
+            _on_timeout(dns_id);
+        });
+    }
+
+    void Resolver::_resolve_blocking(Query* query)
+    {
+        std::shared_ptr<Liveness> liveness = _liveness;
+        EventLoop* loop = _loop;
+        uint16_t dns_id = (uint16_t)(query->id & 0xFFFF);
+        uint64_t id = query->id;
+        std::string name = query->name;
+        DnsType type = query->type;
+
+        std::thread([this, liveness, loop, dns_id, id, name, type]() -> void {
+            // hosts were looked up already, no upstreams means getaddrinfo()
+            DnsAnswer answer;
+            dns_resolve(DnsSettings(), name, type, &answer);
+
+            DnsCache::shared().insert(name, type, answer);
+            DnsFlights::shared().complete(name, type, answer);
+
+            std::lock_guard<std::mutex> lock(liveness->mutex);
+
+            if (!liveness->alive)
+                return;
+
+            loop->post([this, dns_id, id, answer]() -> void {
+                auto it = _queries.find(dns_id);
+
+                if (it == _queries.end() || it->second.id != id)
+                    return;
+
+                _finish(dns_id, answer);
+            });
+        }).detach();
+    }
+
+    bool Resolver::_open_socket(Query* query)
+    {
+        // a fresh socket gets a random ephemeral port
+        int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (sock == -1)
+        {
+            std::cerr << "Couldn't create resolver socket" << std::endl;
+            return false;
+        }
+
+        EventSource* source = new EventSource();
+        source->fd = sock;
+        source->handler = this;
+
+        if (!_loop->add(source, EPOLLIN))
+        {
+            std::cerr << "Couldn't register resolver socket" << std::endl;
+            ::close(sock);
+            delete source;
+            return false;
+        }
+
+        query->source = source;
+        return true;
+    }
+
+    void Resolver::_close_socket(Query* query)
+    {
+        EventSource* source = query->source;
+
+        if (!source)
+            return;
+
+        _loop->remove(source);
+        ::close(source->fd);
+        source->fd = -1;
+        query->source = nullptr;
+
+        // events for it may still be pending in the current batch
+        _loop->defer([source]() -> void {
+            delete source;
+        });
+    }
+
+    void Resolver::_on_timeout(uint16_t dns_id)
+    {
+        auto it = _queries.find(dns_id);
+
+        if (it == _queries.end())
+            return;
+
+        it->second.timer = 0;
+
+        if (it->second.attempt >= _settings->retries + 1)
+        {
+            DnsAnswer answer;
+            answer.status = DnsStatus::Timeout;
+
+            _complete(dns_id, answer);
+            return;
+        }
+
+        _send(&it->second);
+    }
+
+    void Resolver::_complete(uint16_t dns_id, const DnsAnswer& answer)
+    {
+        auto it = _queries.find(dns_id);
+
+        if (it == _queries.end())
+            return;
+
+        DnsCache::shared().insert(it->second.name, it->second.type, answer);
+        DnsFlights::shared().complete(it->second.name, it->second.type, answer);
+
+        _finish(dns_id, answer);
+    }
+
+    void Resolver::_finish(uint16_t dns_id, const DnsAnswer& answer)
+    {
+        auto it = _queries.find(dns_id);
+
+        if (it == _queries.end())
+            return;
+
+        _loop->cancel_timer(it->second.timer);
+        _close_socket(&it->second);
+
+        // callback may start or cancel queries
+        ResolveCallback callback = std::move(it->second.callback);
+        _queries.erase(it);
+
+        if (callback)
+            callback(answer);
+    }
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "common/event.hpp"
+#include "dns.hpp"
+#include "settings.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace s5r
+{
+    class EventLoop;
+
+    using ResolveCallback = std::function<void(const DnsAnswer& answer)>;
+
+    /**
+     * Non-blocking DNS client driven by an EventLoop.
+     * Each query goes to the configured upstreams over a UDP socket
+     * of its own, so its source port is as random as its id, and is
+     * retried on the next upstream after a timeout.
+     * Lookups of a name already in flight anywhere in the process
+     * wait for that answer instead of sending their own query.
+     * Without upstreams getaddrinfo() runs on a helper thread.
+     * Not thread-safe, one resolver per loop (see local())
+     **/
+    class Resolver : public EventHandler
+    {
+    public:
+        Resolver(EventLoop* loop, const DnsSettings* settings);
+        ~Resolver();
+
+        Resolver(const Resolver&) = delete;
+        Resolver& operator=(const Resolver&) = delete;
+
+        // resolver of the calling loop thread, created on first use
+        static Resolver& local(EventLoop* loop, const DnsSettings* settings);
+
+        // hosts file or shared cache answer without a query,
+        // hot entries about to expire are refreshed in the background
+        bool lookup(const std::string& name, DnsType type, DnsAnswer* answer);
+
+        // callback always runs later on the loop thread, returns id
+        // for cancel(). 0 if too many queries are in flight, the
+        // callback isn't called then
+        uint64_t resolve(const std::string& name, DnsType type, ResolveCallback callback);
+
+        // callback won't be called, no-op for finished queries
+        void cancel(uint64_t id);
+
+        void on_event(EventSource* source, uint32_t events) override;
+
+    private:
+        struct Query
+        {
+            uint64_t id;
+            std::string name;
+            DnsType type;
+            ResolveCallback callback;
+
+            // sends the upstream query others wait for, keeps
+            // going after its own caller cancels
+            bool leader;
+
+            char message[DNS_MAX_MESSAGE_SIZE];
+            int message_size;
+
+            // sends so far, upstream is picked by it
+            unsigned int attempt;
+            uint64_t timer;
+
+            // opened by the first send, nullptr until then
+            EventSource* source;
+        };
+
+        // helper threads post answers only while it's alive
+        struct Liveness
+        {
+            std::mutex mutex;
+            bool alive = true;
+        };
+
+        EventLoop* _loop;
+        const DnsSettings* _settings;
+        std::shared_ptr<Liveness> _liveness;
+
+        // in flight, keyed by DNS message id
+        std::unordered_map<uint16_t, Query> _queries;
+        uint64_t _next_generation;
+
+    private:
+        // (re)sends query to its next upstream and arms the timeout
+        void _send(Query* query);
+
+        // getaddrinfo() on a helper thread, for want of upstreams
+        void _resolve_blocking(Query* query);
+
+        // false if the socket couldn't be created
+        bool _open_socket(Query* query);
+        void _close_socket(Query* query);
+        void _on_timeout(uint16_t dns_id);
+
+        // caches upstream answer and hands it to everyone waiting
+        void _complete(uint16_t dns_id, const DnsAnswer& answer);
+        void _finish(uint16_t dns_id, const DnsAnswer& answer);
+    };
+}
@@ -0,0 +1,180 @@
+#include "ring_buffer.hpp"
+#include "buffer_pool.hpp"
+#include "common/net.hpp"
+
+#include <cerrno>
+
+namespace s5r
+{
+    static size_t _round_up_pow2(size_t value)
+    {
+        size_t result = 1;
+
+        while (result < value)
+        {
+            result <<= 1;
+        }
+
+        return result;
+    }
+
+    RingBuffer::RingBuffer(size_t capacity)
+        : _data{nullptr},
+          _mask{_round_up_pow2(capacity) - 1},
+          _head{0},
+          _tail{0}
+    {
+    }
+
+    RingBuffer::~RingBuffer()
+    {
+        _release();
+    }
+
+    size_t RingBuffer::capacity() const
+    {
+        return _mask + 1;
+    }
+
+    bool RingBuffer::resize(size_t capacity)
+    {
+        if (!empty())
+            return false;
+
+        // empty rings hold no memory, nothing to move
+        _release();
+        _mask = _round_up_pow2(capacity) - 1;
+        return true;
+    }
+
+    size_t RingBuffer::size() const
+    {
+        return _tail - _head;
+    }
+
+    bool RingBuffer::empty() const
+    {
+        return _tail == _head;
+    }
+
+    bool RingBuffer::full() const
+    {
+        return size() == capacity();
+    }
+
+    char* RingBuffer::write_ptr(size_t* len)
+    {
+        if (!_data)
+        {
+            size_t borrowed;
+            _data = BufferPool::shared().acquire(capacity(), &borrowed);
+
+            if (!_data)
+            {
+                *len = 0;
+                return nullptr;
+            }
+        }
+
+        size_t offset = _tail & _mask;
+        size_t free = capacity() - size();
+        size_t until_end = capacity() - offset;
+
+        *len = free < until_end ? free : until_end;
+        return _data + offset;
+    }
+
+    void RingBuffer::produce(size_t len)
+    {
+        _tail += len;
+    }
+
+    const char* RingBuffer::read_ptr(size_t* len) const
+    {
+        size_t offset = _head & _mask;
+        size_t until_end = capacity() - offset;
+
+        *len = size() < until_end ? size() : until_end;
+        return _data + offset;
+    }
+
+    void RingBuffer::consume(size_t len)
+    {
+        _head += len;
+
+        // restart at the beginning so reads stay contiguous,
+        // idle rings hold no memory
+        if (_head == _tail)
+        {
+            _head = 0;
+            _tail = 0;
+            _release();
+        }
+    }
+
+    int RingBuffer::recv(int sock, int flags)
+    {
+        size_t len;
+        char* ptr = write_ptr(&len);
+
+        if (!ptr)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        int size = ::recv(sock, ptr, (int)len, flags);
+
+        if (size > 0)
+        {
+            produce(size);
+        }
+        else if (empty())
+        {
+            // nothing came (EAGAIN, eof), an idle ring holds no memory
+            int error = errno;
+            _release();
+            errno = error;
+        }
+
+        return size;
+    }
+
+    int RingBuffer::send(int sock, int flags)
+    {
+        int total = 0;
+
+        // at most two chunks when the data wraps around
+        while (!empty())
+        {
+            size_t len;
+            const char* ptr = read_ptr(&len);
+
+            int sent = ::send(sock, ptr, (int)len, flags);
+
+            if (sent == -1)
+            {
+                return total > 0 ? total : -1;
+            }
+
+            consume(sent);
+            total += sent;
+
+            if ((size_t)sent < len)
+            {
+                break;
+            }
+        }
+
+        return total;
+    }
+
+    void RingBuffer::_release()
+    {
+        if (!_data)
+            return;
+
+        BufferPool::shared().release(_data, capacity());
+        _data = nullptr;
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+
+namespace s5r
+{
+    // default capacity of relay ring buffers (per direction)
+    static constexpr size_t RING_BUFFER_SIZE = 16384;
+
+    /**
+     * Fixed capacity byte ring buffer used by TCP relays.
+     * Data is read from one socket into the free space and
+     * sent to the other socket from the used space, partial
+     * sends just leave the rest in the buffer.
+     * Memory is borrowed from BufferPool while the ring holds
+     * data and given back as soon as it is drained or a read
+     * into the empty ring returned nothing
+     **/
+    class RingBuffer
+    {
+    public:
+        // capacity is rounded up to a power of two,
+        // memory is borrowed on write
+        explicit RingBuffer(size_t capacity = RING_BUFFER_SIZE);
+        ~RingBuffer();
+
+        RingBuffer(const RingBuffer&) = delete;
+        RingBuffer& operator=(const RingBuffer&) = delete;
+
+        size_t capacity() const;
+
+        // changes capacity (rounded up to a power of two),
+        // only possible while empty
+        bool resize(size_t capacity);
+
+        // bytes waiting to be sent
+        size_t size() const;
+
+        bool empty() const;
+        bool full() const;
+
+        // contiguous free space, call produce() after writing to it,
+        // nullptr if no memory could be borrowed
+        char* write_ptr(size_t* len);
+        void produce(size_t len);
+
+        // contiguous used space, call consume() after it was sent
+        const char* read_ptr(size_t* len) const;
+        void consume(size_t len);
+
+        // single recv() into the free space, returns recv() result
+        // (-1 with ENOMEM if no memory could be borrowed).
+        // Must not be called on a full buffer
+        int recv(int sock, int flags = 0);
+
+        // sends as much of the used space as the socket accepts,
+        // returns bytes sent or -1 (check socket error for EAGAIN)
+        int send(int sock, int flags = 0);
+
+    private:
+        char* _data;
+        size_t _mask;
+
+        // monotonic positions, wrapped with _mask on access
+        size_t _head;
+        size_t _tail;
+
+    private:
+        // returns _data to the pool, only when empty
+        void _release();
+    };
+}
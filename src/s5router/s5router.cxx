@@ -1,7 +1,18 @@
 #include "s5router.hpp"
+#include "dns.hpp"
+#include "dns_cache.hpp"
 #include "socks5.hpp"
 #include "common/poll.hpp"
 
+#ifdef __linux__
+    #include "listener.hpp"
+    #include "reactor.hpp"
+    #include "uring.hpp"
+    #include <netinet/tcp.h>
+    #include <signal.h>
+#endif
+
+#include <chrono>
 #include <iostream> // I know including this is a bad idea but whatever
 #include <stdexcept>
 #include <thread>
@@ -36,11 +47,18 @@ namespace s5r
     S5Router::S5Router(
         uint16_t server_port,
         in_addr server_ip,
-        in_addr route_ip
+        in_addr route_ip,
+        const S5Settings& settings
     ) : _server_port{server_port},
         _server_ip{server_ip},
         _route_ip{route_ip},
-        _running{false}
+        _settings{settings},
+        _running{false},
+        _sessions{settings.session_slab_size, settings.session_slabs, settings.session_slabs_max}
+#ifdef __linux__
+        , _reactor{nullptr}
+        , _serve_on_shard{false}
+#endif
     {
 #ifdef _WIN32
         _initialize();
@@ -52,7 +70,7 @@ namespace s5r
         std::vector<NetworkInterface> netifaces;
         get_netifaces(&netifaces);
 
-        std::vector<int> server_socks;
+        std::vector<in_addr> listen_addrs;
         in_addr route_ip = _route_ip;
 
         if (_server_ip.s_addr == 0)
@@ -64,9 +82,7 @@ namespace s5r
 
                 for (auto addr : netiface.addrs)
                 {
-                    server_socks.push_back(
-                        _open_server_socket(addr)
-                    );
+                    listen_addrs.push_back(addr);
                 }
             }
         }
@@ -83,14 +99,7 @@ namespace s5r
                 return false;
             }
 
-            server_socks.push_back(
-                _open_server_socket(_server_ip)
-            );
-        }
-
-        if (server_socks.empty())
-        {
-            return false;
+            listen_addrs.push_back(_server_ip);
         }
 
         if (route_ip.s_addr == 0)
@@ -116,23 +125,220 @@ namespace s5r
             }
         }
 
+        PolicyTable& policy = PolicyTable::shared();
+        policy.clear();
+
+        if (!_settings.rules_file.empty())
+        {
+            if (!policy.load(_settings.rules_file.c_str(), netifaces))
+            {
+                return false;
+            }
+
+            std::cout << "Policy rules: " << policy.stats().rules << std::endl;
+        }
+
+        DnsCache::shared().configure(_settings.dns);
+        MemoryBudget::shared().configure(_settings.memory_budget);
+
+        if (_settings.dns.hosts.empty())
+        {
+            dns_load_hosts("/etc/hosts", &_settings.dns.hosts);
+        }
+
+        if (_settings.dns.servers.empty())
+        {
+            dns_load_resolv_conf("/etc/resolv.conf", &_settings.dns.servers);
+
+            if (_settings.dns.servers.empty())
+            {
+                std::cerr << "Warning: no nameservers found, falling back to getaddrinfo" << std::endl;
+            }
+        }
+
+#ifdef __linux__
+        // peers closing mid-send must not kill the process
+        signal(SIGPIPE, SIG_IGN);
+
+        if (_settings.run_mode == RunMode::Reactor)
+        {
+            _reactor = new Reactor(_settings.workers);
+
+            if (!_reactor->start())
+            {
+                std::cerr << "Couldn't start reactor workers" << std::endl;
+                delete _reactor;
+                _reactor = nullptr;
+                return false;
+            }
+
+            std::cout << "Reactor workers: " << _reactor->size() << std::endl;
+
+            _start_pools(listen_addrs, route_ip);
+
+            bool result = _run_sharded(listen_addrs, route_ip);
+
+            _reactor->stop();
+            delete _reactor;
+            _reactor = nullptr;
+
+            _stop_pools();
+            return result;
+        }
+#endif
+
+        std::vector<int> server_socks;
+
+        for (auto addr : listen_addrs)
+        {
+            int sock = _open_server_socket(addr);
+
+            if (sock)
+            {
+                server_socks.push_back(sock);
+            }
+        }
+
+        if (server_socks.empty())
+        {
+            return false;
+        }
+
         int socks[server_socks.size()];
         for (int i = 0; i < server_socks.size(); i++)
         {
             socks[i] = server_socks[i];
         }
 
+        _start_pools(listen_addrs, route_ip);
+
+#ifdef __linux__
+        // UDP associations leave their session threads for these
+        if (_settings.udp_workers > 0)
+        {
+            if (UdpAssociations::shared().start(_settings.udp_workers))
+            {
+                std::cout << "UDP workers: " << UdpAssociations::shared().workers() << std::endl;
+            }
+            else
+            {
+                std::cerr << "Couldn't start UDP workers, associations get their own threads" << std::endl;
+            }
+        }
+#endif
+
         // Server loop here
         _running = true;
         _server_loop(socks, server_socks.size(), route_ip);
 
+#ifdef __linux__
+        UdpAssociations::shared().stop();
+#endif
+
         for (int i = 0; i < server_socks.size(); i++)
         {
             ::close(socks[i]);
         }
 
+        _stop_pools();
+        return true;
+    }
+
+    void S5Router::_start_pools(const std::vector<in_addr>& listen_addrs, in_addr route_ip)
+    {
+        UdpSocketPool& udp_sockets = UdpSocketPool::shared();
+        udp_sockets.configure(_settings.udp_socket_pool, _settings.udp_client_ports, _settings.udp_route_ports);
+        udp_sockets.fill(UdpSocketSide::Route, route_ip);
+
+        for (auto addr : listen_addrs)
+        {
+            udp_sockets.fill(UdpSocketSide::Client, addr);
+        }
+
+        UpstreamPool& upstreams = UpstreamPool::shared();
+        upstreams.configure(
+            _settings.upstream_pool,
+            _settings.upstream_pool_destinations,
+            _settings.upstream_pool_idle_ms
+        );
+        upstreams.start(route_ip);
+    }
+
+    void S5Router::_stop_pools()
+    {
+        UpstreamPool::shared().stop();
+        UdpSocketPool::shared().clear();
+    }
+
+#ifdef __linux__
+    bool S5Router::_run_sharded(const std::vector<in_addr>& listen_addrs, in_addr route_ip)
+    {
+        unsigned int shards = _settings.shards;
+
+        if (shards == 0)
+        {
+            shards = _reactor->size();
+        }
+
+        // every worker accepts for itself, otherwise
+        // shard owners hand clients out round robin
+        _serve_on_shard = shards >= _reactor->size();
+
+        std::vector<Listener*> listeners;
+
+        for (auto addr : listen_addrs)
+        {
+            for (unsigned int i = 0; i < shards; i++)
+            {
+                int sock = _open_server_socket(addr, true);
+
+                if (!sock)
+                {
+                    continue;
+                }
+
+                set_socket_nonblocking(sock);
+
+                EventLoop* loop = _reactor->loop(i % _reactor->size());
+                Listener* listener = new Listener(sock, loop,
+                    [this, route_ip](const sockaddr_in& addr, int cl_sock, EventLoop* loop) -> void {
+                        _dispatch_client(addr, cl_sock, route_ip, loop);
+                    }
+                );
+
+                loop->post([listener]() -> void {
+                    listener->start();
+                });
+
+                listeners.push_back(listener);
+            }
+        }
+
+        if (listeners.empty())
+        {
+            return false;
+        }
+
+        std::cout << "Listening shards: " << shards << std::endl;
+
+        _running = true;
+
+        while (_running)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+
+        // loops must be stopped before listeners go away
+        _reactor->stop();
+
+        for (Listener* listener : listeners)
+        {
+            delete listener;
+        }
+
         return true;
     }
+#endif
 
     void S5Router::stop()
     {
@@ -144,8 +350,75 @@ namespace s5r
         return _running;
     }
 
+    DnsCacheStats S5Router::dns_cache_stats() const
+    {
+        return DnsCache::shared().stats();
+    }
+
+    DnsFlightStats S5Router::dns_flight_stats() const
+    {
+        return DnsFlights::shared().stats();
+    }
+
+    SessionPoolStats S5Router::session_stats() const
+    {
+        return _sessions.stats();
+    }
+
+    BufferPoolStats S5Router::buffer_stats() const
+    {
+        return BufferPool::shared().stats();
+    }
+
+    MemoryStats S5Router::memory_stats() const
+    {
+        return MemoryBudget::shared().stats();
+    }
+
+    void S5Router::for_each_session(const std::function<void(const Socks5Proxy& proxy)>& visit) const
+    {
+        _sessions.for_each(visit);
+    }
+
+    UdpAssociationStats S5Router::udp_association_stats() const
+    {
+        return UdpAssociations::shared().stats();
+    }
+
+    void S5Router::for_each_udp_association(const std::function<void(const UdpAssociationInfo& info)>& visit) const
+    {
+        UdpAssociations::shared().for_each(visit);
+    }
+
+    UdpFragmentStats S5Router::udp_fragment_stats() const
+    {
+        return UdpFragments::stats();
+    }
+
+    UdpSocketPoolStats S5Router::udp_socket_stats() const
+    {
+        return UdpSocketPool::shared().stats();
+    }
+
+    PolicyStats S5Router::policy_stats() const
+    {
+        return PolicyTable::shared().stats();
+    }
+
+    UpstreamPoolStats S5Router::upstream_stats() const
+    {
+        return UpstreamPool::shared().stats();
+    }
+
     void S5Router::_server_loop(int socks[], int sock_count, in_addr route_ip)
     {
+#ifdef __linux__
+        if (_settings.io_uring && _server_loop_uring(socks, sock_count, route_ip))
+        {
+            return;
+        }
+#endif
+
         pollfd fds[sock_count];
 
         for (int i = 0; i < sock_count; i++)
@@ -182,11 +455,7 @@ namespace s5r
 
                         if (cl_sock != -1)
                         {
-                            Socks5Proxy* proxy = new Socks5Proxy(addr, cl_sock, route_ip);
-                            std::thread th([](void* _proxy) -> void {
-                                ((Socks5Proxy*)_proxy)->serve();
-                            }, (void*)proxy);
-                            th.detach();
+                            _dispatch_client(addr, cl_sock, route_ip);
                         }
                         else
                         {
@@ -206,10 +475,197 @@ namespace s5r
         }
     }
 
-    int S5Router::_open_server_socket(in_addr address)
+#ifdef __linux__
+    bool S5Router::_server_loop_uring(int socks[], int sock_count, in_addr route_ip)
+    {
+        if (!URing::is_supported())
+            return false;
+
+        URing ring;
+
+        // one accept per listening socket + timeout,
+        // twice that for cancelling them all on exit
+        if (!ring.init(2 * (sock_count + 1)))
+            return false;
+
+        // user_data of the timeout used to re-check _running
+        const uint64_t TIMEOUT_TAG = sock_count;
+
+        std::vector<sockaddr_in> addrs(sock_count);
+        std::vector<socklen_t> addr_lens(sock_count);
+        __kernel_timespec timeout = {2, 0};
+        int inflight = 0;
+
+        auto submit_accept = [&](int i) -> void {
+            addr_lens[i] = sizeof(sockaddr_in);
+            URing::prep_accept(ring.get_sqe(), socks[i], (sockaddr*)&addrs[i], &addr_lens[i], i);
+            inflight++;
+        };
+
+        auto submit_timeout = [&]() -> void {
+            URing::prep_timeout(ring.get_sqe(), &timeout, TIMEOUT_TAG);
+            inflight++;
+        };
+
+        for (int i = 0; i < sock_count; i++)
+        {
+            submit_accept(i);
+        }
+
+        submit_timeout();
+
+        while (_running)
+        {
+            if (ring.submit_and_wait(1) == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                stop();
+                break;
+            }
+
+            while (io_uring_cqe* cqe = ring.peek_cqe())
+            {
+                uint64_t i = cqe->user_data;
+                int result = cqe->res;
+
+                ring.cqe_seen();
+                inflight--;
+
+                if (i == TIMEOUT_TAG)
+                {
+                    // time out
+                    submit_timeout();
+                    continue;
+                }
+
+                if (result >= 0)
+                {
+                    _dispatch_client(addrs[i], result, route_ip);
+                }
+                else if (result == -EBADF || result == -EINVAL || result == -ENOTSOCK)
+                {
+                    std::cerr << "Socket error when accepting" << std::endl;
+                    stop();
+                    continue;
+                }
+                else
+                {
+                    std::cerr << "Couldn't accept socket connection" << std::endl;
+                }
+
+                submit_accept(i);
+            }
+        }
+
+        // kernel may still write into addrs, wait for cancellations
+        for (int i = 0; i <= sock_count; i++)
+        {
+            io_uring_sqe* sqe = ring.get_sqe();
+
+            if (sqe)
+                URing::prep_cancel(sqe, i, UINT64_MAX);
+        }
+
+        while (inflight > 0)
+        {
+            if (ring.submit_and_wait(1) == -1 && errno != EINTR)
+                break;
+
+            while (io_uring_cqe* cqe = ring.peek_cqe())
+            {
+                if (cqe->user_data != UINT64_MAX)
+                {
+                    if (cqe->res >= 0 && cqe->user_data != TIMEOUT_TAG)
+                        ::close(cqe->res);
+
+                    inflight--;
+                }
+
+                ring.cqe_seen();
+            }
+        }
+
+        return true;
+    }
+#endif
+
+    void S5Router::_dispatch_client(const sockaddr_in& addr, int cl_sock, in_addr route_ip, EventLoop* loop)
+    {
+        Socks5Proxy* proxy = _sessions.create(addr, cl_sock, route_ip, &_settings);
+
+        if (!proxy)
+        {
+            std::cerr << "Session limit reached, refusing client" << std::endl;
+            ::shutdown(cl_sock, SD_BOTH);
+            ::close(cl_sock);
+            return;
+        }
+
+#ifdef __linux__
+        if (loop && _serve_on_shard)
+        {
+            proxy->start(loop);
+            return;
+        }
+
+        if (_reactor)
+        {
+            if (!loop && set_socket_nonblocking(cl_sock) == -1)
+            {
+                std::cerr << "Couldn't make client socket non-blocking" << std::endl;
+                SessionPool::destroy(proxy);
+                return;
+            }
+
+            loop = _reactor->next_loop();
+            loop->post([proxy, loop]() -> void {
+                proxy->start(loop);
+            });
+            return;
+        }
+#endif
+
+        std::thread th([](void* _proxy) -> void {
+            ((Socks5Proxy*)_proxy)->serve();
+        }, (void*)proxy);
+        th.detach();
+    }
+
+    int S5Router::_open_server_socket(in_addr address, bool reuse_port)
     {
         int sock = socket(AF_INET, SOCK_STREAM, 0);
 
+        if (sock == -1)
+        {
+            return 0;
+        }
+
+#ifdef __linux__
+        // allow restarting while old connections are in TIME_WAIT
+        int reuse = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        // kernel balances connections between sockets bound to the same port
+        if (reuse_port
+            && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1)
+        {
+            ::close(sock);
+            return 0;
+        }
+
+        // pending fast open connections a listener holds, the
+        // kernel falls back to a plain handshake beyond that
+        int fastopen_queue = 256;
+
+        if (_settings.tcp_fastopen
+            && setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_queue, sizeof(fastopen_queue)) == -1)
+        {
+            std::cerr << "Couldn't enable TCP Fast Open on the listening socket" << std::endl;
+        }
+#endif
+
         sockaddr_in sock_addr;
         sock_addr.sin_family = AF_INET;
         sock_addr.sin_port = htons(this->_server_port);
@@ -217,11 +673,13 @@ namespace s5r
 
         if (::bind(sock, (sockaddr*)&sock_addr, sizeof(sockaddr_in)) == -1)
         {
+            ::close(sock);
             return 0;
         }
 
         if (::listen(sock, 4096) == -1)
         {
+            ::close(sock);
             return 0;
         }
 
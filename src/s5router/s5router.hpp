@@ -1,11 +1,29 @@
 #pragma once
 
 #include "common/net.hpp"
+#include "buffer_pool.hpp"
+#include "dns_cache.hpp"
+#include "dns_flights.hpp"
+#include "memory_budget.hpp"
+#include "policy.hpp"
+#include "session_pool.hpp"
+#include "settings.hpp"
+#include "udp_associations.hpp"
+#include "udp_fragments.hpp"
+#include "udp_socket_pool.hpp"
+#include "upstream_pool.hpp"
 #include "utils.hpp"
 #include <cstdint>
 
 namespace s5r
 {
+    // only defined on Linux, _dispatch_client() passes nullptr elsewhere
+    class EventLoop;
+
+#ifdef __linux__
+    class Reactor;
+#endif
+
     class S5Router
     {
     public:
@@ -19,7 +37,10 @@ namespace s5r
 
             // no routing, act like transparent proxy
             // defaults to 0.0.0.0
-            in_addr route_ip = {0}
+            in_addr route_ip = {0},
+
+            // run mode and tuning
+            const S5Settings& settings = S5Settings()
         );
 
         // runs the server (blocking)
@@ -32,18 +53,86 @@ namespace s5r
         // checks if server is currently running
         bool is_running();
 
+        // counters of the shared DNS cache
+        DnsCacheStats dns_cache_stats() const;
+
+        // upstream DNS lookups and how many more were coalesced into them
+        DnsFlightStats dns_flight_stats() const;
+
+        SessionPoolStats session_stats() const;
+
+        // memory of the shared relay buffer pool
+        BufferPoolStats buffer_stats() const;
+
+        // accounted memory against the configured budget
+        MemoryStats memory_stats() const;
+
+        // walks sessions being served, see SessionPool::for_each()
+        void for_each_session(const std::function<void(const Socks5Proxy& proxy)>& visit) const;
+
+        UdpAssociationStats udp_association_stats() const;
+
+        // walks open UDP associations with their counters
+        void for_each_udp_association(const std::function<void(const UdpAssociationInfo& info)>& visit) const;
+
+        // reassembly of fragmented client datagrams
+        UdpFragmentStats udp_fragment_stats() const;
+
+        // bound sockets handed to UDP associations
+        UdpSocketPoolStats udp_socket_stats() const;
+
+        // requests per action of the policy rules
+        PolicyStats policy_stats() const;
+
+        // connected route sockets kept for hot destinations
+        UpstreamPoolStats upstream_stats() const;
+
     private:
         uint16_t _server_port;
         in_addr _server_ip;
         in_addr _route_ip;
+        S5Settings _settings;
 
     private:
         bool _running;
 
+        SessionPool _sessions;
+
+#ifdef __linux__
+        // set while running in RunMode::Reactor
+        Reactor* _reactor;
+
+        // clients accepted by a shard stay on its loop
+        bool _serve_on_shard;
+#endif
+
     private:
         void _server_loop(int socks[], int sock_count, in_addr route_ip);
 
-        int _open_server_socket(in_addr address);
+        // pre-binds UDP sockets and starts the upstream pool thread,
+        // only once nothing is left that can fail start-up
+        void _start_pools(const std::vector<in_addr>& listen_addrs, in_addr route_ip);
+        void _stop_pools();
+
+#ifdef __linux__
+        // accepts through io_uring, returns false if it isn't available
+        bool _server_loop_uring(int socks[], int sock_count, in_addr route_ip);
+
+        // reactor mode: every worker accepts on its own SO_REUSEPORT
+        // listeners, blocks until stopped
+        bool _run_sharded(const std::vector<in_addr>& listen_addrs, in_addr route_ip);
+#endif
+
+        // hands accepted client over to a worker or a new thread,
+        // `loop` is the reactor loop of the shard that accepted it
+        void _dispatch_client(
+            const sockaddr_in& addr,
+            int cl_sock,
+            in_addr route_ip,
+            EventLoop* loop = nullptr
+        );
+
+        int _open_server_socket(in_addr address, bool reuse_port = false);
 
     private:
         // Helpers/Utils
@@ -0,0 +1,142 @@
+#include "session_pool.hpp"
+#include "memory_budget.hpp"
+
+#include <algorithm>
+#include <new>
+
+namespace s5r
+{
+    SessionPool::SessionPool(size_t slab_size, size_t slabs, size_t max_slabs)
+        : _slab_size{std::max<size_t>(1, slab_size)},
+          _max_slabs{max_slabs},
+          _free{nullptr},
+          _live{nullptr},
+          _live_count{0},
+          _peak{0}
+    {
+        for (size_t i = 0; i < slabs; i++)
+        {
+            if (!_grow())
+                break;
+        }
+    }
+
+    SessionPool::~SessionPool()
+    {
+        // detached tunnel threads may still run their sessions,
+        // their slabs can't be freed under them
+        if (_live_count)
+        {
+            for (auto& slab : _slabs)
+            {
+                slab.release();
+            }
+
+            return;
+        }
+
+        MemoryBudget::shared().release(MemoryUse::Sessions, _slabs.size() * _slab_size * sizeof(Slot));
+    }
+
+    Socks5Proxy* SessionPool::create(const sockaddr_in& cl_addr, int sock, in_addr route_ip, const S5Settings* settings)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (!_free && !_grow())
+            return nullptr;
+
+        Slot* slot = _free;
+        _free = slot->next;
+
+        // constructed before it's linked, for_each() only sees whole sessions
+        Socks5Proxy* proxy = new (slot->storage) Socks5Proxy(cl_addr, sock, route_ip, settings);
+
+        slot->prev = nullptr;
+        slot->next = _live;
+
+        if (_live)
+            _live->prev = slot;
+
+        _live = slot;
+
+        _live_count++;
+        _peak = std::max(_peak, _live_count);
+
+        return proxy;
+    }
+
+    void SessionPool::destroy(Socks5Proxy* proxy)
+    {
+        Slot* slot = reinterpret_cast<Slot*>(proxy);
+        slot->pool->_release(slot);
+    }
+
+    void SessionPool::for_each(const std::function<void(const Socks5Proxy& proxy)>& visit) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        for (Slot* slot = _live; slot; slot = slot->next)
+        {
+            visit(*reinterpret_cast<const Socks5Proxy*>(slot->storage));
+        }
+    }
+
+    SessionPoolStats SessionPool::stats() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        SessionPoolStats stats;
+        stats.live = _live_count;
+        stats.peak = _peak;
+        stats.capacity = _slabs.size() * _slab_size;
+        stats.slabs = _slabs.size();
+
+        return stats;
+    }
+
+    bool SessionPool::_grow()
+    {
+        if (_max_slabs && _slabs.size() >= _max_slabs)
+            return false;
+
+        std::unique_ptr<Slot[]> slab(new (std::nothrow) Slot[_slab_size]);
+
+        if (!slab)
+            return false;
+
+        // pushed in reverse so the slab is handed out in order
+        for (size_t i = _slab_size; i-- > 0;)
+        {
+            slab[i].pool = this;
+            slab[i].prev = nullptr;
+            slab[i].next = _free;
+            _free = &slab[i];
+        }
+
+        _slabs.push_back(std::move(slab));
+        MemoryBudget::shared().charge(MemoryUse::Sessions, _slab_size * sizeof(Slot));
+        return true;
+    }
+
+    void SessionPool::_release(Slot* slot)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (slot->prev)
+            slot->prev->next = slot->next;
+        else
+            _live = slot->next;
+
+        if (slot->next)
+            slot->next->prev = slot->prev;
+
+        // unlinked before it's destroyed, under the lock for_each() holds
+        reinterpret_cast<Socks5Proxy*>(slot->storage)->~Socks5Proxy();
+
+        slot->prev = nullptr;
+        slot->next = _free;
+        _free = slot;
+
+        _live_count--;
+    }
+}
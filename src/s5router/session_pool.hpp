@@ -0,0 +1,88 @@
+#pragma once
+
+#include "socks5.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace s5r
+{
+    struct SessionPoolStats
+    {
+        // sessions currently served
+        size_t live = 0;
+
+        // most sessions served at once
+        size_t peak = 0;
+
+        // slots in all slabs
+        size_t capacity = 0;
+        size_t slabs = 0;
+    };
+
+    /**
+     * Slab allocator of Socks5Proxy sessions.
+     * Slots are preallocated in slabs and recycled through an
+     * intrusive free list, live ones are chained in an intrusive
+     * list so they can be walked. Thread-safe, sessions are
+     * created by the acceptor and destroyed by whoever served them
+     **/
+    class SessionPool
+    {
+    public:
+        // `slabs` are allocated up front, more are added on demand
+        // up to `max_slabs` (0 for no limit)
+        SessionPool(size_t slab_size, size_t slabs, size_t max_slabs);
+        ~SessionPool();
+
+        SessionPool(const SessionPool&) = delete;
+        SessionPool& operator=(const SessionPool&) = delete;
+
+        // returns nullptr if the slab limit is reached
+        Socks5Proxy* create(const sockaddr_in& cl_addr, int sock, in_addr route_ip, const S5Settings* settings);
+
+        // destroys a session and returns its slot to the pool it came from
+        static void destroy(Socks5Proxy* proxy);
+
+        // sessions can't be destroyed while `visit` runs,
+        // it must not create or destroy any itself
+        void for_each(const std::function<void(const Socks5Proxy& proxy)>& visit) const;
+
+        SessionPoolStats stats() const;
+
+    private:
+        struct Slot
+        {
+            // first member, the session address is the slot address
+            alignas(Socks5Proxy) unsigned char storage[sizeof(Socks5Proxy)];
+
+            SessionPool* pool;
+
+            // free list while free, live list while used
+            Slot* next;
+            Slot* prev;
+        };
+
+        mutable std::mutex _mutex;
+
+        std::vector<std::unique_ptr<Slot[]>> _slabs;
+        size_t _slab_size;
+        size_t _max_slabs;
+
+        Slot* _free;
+        Slot* _live;
+
+        size_t _live_count;
+        size_t _peak;
+
+    private:
+        // links a new slab into the free list, false at the limit
+        bool _grow();
+
+        // unlinks and destroys the session of `slot`, frees the slot
+        void _release(Slot* slot);
+    };
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "common/net.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace s5r
+{
+    enum class RunMode
+    {
+        // one blocking thread per connection
+        Threaded,
+
+        // fixed set of epoll workers multiplexing
+        // every session (Linux only)
+        Reactor
+    };
+
+    enum class RelayMode
+    {
+        // recv()/send() through a user space buffer
+        Copy,
+
+        // splice() through pipes, payload never leaves
+        // the kernel (Linux only)
+        Splice
+    };
+
+    // inclusive range of ports, host order
+    struct PortRange
+    {
+        // 0 leaves picking the port to the system
+        uint16_t first = 0;
+        uint16_t last = 0;
+    };
+
+    struct DnsSettings
+    {
+        // upstream nameservers, tried in turn on timeouts,
+        // empty picks the ones from /etc/resolv.conf
+        std::vector<sockaddr_in> servers;
+
+        // static names (/etc/hosts), answered without a query,
+        // keys are lower case
+        std::unordered_map<std::string, std::vector<in_addr>> hosts;
+
+        // wait for a single query
+        uint32_t timeout_ms = 2000;
+
+        // queries sent again after the first one timed out
+        unsigned int retries = 2;
+
+        // answers kept by the shared cache, 0 disables it
+        size_t cache_size = 10000;
+
+        // clamps applied to record TTLs (seconds)
+        uint32_t cache_min_ttl = 5;
+        uint32_t cache_max_ttl = 3600;
+
+        // NXDOMAIN/no records upper bound (seconds)
+        uint32_t cache_negative_ttl = 30;
+
+        // SERVFAIL/timeouts are remembered this long (seconds)
+        uint32_t cache_failure_ttl = 5;
+
+        // hits within an answer's lifetime that get it refreshed
+        // in the background before it expires, 0 disables that
+        uint32_t prefetch_hits = 8;
+
+        // background refreshes started per second at most
+        uint32_t prefetch_rate = 50;
+    };
+
+    struct S5Settings
+    {
+#ifdef __linux__
+        RunMode run_mode = RunMode::Reactor;
+#else
+        RunMode run_mode = RunMode::Threaded;
+#endif
+
+        // reactor worker threads
+        // 0 picks the number of cores
+        unsigned int workers = 0;
+
+        // SO_REUSEPORT listeners per address in reactor mode, each
+        // accepting on its own worker, 0 gives one to every worker
+        unsigned int shards = 0;
+
+        // use io_uring for the accept loop and the threaded mode
+        // relay loops when the kernel supports it (Linux only).
+        // Reactor mode never uses it, and a relay keeps a single
+        // read or write in flight per direction, so it saves
+        // little over poll() and is off unless asked for
+        bool io_uring = false;
+
+        // how TCP payload is moved between client and route,
+        // falls back to copying when splice isn't possible
+        RelayMode tcp_relay = RelayMode::Copy;
+
+        // delay before racing the next destination of a CONNECT
+        // while earlier attempts are still pending (RFC 8305)
+        uint32_t connect_delay_ms = 250;
+
+        // single connect attempt gives up after this
+        uint32_t connect_timeout_ms = 10000;
+
+        // reply to CONNECT before the route is resolved and connected,
+        // saving the client that round trip. The route failing then
+        // resets the client connection instead of a failure reply
+        bool optimistic_connect = false;
+
+        // TCP Fast Open (Linux only): listening sockets accept data in
+        // the SYN and route connects carry the client's first bytes.
+        // Needs net.ipv4.tcp_fastopen to allow the respective side
+        bool tcp_fastopen = false;
+
+        // datagrams a UDP relay reads and forwards per system call
+        // (recvmmsg/sendmmsg, Linux only), 1 disables batching
+        unsigned int udp_batch = 16;
+
+        // threaded mode hands UDP associations to this many shared
+        // workers (Linux only), 0 keeps a thread for each of them
+        unsigned int udp_workers = 2;
+
+        // UDP associations that relay nothing for this long are
+        // closed along with their control connection, 0 disables it
+        uint32_t udp_idle_timeout_ms = 120000;
+
+        // let the kernel coalesce received UDP datagrams (UDP_GRO)
+        // and split forwarded ones (UDP_SEGMENT) when it supports it
+        bool udp_offload = true;
+
+        // payload bytes a fragmented client datagram may add up to
+        // (RFC 1928 FRAG), 0 drops fragments instead of reassembling
+        size_t udp_reassembly_max = 65507;
+
+        // fragments of a datagram have to arrive within this long
+        uint32_t udp_reassembly_timeout_ms = 5000;
+
+        // bound UDP sockets kept for new associations per side and
+        // address, bound at startup already. 0 disables the pool
+        unsigned int udp_socket_pool = 32;
+
+        // connected route sockets kept for each hot destination,
+        // how many of the most requested destinations are hot and
+        // how long a pooled socket may wait. 0 disables the pool
+        unsigned int upstream_pool = 0;
+        unsigned int upstream_pool_destinations = 8;
+        uint32_t upstream_pool_idle_ms = 30000;
+
+        // ports the UDP sockets facing clients and remote hosts
+        // of associations are bound to
+        PortRange udp_client_ports;
+        PortRange udp_route_ports;
+
+        // bounds of the per-direction relay buffer, sized by each
+        // tunnel's throughput along with SO_RCVBUF/SO_SNDBUF.
+        // Equal bounds keep the size fixed and leave socket buffers alone
+        size_t relay_buffer_min = 4096;
+        size_t relay_buffer_max = 1048576;
+
+        // bytes of sessions, relay buffers, DNS cache and queued
+        // datagrams, requests are refused past it. 0 means no limit
+        size_t memory_budget = 0;
+
+        // session objects per slab of the session pool
+        unsigned int session_slab_size = 256;
+
+        // slabs allocated at startup
+        unsigned int session_slabs = 1;
+
+        // clients are refused once this many slabs are in use,
+        // 0 lets the pool grow without a limit
+        unsigned int session_slabs_max = 0;
+
+        // policy rules consulted for CONNECT requests and every UDP
+        // datagram a client sends (see PolicyTable), empty connects
+        // everything from the route address
+        std::string rules_file;
+
+        // domain name resolution of CONNECT and UDP destinations
+        DnsSettings dns;
+    };
+}
@@ -1,11 +1,22 @@
 #include "socks5.hpp"
+#include "buffer_pool.hpp"
+#include "dns_cache.hpp"
+#include "memory_budget.hpp"
+#include "policy.hpp"
+#include "session_pool.hpp"
+#include "udp_socket_pool.hpp"
 #include "utils.hpp"
 #include "common/poll.hpp"
 #include "common/error.hpp"
 
+#include <algorithm>
 #include <cstdlib>
 #include <unistd.h>
 
+#ifdef __linux__
+    #include "resolver.hpp"
+#endif
+
 #ifdef _WIN32
     #include <ws2tcpip.h>
 #endif
@@ -44,7 +55,7 @@ namespace s5r
                 ::close(rt_sock);
             }
 
-            delete this;
+            SessionPool::destroy(this);
             return;
         }
 
@@ -52,6 +63,45 @@ namespace s5r
 
         get_socket_addr(rt_sock, &server_address);
 
+        if (command == S5Command::TCPStream)
+        {
+            _log_tunnel(server_address, "TCP");
+
+            if (_send_early_data(rt_sock))
+            {
+                _tcp_loop(rt_sock);
+            }
+            else
+            {
+                ::shutdown(rt_sock, SD_BOTH);
+                ::close(rt_sock);
+            }
+
+            _log_tunnel(server_address, "TCP closed");
+        }
+        else if (command == S5Command::UDPPort)
+        {
+#ifdef __linux__
+            // leave this thread, a shared UDP worker relays from here on
+            bool handed_over = _settings->udp_workers > 0
+                && UdpAssociations::shared().post([this, rt_sock, udp_sock](EventLoop* loop) -> void {
+                    _start_udp(loop, rt_sock, udp_sock);
+                });
+
+            if (handed_over)
+                return;
+#endif
+
+            _log_tunnel(server_address, "UDP");
+            _udp_loop(rt_sock, udp_sock);
+            _log_tunnel(server_address, "UDP closed");
+        }
+
+        SessionPool::destroy(this);
+    }
+
+    void Socks5Proxy::_log_tunnel(const sockaddr_in& server_address, const char* suffix)
+    {
         std::string client_ip = inet_ntoa(_cl_addr.sin_addr);
         std::string server_ip = inet_ntoa(server_address.sin_addr);
 
@@ -61,128 +111,141 @@ namespace s5r
             << " -> "
             << server_ip
             << ":" << ntohs(server_address.sin_port)
-	        << " | ";
+            << " | " << suffix << std::endl;
+    }
 
-        if (command == S5Command::TCPStream)
+    void Socks5Proxy::_tcp_loop(int rt_sock)
+    {
+#ifdef __linux__
+        bool relayed =
+            (_settings->tcp_relay == RelayMode::Splice && _tcp_loop_splice(rt_sock)) ||
+            (_settings->io_uring && _tcp_loop_uring(rt_sock));
+
+        if (relayed)
         {
-            std::cout << "TCP" << std::endl;            
-            _tcp_loop(rt_sock);
-            std::cout
-                << client_ip
-                << ":" << ntohs(_cl_addr.sin_port)
-                << " -> "
-                << server_ip
-                << ":" << ntohs(server_address.sin_port)
-                << " | TCP closed" << std::endl;
+            ::shutdown(rt_sock, SD_BOTH);
+            ::close(rt_sock);
+            return;
         }
-        else if (command == S5Command::UDPPort)
+#endif
+
+        // sockets go non-blocking so a slow reader on one side
+        // only stalls its own direction (_sock is closed after this)
+        if (set_socket_nonblocking(_sock) == -1 || set_socket_nonblocking(rt_sock) == -1)
         {
-            std::cout << "UDP" << std::endl;
-            _udp_loop(rt_sock, udp_sock);
-            std::cout
-                << client_ip
-                << ":" << ntohs(_cl_addr.sin_port)
-                << " -> "
-                << server_ip
-                << ":" << ntohs(server_address.sin_port)
-                << " | UDP closed" << std::endl;
-	}
+            std::cerr << "Couldn't make relay sockets non-blocking" << std::endl;
+            ::shutdown(rt_sock, SD_BOTH);
+            ::close(rt_sock);
+            return;
+        }
 
-        delete this;
-    }
+        // 0: client -> route, 1: route -> client
+        RingBuffer buffers[2];
+        int from[2] = {_sock, rt_sock};
+        int to[2] = {rt_sock, _sock};
+        bool eof[2] = {false, false};
+        bool shut[2] = {false, false};
 
-    void Socks5Proxy::_tcp_loop(int rt_sock)
-    {
+        // socket i of `from` reported POLLHUP
+        bool hup[2] = {false, false};
+
+        // fds[i].fd is socket i of `from`
         pollfd fds[2];
 
-        fds[0].fd = _sock;
-        fds[0].events = POLLIN;
-        fds[0].revents = 0;
+        bool failed = false;
 
-        fds[1].fd = rt_sock;
-        fds[1].events = POLLIN;
-        fds[1].revents = 0;
+        while (!failed && !(shut[0] && shut[1]))
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                fds[i].fd = from[i];
+                fds[i].events = 0;
+                fds[i].revents = 0;
+            }
 
-        char buffer[4096];
-        int buffer_size = 4096;
+            for (int d = 0; d < 2; d++)
+            {
+                // stop reading while the other side can't keep up
+                if (!eof[d] && !buffers[d].full())
+                    fds[d].events |= POLLIN;
+
+                // `to[d]` is `from[1 - d]`
+                if (!buffers[d].empty())
+                    fds[1 - d].events |= POLLOUT;
+            }
+
+            // a hung up socket is reported whatever is asked for,
+            // leave it out while there's nothing to do with it
+            for (int i = 0; i < 2; i++)
+            {
+                if (hup[i] && fds[i].events == 0)
+                    fds[i].fd = -1;
+            }
 
-        while (true)
-        {
             int poll_result = poll(fds, 2, 10000);
 
             if (poll_result == -1)
             {
+                if (get_last_socket_error() == EINTR)
+                    continue;
+
                 std::cerr << "Client poll error" << std::endl;
                 break;
             }
             else if (poll_result == 0)
             {
                 // time out
+                continue;
             }
-            else
+
+            for (int d = 0; d < 2 && !failed; d++)
             {
-                // client
-                if (fds[0].revents & POLLIN)
+                if (fds[d].revents & (POLLERR | POLLNVAL))
+                {
+                    std::cerr << (d == 0 ? "Client" : "Route") << " socket error" << std::endl;
+                    failed = true;
+                    break;
+                }
+
+                if ((fds[d].revents & (POLLIN | POLLHUP)) && !eof[d] && !buffers[d].full())
                 {
-                    buffer_size = ::recv(_sock, buffer, 4096, 0);
+                    int size = _tuned_recv(d, &buffers[d], from[d], to[d]);
 
-                    if (buffer_size == -1)
+                    if (size == 0)
                     {
-                        std::cerr << "Client socket recv == -1" << std::endl;
+                        eof[d] = true;
+                    }
+                    else if (size == -1 && !socket_would_block())
+                    {
+                        std::cerr << (d == 0 ? "Client" : "Route") << " socket recv == -1" << std::endl;
+                        failed = true;
                         break;
                     }
-
-                    // std::cout << "TCP -> " << buffer_size << std::endl;
-
-                    ::send(
-                        rt_sock,
-                        (char*)buffer,
-                        buffer_size,
-                        0
-                    );
-
-                    fds[0].revents = 0;
-                }
-                else if (fds[0].revents & POLLHUP)
-                {
-                    break;
-                }
-                else if (fds[0].revents & (POLLERR | POLLNVAL))
-                {
-                    std::cerr << "Client socket error" << std::endl;
-                    break;
                 }
 
-                // route/server
-                if (fds[1].revents & POLLIN)
+                // send right away, most of the time the socket is writable
+                if (!buffers[d].empty())
                 {
-                    buffer_size = ::recv(
-                        rt_sock,
-                        (char*)buffer,
-                        4096,
-                        0
-                    );
-
-                    if (buffer_size == -1)
+                    if (buffers[d].send(to[d], MSG_NOSIGNAL) == -1 && !socket_would_block())
                     {
-                        std::cerr << "Route socket recv == -1" << std::endl;
+                        failed = true;
                         break;
                     }
-
-                    // std::cout << "TCP <- " << buffer_size << std::endl;
-
-                    ::send(_sock, buffer, buffer_size, 0);
-
-                    fds[1].revents = 0;
                 }
-                else if (fds[1].revents & POLLHUP)
+
+                if (eof[d] && buffers[d].empty() && !shut[d])
                 {
-                    break;
+                    ::shutdown(to[d], SD_SEND);
+                    shut[d] = true;
                 }
-                else if (fds[1].revents & (POLLERR | POLLNVAL))
+
+                if (fds[d].revents & POLLHUP)
+                    hup[d] = true;
+
+                // peer is gone in both directions and nothing is left to relay
+                if (hup[d] && eof[d] && buffers[0].empty() && buffers[1].empty())
                 {
-                    std::cerr << "Route socket error" << std::endl;
-                    break;
+                    failed = true;
                 }
             }
         }
@@ -191,7 +254,73 @@ namespace s5r
         ::close(rt_sock);
     }
 
+    int Socks5Proxy::_tuned_recv(int direction, RingBuffer* ring, int from, int to)
+    {
+        BufferTuner& tuner = _tuners[direction];
+
+        size_t previous = ring->capacity();
+
+        if (tuner.is_adaptive() && previous != tuner.size() && ring->resize(tuner.size()))
+        {
+            int size = (int)tuner.size();
+
+            // kernel buffers follow so memory moves with the flow, except
+            // that a receive buffer never goes below its current (maybe
+            // autotuned) size, shrinking it drops data the peer was already
+            // allowed to send (the advertised window can't be taken back)
+            int current = 0;
+            socklen_t length = sizeof(current);
+
+            if (tuner.size() > previous
+                && getsockopt(from, SOL_SOCKET, SO_RCVBUF, (char*)&current, &length) == 0
+                && current < size)
+            {
+                setsockopt(from, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size));
+            }
+
+            setsockopt(to, SOL_SOCKET, SO_SNDBUF, (const char*)&size, sizeof(size));
+        }
+
+        size_t room = ring->capacity() - ring->size();
+        int size = ring->recv(from);
+
+        tuner.on_read(size, room);
+        return size;
+    }
+
     void Socks5Proxy::_udp_loop(int rt_sock, int udp_sock)
+    {
+        S5UDPRelayState state;
+        state.cl_addr.sin_addr.s_addr = 0;
+        state.cl_addr.sin_port = 0;
+        state.fragments.configure(_settings->udp_reassembly_max, _settings->udp_reassembly_timeout_ms);
+
+        sockaddr_in relay_address;
+        get_socket_addr(udp_sock, &relay_address);
+        UdpAssociations::shared().add(_cl_addr, relay_address, &state.counters);
+
+        bool relayed = false;
+
+#ifdef __linux__
+        state.gro = _udp_offload;
+        state.gso = _udp_offload;
+
+        // coalesced datagrams can't go through the io_uring loop
+        relayed = !_udp_offload && _settings->io_uring && _udp_loop_uring(&state, rt_sock, udp_sock);
+#endif
+
+        if (!relayed)
+        {
+            _udp_loop_poll(&state, rt_sock, udp_sock);
+        }
+
+        UdpAssociations::shared().remove(_cl_addr);
+
+        UdpSocketPool::shared().release(UdpSocketSide::Route, rt_sock);
+        UdpSocketPool::shared().release(UdpSocketSide::Client, udp_sock);
+    }
+
+    void Socks5Proxy::_udp_loop_poll(S5UDPRelayState* state, int rt_sock, int udp_sock)
     {
         pollfd fds[3];
 
@@ -207,26 +336,19 @@ namespace s5r
         fds[2].events = POLLIN;
         fds[2].revents = 0;
 
-        char buffer[4096];
-        int buffer_size = 4096;
+        UdpIdleCheck idle;
+        idle.start(_settings->udp_idle_timeout_ms);
 
-        S5RequestBody udp_header;
-        std::vector<Destination> destinations;
-
-        socklen_t cl_addr_len = sizeof(sockaddr_in);
-        sockaddr_in cl_addr;
-        cl_addr.sin_addr.s_addr = 0;
-        cl_addr.sin_port = 0;
+        int timeout = 10000;
 
-        socklen_t sv_addr_len = sizeof(sockaddr_in);
-        sockaddr_in sv_addr;
-        sv_addr.sin_family = AF_INET;
-        sv_addr.sin_addr.s_addr = 0;
-        sv_addr.sin_port = 0;
+        if (idle.is_enabled())
+        {
+            timeout = std::min<int>(timeout, idle.interval_ms());
+        }
 
         while (true)
         {
-            int poll_result = poll(fds, 3, 10000);
+            int poll_result = poll(fds, 3, timeout);
 
             if (poll_result == -1)
             {
@@ -242,40 +364,12 @@ namespace s5r
                 // bound client udp
                 if (fds[0].revents & POLLIN)
                 {
-                    buffer_size = ::recvfrom(udp_sock, buffer, 4096, 0,
-                        (sockaddr*)&cl_addr, &cl_addr_len);
-                    int offset = 0;
-
-                    S5RequestBody* request = reinterpret_cast<S5RequestBody*>(buffer);
-
-                    _extract_address(request, &destinations);
-
-                    memcpy((char*)&udp_header, buffer, request->get_size());
-                    udp_header.frag = 0;
-
-                    offset = udp_header.get_size();
-                    // std::cout << "Request size: " << offset << std::endl;
-
-                    if (buffer_size == -1)
+                    if (_udp_from_client(state, rt_sock, udp_sock) == -1)
                     {
                         std::cerr << "Client socket recv == -1" << std::endl;
                         break;
                     }
 
-                    // std::cout << "UDP -> " << buffer_size << std::endl;
-
-                    sv_addr.sin_addr = destinations[0].address;
-                    sv_addr.sin_port = destinations[0].port;
-
-                    ::sendto(
-                        rt_sock,
-                        (char*)buffer + offset,
-                        buffer_size - offset,
-                        0,
-                        (sockaddr*)&sv_addr,
-                        sv_addr_len
-                    );
-
                     fds[0].revents = 0;
                 }
                 else if (fds[0].revents & POLLHUP)
@@ -292,36 +386,12 @@ namespace s5r
                 // route/server
                 if (fds[1].revents & POLLIN)
                 {
-                    int offset = udp_header.get_size();
-                    // std::cout << "2Request size: " << offset << std::endl;
-                    memcpy(buffer, (char*)&udp_header, offset);
-
-                    buffer_size = ::recvfrom(
-                        rt_sock,
-                        (char*)buffer + offset,
-                        4096 - offset,
-                        0,
-                        (sockaddr*)&sv_addr,
-                        &sv_addr_len
-                    ) + offset;
-
-                    if (buffer_size == -1)
+                    if (_udp_from_route(state, rt_sock, udp_sock) == -1)
                     {
                         std::cerr << "Route socket recv == -1" << std::endl;
                         break;
                     }
 
-                    S5RequestBody* request = reinterpret_cast<S5RequestBody*>(buffer);
-                    request->address.type = static_cast<char>(S5Address::Type::IPv4Address);
-                    in_addr* udp_addr = reinterpret_cast<in_addr*>(request->address.get_address());
-                    *udp_addr = sv_addr.sin_addr;
-                    *request->get_port_ptr() = sv_addr.sin_port;
-
-                    // std::cout << "UDP <- " << buffer_size << std::endl;
-
-                    ::sendto(udp_sock, buffer, buffer_size, 0,
-                        (sockaddr*)&cl_addr, cl_addr_len);
-
                     fds[1].revents = 0;
                 }
                 else if (fds[1].revents & POLLHUP)
@@ -335,6 +405,7 @@ namespace s5r
                     break;
                 }
 
+                // association lives as long as the control connection
                 if (fds[2].revents & POLLHUP)
                 {
                     break;
@@ -344,61 +415,419 @@ namespace s5r
                     std::cerr << "UDP TCP (POLLERR | POLLNVAL)" << std::endl;
                     break;
                 }
+                else if (fds[2].revents & POLLIN)
+                {
+                    char buffer[256];
+
+                    if (this->recv(buffer, sizeof(buffer)) <= 0)
+                    {
+                        break;
+                    }
+
+                    fds[2].revents = 0;
+                }
+            }
+
+            if (idle.is_enabled() && idle.is_idle(state->counters))
+            {
+                UdpAssociations::shared().expire(_cl_addr);
+                break;
             }
         }
+    }
 
-        ::close(rt_sock);
-        ::close(udp_sock);
+    int Socks5Proxy::_udp_from_client(S5UDPRelayState* state, int rt_sock, int udp_sock)
+    {
+#ifdef __linux__
+        if (_settings->udp_batch > 1 || state->gro)
+            return _udp_from_client_batch(state, rt_sock, udp_sock);
+#endif
+
+        PooledBuffer buffer(S5_UDP_BUFFER_SIZE);
+
+        if (!buffer.data())
+            return -1;
+
+        socklen_t cl_addr_len = sizeof(sockaddr_in);
+
+        int buffer_size = ::recvfrom(udp_sock, buffer.data(), (int)S5_UDP_BUFFER_SIZE, 0,
+            (sockaddr*)&state->cl_addr, &cl_addr_len);
+
+        if (buffer_size == -1)
+        {
+            int error = get_last_socket_error();
+            return (error == EAGAIN || error == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        state->counters.on_client(1, buffer_size);
+
+        sockaddr_in sv_addr;
+        const char* payload;
+        int payload_size = _udp_client_datagram(state, buffer.data(), buffer_size, &sv_addr, &payload);
+
+        if (payload_size == -1)
+        {
+            return 0;
+        }
+
+        // std::cout << "UDP -> " << buffer_size << std::endl;
+
+        ::sendto(
+            rt_sock,
+            payload,
+            payload_size,
+            0,
+            (sockaddr*)&sv_addr,
+            sizeof(sockaddr_in)
+        );
+
+        return 1;
     }
 
-    S5HandshakeStatus Socks5Proxy::_handshake(int* out_sock, S5Command* command, int* out_udp_sock)
+    int Socks5Proxy::_udp_from_route(S5UDPRelayState* state, int rt_sock, int udp_sock)
     {
-        if (!out_sock)
-            return S5HandshakeStatus::UnknownError;
+#ifdef __linux__
+        if (_settings->udp_batch > 1 || state->gro)
+            return _udp_from_route_batch(state, rt_sock, udp_sock);
+#endif
 
-        *out_sock = 0;
+        PooledBuffer buffer(S5_UDP_BUFFER_SIZE);
+
+        if (!buffer.data())
+            return -1;
+
+        sockaddr_in sv_addr;
+        socklen_t sv_addr_len = sizeof(sockaddr_in);
 
-        static constexpr int BUFFER_SIZE = 1024;
-        char buffer[BUFFER_SIZE];
-        int buffer_size = 0;
+        int buffer_size = ::recvfrom(
+            rt_sock,
+            buffer.data(),
+            (int)S5_UDP_BUFFER_SIZE,
+            0,
+            (sockaddr*)&sv_addr,
+            &sv_addr_len
+        );
 
-        buffer_size = this->recv(buffer, BUFFER_SIZE);
         if (buffer_size == -1)
         {
-            std::cerr << "[1] buffer_size -1" << std::endl;
-            return S5HandshakeStatus::UnknownError;
+            int error = get_last_socket_error();
+            return (error == EAGAIN || error == EWOULDBLOCK) ? 0 : -1;
         }
 
-        S5ClientGreeting* greeting = (S5ClientGreeting*)buffer;
+        state->counters.on_remote(1, buffer_size);
+
+        const char* header = state->reply_headers.get(sv_addr);
+
+        // std::cout << "UDP <- " << buffer_size << std::endl;
+
+#ifdef _WIN32
+        // no sendmsg(), the payload moves behind the header
+        memmove(buffer.data() + S5_UDP_REPLY_HEADER_SIZE, buffer.data(),
+            std::min<int>(buffer_size, (int)S5_UDP_BUFFER_SIZE - S5_UDP_REPLY_HEADER_SIZE));
+        memcpy(buffer.data(), header, S5_UDP_REPLY_HEADER_SIZE);
+
+        ::sendto(udp_sock, buffer.data(), buffer_size + S5_UDP_REPLY_HEADER_SIZE, 0,
+            (sockaddr*)&state->cl_addr, sizeof(sockaddr_in));
+#else
+        iovec iov[2];
+        iov[0].iov_base = (void*)header;
+        iov[0].iov_len = S5_UDP_REPLY_HEADER_SIZE;
+        iov[1].iov_base = buffer.data();
+        iov[1].iov_len = buffer_size;
+
+        msghdr message;
+        memset(&message, 0, sizeof(msghdr));
+        message.msg_name = &state->cl_addr;
+        message.msg_namelen = sizeof(sockaddr_in);
+        message.msg_iov = iov;
+        message.msg_iovlen = 2;
+
+        ::sendmsg(udp_sock, &message, 0);
+#endif
+
+        return 1;
+    }
+
+    // SOCKS5 UDP header size (RSV, FRAG, ATYP, address, port),
+    // -1 if the datagram is shorter or the address type unknown
+    static int _udp_header_size(const char buffer[], int buffer_size)
+    {
+        if (buffer_size < 4)
+            return -1;
 
-        if (!_verify_version(greeting->ver))
+        int size;
+
+        switch ((S5Address::Type)buffer[3])
         {
-            std::cerr << "[2] version mismatch" << std::endl;
-            _choose_auth_method(0xFF);
-            return S5HandshakeStatus::InvalidVersion;
+        case S5Address::Type::IPv4Address:
+            size = 4 + sizeof(in_addr) + 2;
+            break;
+        case S5Address::Type::DomainName:
+            // the length byte comes first
+            if (buffer_size < 5)
+                return -1;
+
+            size = 4 + 1 + (unsigned char)buffer[4] + 2;
+            break;
+        case S5Address::Type::IPv6Address:
+            size = 4 + sizeof(in6_addr) + 2;
+            break;
+        default:
+            return -1;
         }
 
-        char* auths = (char*)(greeting + 1);
-        int cauth = 0xFF;
-        for (int i = 0; i < greeting->nauth; i++)
+        return buffer_size < size ? -1 : size;
+    }
+
+    int Socks5Proxy::_udp_client_datagram(
+        S5UDPRelayState* state,
+        char buffer[],
+        int buffer_size,
+        sockaddr_in* sv_addr,
+        const char** payload
+    ) {
+        int header_size = _udp_header_size(buffer, buffer_size);
+
+        if (header_size == -1)
         {
-            if (auths[i] == 0)
+            // malformed, drop it
+            return -1;
+        }
+
+        S5RequestBody* request = reinterpret_cast<S5RequestBody*>(buffer);
+
+        *payload = buffer + header_size;
+        int payload_size = buffer_size - header_size;
+
+        // fragments wait for the rest of their datagram, which
+        // then goes where its last fragment is addressed to
+        if (request->frag != 0
+            && !state->fragments.add((uint8_t)request->frag, *payload, payload_size, payload, &payload_size))
+        {
+            return -1;
+        }
+
+        state->destinations.clear();
+
+        std::string domain;
+        bool has_domain = _get_domain(request, &domain);
+
+        // the rules apply to every datagram, names they reject aren't resolved
+        if (has_domain && !_udp_name_allowed(domain, request->get_port()))
+        {
+            return -1;
+        }
+
+#ifdef __linux__
+        DnsAnswer answer;
+
+        // reactor mode resolves in the background and sends it later
+        if (_loop && has_domain)
+        {
+            if (!Resolver::local(_loop, &_settings->dns).lookup(domain, DnsType::A, &answer))
             {
-                cauth = 0;
+                _udp_resolve(domain, request->get_port(), *payload, payload_size);
+                return -1;
+            }
+
+            _add_destinations(answer, request->get_port(), &state->destinations);
+        }
+        else
+#endif
+        if (_extract_address(request, &state->destinations))
+        {
+            return -1;
+        }
+
+        const Destination* destination = _udp_allowed_destination(
+            state->destinations,
+            has_domain ? &domain : nullptr
+        );
+
+        if (!destination)
+        {
+            return -1;
+        }
+
+        sv_addr->sin_family = AF_INET;
+        sv_addr->sin_addr = destination->address;
+        sv_addr->sin_port = destination->port;
+
+        return payload_size;
+    }
+
+    S5HandshakeParser::Result S5HandshakeParser::next()
+    {
+        if (_stage == Stage::Done)
+            return Result::Invalid;
+
+        const unsigned char* message = (const unsigned char*)_buffer + _parsed;
+        int available = _size - _parsed;
+
+        if (available >= 1 && message[0] != 5)
+            return Result::Invalid;
+
+        int size = 0;
+
+        if (_stage == Stage::Greeting)
+        {
+            if (available < 2)
+                return Result::NeedMore;
+
+            size = 2 + message[1];
+        }
+        else
+        {
+            // up to the first byte of the address
+            if (available < 5)
+                return Result::NeedMore;
+
+            switch (static_cast<S5Address::Type>(message[3]))
+            {
+            case S5Address::Type::IPv4Address:
+                size = 4 + sizeof(in_addr) + 2;
+                break;
+            case S5Address::Type::DomainName:
+                size = 4 + 1 + message[4] + 2;
+                break;
+            case S5Address::Type::IPv6Address:
+                size = 4 + 16 + 2;
                 break;
+            default:
+                return Result::Invalid;
             }
         }
 
-        _choose_auth_method(cauth);
+        if (available < size)
+            return Result::NeedMore;
 
-        buffer_size = this->recv(buffer, BUFFER_SIZE);
-        if (buffer_size == -1)
+        _message = _parsed;
+        _message_size = size;
+        _parsed += size;
+
+        if (_stage == Stage::Greeting)
+        {
+            _stage = Stage::Request;
+            return Result::Greeting;
+        }
+
+        _stage = Stage::Done;
+        return Result::Request;
+    }
+
+    const char* UdpReplyHeaders::get(const sockaddr_in& peer)
+    {
+        if (!_entries)
+        {
+            _entries.reset(new Entry[CAPACITY]);
+        }
+
+        _clock++;
+
+        auto matches = [&peer](const Entry& entry) -> bool {
+            return entry.address.s_addr == peer.sin_addr.s_addr && entry.port == peer.sin_port;
+        };
+
+        if (_size && matches(_entries[_last]))
+        {
+            _entries[_last].used = _clock;
+            return _entries[_last].header;
+        }
+
+        size_t index = 0;
+
+        for (size_t i = 0; i < _size; i++)
+        {
+            if (matches(_entries[i]))
+            {
+                _last = i;
+                _entries[i].used = _clock;
+                return _entries[i].header;
+            }
+
+            if (_entries[i].used < _entries[index].used)
+            {
+                index = i;
+            }
+        }
+
+        if (_size < CAPACITY)
+        {
+            index = _size++;
+        }
+
+        Entry& entry = _entries[index];
+        entry.address = peer.sin_addr;
+        entry.port = peer.sin_port;
+        entry.used = _clock;
+        _build(entry.header, peer);
+
+        _last = index;
+        return entry.header;
+    }
+
+    void UdpReplyHeaders::_build(char buffer[], const sockaddr_in& sv_addr)
+    {
+        // replies always carry an IPv4 address
+        S5RequestBody* request = reinterpret_cast<S5RequestBody*>(buffer);
+        request->ver = 0;
+        request->cmd = 0;
+        request->frag = 0;
+        request->address.type = static_cast<char>(S5Address::Type::IPv4Address);
+
+        in_addr* udp_addr = reinterpret_cast<in_addr*>(request->address.get_address());
+        *udp_addr = sv_addr.sin_addr;
+        *request->get_port_ptr() = sv_addr.sin_port;
+    }
+
+    S5HandshakeStatus Socks5Proxy::_handshake(int* out_sock, S5Command* command, int* out_udp_sock)
+    {
+        if (!out_sock)
+            return S5HandshakeStatus::UnknownError;
+
+        *out_sock = 0;
+
+        if (_recv_handshake() != S5HandshakeParser::Result::Greeting)
+        {
+            std::cerr << "[1] no greeting" << std::endl;
+            return S5HandshakeStatus::UnknownError;
+        }
+
+        auto status = _negotiate_auth(_parser.greeting(), _parser.greeting_size());
+        if (status != S5HandshakeStatus::Ok)
+        {
+            return status;
+        }
+
+        if (_recv_handshake() != S5HandshakeParser::Result::Request)
         {
-            std::cerr << "[3] buffer_size -1" << std::endl;
+            std::cerr << "[3] no request" << std::endl;
             return S5HandshakeStatus::UnknownError;
         }
 
-        S5RequestBody* connection_request = (S5RequestBody*)buffer;
+        S5RequestBody* connection_request = _parser.request();
+
+        if (!MemoryBudget::shared().admit())
+        {
+            std::cerr << "Out of memory budget, refusing request" << std::endl;
+            _send_request_status(connection_request, 0x01);
+            return S5HandshakeStatus::GeneralFailure;
+        }
+
+        // the client may send payload while the route is connected,
+        // it waits in the socket buffer until then
+        if (_settings->optimistic_connect && connection_request->get_cmd() == S5Command::TCPStream)
+        {
+            _send_request_status(connection_request, 0x0);
+        }
+
+        // names the rules reject aren't even resolved
+        if (connection_request->get_cmd() == S5Command::TCPStream && !_apply_name_policy(connection_request))
+        {
+            std::cerr << "[12] Connection not allowed by ruleset" << std::endl;
+            _send_request_status(connection_request, 0x02);
+            return S5HandshakeStatus::ConnectionNotAllowedByRuleset;
+        }
 
         std::vector<Destination> destinations;
 
@@ -416,6 +845,13 @@ namespace s5r
         switch (connection_request->get_cmd())
         {
         case S5Command::TCPStream:
+            if (!_apply_policy(connection_request, &destinations))
+            {
+                std::cerr << "[12] Connection not allowed by ruleset" << std::endl;
+                _send_request_status(connection_request, 0x02);
+                return S5HandshakeStatus::ConnectionNotAllowedByRuleset;
+            }
+
             *out_sock = _create_tcp_socket(&destinations);
 
             if (*out_sock == -1)
@@ -433,66 +869,154 @@ namespace s5r
             _send_request_status(connection_request, 0x07);
             return S5HandshakeStatus::UnsupportedCommand;
         case S5Command::UDPPort:
-            *out_sock = _create_udp_socket(&destinations);
+            return _associate_udp(connection_request, &destinations, out_sock, out_udp_sock);
+        default:
+            std::cerr << "[11] Unknown command" << std::endl;
+            _send_request_status(connection_request, 0x07);
+            return S5HandshakeStatus::UnsupportedCommand;
+        }
 
-            if (*out_sock == -1)
-            {
-                // TODO: Handle errors (with errno)
-                std::cerr << "[7] UDP port binding failed" << std::endl;
-                _send_request_status(connection_request, 0x01);
-                return S5HandshakeStatus::GeneralFailure;
-            }
+        return S5HandshakeStatus::Ok;
+    }
 
-            sockaddr_in bind_addr;
-            if (get_socket_addr(_sock, &bind_addr) == -1)
-            {
-                std::cerr << "[8] UDP get_socket_addr == -1" << std::endl;
-                _send_request_status(connection_request, 0x01);
-                return S5HandshakeStatus::GeneralFailure;
-            }
+    S5HandshakeParser::Result Socks5Proxy::_recv_handshake()
+    {
+        while (true)
+        {
+            auto result = _parser.next();
 
-            *out_udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+            if (result != S5HandshakeParser::Result::NeedMore)
+                return result;
 
-            if (*out_udp_sock == -1)
-            {
-                std::cerr << "out_udp_sock == -1" << std::endl;
-                _send_request_status(connection_request, 0x01);
-                return S5HandshakeStatus::GeneralFailure;
-            }
+            int size = this->recv(_parser.space(), _parser.space_size());
 
-            bind_addr.sin_port = 0;
+            if (size <= 0)
+                return S5HandshakeParser::Result::Invalid;
 
-            ::bind(*out_udp_sock, (sockaddr*)&bind_addr, sizeof(sockaddr_in));
-            // ::connect(*out_udp_sock, (sockaddr*)&_cl_addr, sizeof(sockaddr_in));
+            _parser.received(size);
+        }
+    }
 
-            if (*out_udp_sock == -1)
-            {
-                // TODO: Handle errors (with errno)
-                std::cerr << "[9] UDP port binding failed" << std::endl;
-                _send_request_status(connection_request, 0x01);
-                return S5HandshakeStatus::GeneralFailure;
-            }
+    void Socks5Proxy::_prepare_fast_open(ConnectRace* race)
+    {
+        if (!_settings->tcp_fastopen)
+            return;
+
+#ifdef __linux__
+        if (_replied)
+        {
+            int size = (int)::recv(_sock, _parser.space(), _parser.space_size(), MSG_DONTWAIT);
 
-            if (get_socket_addr(*out_udp_sock, &bind_addr) == -1)
+            if (size > 0)
             {
-                std::cerr << "[10] UDP get_socket_addr == -1" << std::endl;
-                _send_request_status(connection_request, 0x01);
-                return S5HandshakeStatus::GeneralFailure;
+                _parser.received(size);
             }
+        }
+#endif
 
-            connection_request->address.type = static_cast<char>(S5Address::Type::IPv4Address);
-            in_addr* udp_addr = reinterpret_cast<in_addr*>(connection_request->address.get_address());
-            *udp_addr = bind_addr.sin_addr;
-            *connection_request->get_port_ptr() = bind_addr.sin_port;
+        race->set_fast_open(_parser.early_data(), _parser.early_data_size());
+    }
 
-            _send_request_status(connection_request, 0x0);
+    bool Socks5Proxy::_send_early_data(int rt_sock)
+    {
+        while (_parser.early_data_size() > 0)
+        {
+            int sent = ::send(rt_sock, _parser.early_data(), _parser.early_data_size(), MSG_NOSIGNAL);
+
+            if (sent == -1)
+                return socket_would_block();
+
+            _parser.consume_early_data(sent);
+        }
 
-            if (destinations[0].address.s_addr == 0)
+        return true;
+    }
+
+    S5HandshakeStatus Socks5Proxy::_negotiate_auth(char buffer[], int buffer_size)
+    {
+        S5ClientGreeting* greeting = (S5ClientGreeting*)buffer;
+
+        if (buffer_size < (int)sizeof(S5ClientGreeting) || !_verify_version(greeting->ver))
+        {
+            std::cerr << "[2] version mismatch" << std::endl;
+            _choose_auth_method(0xFF);
+            return S5HandshakeStatus::InvalidVersion;
+        }
+
+        char* auths = (char*)(greeting + 1);
+        int nauth = std::min<int>(
+            (unsigned char)greeting->nauth,
+            buffer_size - sizeof(S5ClientGreeting)
+        );
+        int cauth = 0xFF;
+        for (int i = 0; i < nauth; i++)
+        {
+            if (auths[i] == 0)
             {
-                return S5HandshakeStatus::OkUDPAssociationRequired;
+                cauth = 0;
+                break;
             }
+        }
 
-            break;
+        _choose_auth_method(cauth);
+
+        if (cauth == 0xFF)
+        {
+            return S5HandshakeStatus::UnsupportedAuthMethod;
+        }
+
+        return S5HandshakeStatus::Ok;
+    }
+
+    S5HandshakeStatus Socks5Proxy::_associate_udp(
+        S5RequestBody* request,
+        std::vector<Destination>* destinations,
+        int* out_sock,
+        int* out_udp_sock
+    ) {
+        *out_sock = _create_udp_socket();
+
+        if (*out_sock == -1)
+        {
+            // TODO: Handle errors (with errno)
+            std::cerr << "[7] UDP port binding failed" << std::endl;
+            _send_request_status(request, 0x01);
+            return S5HandshakeStatus::GeneralFailure;
+        }
+
+        sockaddr_in bind_addr;
+        if (get_socket_addr(_sock, &bind_addr) == -1)
+        {
+            std::cerr << "[8] UDP get_socket_addr == -1" << std::endl;
+            _send_request_status(request, 0x01);
+            return S5HandshakeStatus::GeneralFailure;
+        }
+
+        *out_udp_sock = UdpSocketPool::shared().acquire(UdpSocketSide::Client, bind_addr.sin_addr, &bind_addr.sin_port);
+
+        if (*out_udp_sock == -1)
+        {
+            // TODO: Handle errors (with errno)
+            std::cerr << "[9] UDP port binding failed" << std::endl;
+            _send_request_status(request, 0x01);
+            return S5HandshakeStatus::GeneralFailure;
+        }
+
+        request->address.type = static_cast<char>(S5Address::Type::IPv4Address);
+        in_addr* udp_addr = reinterpret_cast<in_addr*>(request->address.get_address());
+        *udp_addr = bind_addr.sin_addr;
+        *request->get_port_ptr() = bind_addr.sin_port;
+
+#ifdef __linux__
+        // before the reply, the client may start sending right after it
+        _udp_offload = _udp_enable_offload(*out_sock, *out_udp_sock);
+#endif
+
+        _send_request_status(request, 0x0);
+
+        if ((*destinations)[0].address.s_addr == 0)
+        {
+            return S5HandshakeStatus::OkUDPAssociationRequired;
         }
 
         return S5HandshakeStatus::Ok;
@@ -520,52 +1044,66 @@ namespace s5r
     }
 
     int Socks5Proxy::_create_tcp_socket(std::vector<Destination>* destinations) {
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        ConnectRace race;
+        _prepare_fast_open(&race);
 
-        if (sock == -1)
-        {
-            return -1;
-        }
+        race.start(
+            _route_ip,
+            *destinations,
+            _settings->connect_delay_ms,
+            _settings->connect_timeout_ms
+        );
 
-        sockaddr_in addr;
-        addr.sin_family = AF_INET;
-        addr.sin_port = 0;
-        addr.sin_addr = _route_ip;
+        std::vector<pollfd> fds;
+        std::vector<EventSource*> sources;
 
-        if (::bind(sock, (sockaddr*)&addr, sizeof(sockaddr_in)) == -1)
+        while (!race.is_done())
         {
-            ::close(sock);
-            return -1;
-        }
+            fds.clear();
+            sources.clear();
 
-        for (auto& destination : *destinations) {
-            addr.sin_port = destination.port;
-            addr.sin_addr = destination.address;
-
-            if (!::connect(sock, (sockaddr*)&addr, sizeof(sockaddr_in)))
+            for (auto& attempt : race.attempts())
             {
-                return sock;
+                if (attempt.source.fd == -1)
+                    continue;
+
+                pollfd fd;
+                fd.fd = attempt.source.fd;
+                fd.events = POLLOUT;
+                fd.revents = 0;
+
+                fds.push_back(fd);
+                sources.push_back(&attempt.source);
             }
-        }
 
-        ::close(sock);
-        return -1;
-    }
+            int poll_result = poll(fds.data(), fds.size(), race.timeout_ms());
 
-    int Socks5Proxy::_create_udp_socket(std::vector<Destination>* destinations) {
-        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+            if (poll_result == -1)
+            {
+                if (get_last_socket_error() == EINTR)
+                    continue;
 
-        if (sock == -1)
-        {
-            return -1;
+                return -1;
+            }
+
+            for (size_t i = 0; i < fds.size(); i++)
+            {
+                if (fds[i].revents)
+                {
+                    race.on_writable(sources[i]);
+                }
+            }
+
+            race.update();
         }
 
-        sockaddr_in addr;
-        addr.sin_family = AF_INET;
-        addr.sin_port = 0;
-        addr.sin_addr = _route_ip;
+        int sock = race.take_winner();
+
+        // what went out with the SYN isn't sent again
+        _parser.consume_early_data(race.fast_open_sent());
 
-        if (::bind(sock, (sockaddr*)&addr, sizeof(sockaddr_in)) == -1)
+        // relay loops expect a blocking socket
+        if (sock != -1 && set_socket_blocking(sock) == -1)
         {
             ::close(sock);
             return -1;
@@ -574,6 +1112,10 @@ namespace s5r
         return sock;
     }
 
+    int Socks5Proxy::_create_udp_socket() {
+        return UdpSocketPool::shared().acquire(UdpSocketSide::Route, _route_ip);
+    }
+
     int Socks5Proxy::_extract_address(S5RequestBody* request, std::vector<Destination>* destinations)
     {
         auto type = request->address.get_type();
@@ -587,29 +1129,21 @@ namespace s5r
         }
         else if (type == S5Address::Type::DomainName)
         {
-            char* addr_start = request->get_address();
-            char domain_size = *addr_start;
-            char* domain_name = addr_start + 1;
-            char cdomain_name[domain_size + 1];
-            cdomain_name[domain_size] = 0;
-            memcpy(cdomain_name, domain_name, domain_size);
-            in_addr addrs[10];
-            std::cout << "Resolving: " << cdomain_name << std::endl;
-            int count = resolve_dns(cdomain_name, addrs, 10);
-
-            if (count == -1)
+            std::string domain;
+            _get_domain(request, &domain);
+
+            std::cout << "Resolving: " << domain << std::endl;
+
+            DnsAnswer answer;
+            dns_resolve_cached(_settings->dns, domain, DnsType::A, &answer);
+
+            if (answer.status != DnsStatus::Ok)
             {
                 std::cerr << "Coudln't resolve IP address (resolve_dns)" << std::endl;
                 return -1;
             }
 
-            for (int i = 0; i < count; i++)
-            {
-                destinations->emplace_back(
-                    addrs[i],
-                    request->get_port()
-                );
-            }
+            _add_destinations(answer, request->get_port(), destinations);
         }
         else
         {
@@ -620,8 +1154,171 @@ namespace s5r
         return 0;
     }
 
+    bool Socks5Proxy::_apply_name_policy(S5RequestBody* request)
+    {
+        PolicyTable& policy = PolicyTable::shared();
+        std::string domain;
+
+        if (policy.empty() || !_get_domain(request, &domain))
+            return true;
+
+        const PolicyRule* rule;
+
+        // a destination network rule may come first, wait for the address
+        if (!policy.match_name(_cl_addr.sin_addr, ntohs(request->get_port()), domain, &rule))
+            return true;
+
+        _policy_decided = true;
+        return _follow_rule(rule);
+    }
+
+    bool Socks5Proxy::_apply_policy(S5RequestBody* request, std::vector<Destination>* destinations)
+    {
+        PolicyTable& policy = PolicyTable::shared();
+
+        if (policy.empty() || _policy_decided)
+            return true;
+
+        std::string domain;
+        bool has_domain = _get_domain(request, &domain);
+
+        // every address is matched, the first one allowed picks the rule
+        // and only addresses served by the same rule are raced
+        const PolicyRule* chosen = nullptr;
+        const PolicyRule* rejected = nullptr;
+        bool allowed = false;
+        size_t kept = 0;
+
+        for (size_t i = 0; i < destinations->size(); i++)
+        {
+            const PolicyRule* rule = policy.match(
+                _cl_addr.sin_addr,
+                (*destinations)[i].address,
+                ntohs(request->get_port()),
+                has_domain ? &domain : nullptr
+            );
+
+            if (rule && rule->action == PolicyAction::Reject)
+            {
+                if (!rejected)
+                    rejected = rule;
+
+                continue;
+            }
+
+            if (!allowed)
+            {
+                chosen = rule;
+                allowed = true;
+            }
+
+            if (rule == chosen)
+                (*destinations)[kept++] = (*destinations)[i];
+        }
+
+        destinations->erase(destinations->begin() + kept, destinations->end());
+
+        return _follow_rule(allowed ? chosen : rejected);
+    }
+
+    bool Socks5Proxy::_follow_rule(const PolicyRule* rule)
+    {
+        PolicyTable::shared().count(rule);
+
+        if (!rule)
+            return true;
+
+        switch (rule->action)
+        {
+        case PolicyAction::Reject:
+            return false;
+        case PolicyAction::Direct:
+            _route_ip.s_addr = INADDR_ANY;
+            break;
+        case PolicyAction::Route:
+            _route_ip = rule->route_ip;
+            break;
+        }
+
+        return true;
+    }
+
+    bool Socks5Proxy::_udp_name_allowed(const std::string& domain, uint16_t port)
+    {
+        PolicyTable& policy = PolicyTable::shared();
+        const PolicyRule* rule;
+
+        // a destination network rule may come first, the address decides
+        if (policy.empty() || !policy.match_name(_cl_addr.sin_addr, ntohs(port), domain, &rule))
+            return true;
+
+        return !rule || rule->action != PolicyAction::Reject;
+    }
+
+    const Destination* Socks5Proxy::_udp_allowed_destination(
+        const std::vector<Destination>& destinations,
+        const std::string* domain
+    ) {
+        PolicyTable& policy = PolicyTable::shared();
+
+        for (auto& destination : destinations)
+        {
+            if (policy.empty())
+                return &destination;
+
+            const PolicyRule* rule = policy.match(
+                _cl_addr.sin_addr,
+                destination.address,
+                ntohs(destination.port),
+                domain
+            );
+
+            if (!rule || rule->action != PolicyAction::Reject)
+                return &destination;
+        }
+
+        return nullptr;
+    }
+
+    bool Socks5Proxy::_get_domain(S5RequestBody* request, std::string* domain)
+    {
+        if (request->address.get_type() != S5Address::Type::DomainName)
+        {
+            return false;
+        }
+
+        char* addr_start = request->get_address();
+        unsigned char domain_size = *addr_start;
+
+        domain->assign(addr_start + 1, domain_size);
+        return true;
+    }
+
+    void Socks5Proxy::_add_destinations(
+        const DnsAnswer& answer,
+        uint16_t port,
+        std::vector<Destination>* destinations
+    ) {
+        for (auto& addr : answer.addrs)
+        {
+            destinations->emplace_back(addr, port);
+        }
+    }
+
     void Socks5Proxy::_send_request_status(S5RequestBody* request, char status)
     {
+        if (_replied)
+        {
+            // told the client it succeeded already (optimistic connect),
+            // resetting the connection is all that's left to report errors
+            if (status != 0x0)
+                set_socket_reset_on_close(_sock);
+
+            return;
+        }
+
+        _replied = true;
+
         auto buffer_size = request->get_size();
         char buffer[buffer_size];
         memcpy(buffer, (char*)request, buffer_size);
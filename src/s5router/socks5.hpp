@@ -1,10 +1,25 @@
 #pragma once
 
 #include "common/net.hpp"
+#include "common/event.hpp"
+#include "buffer_tuner.hpp"
+#include "connect_race.hpp"
+#include "dns.hpp"
+#include "ring_buffer.hpp"
+#include "settings.hpp"
+#include "udp_associations.hpp"
+#include "udp_fragments.hpp"
 #include <vector>
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
 // #include <iostream>
 
+#ifdef __linux__
+    #include "pipe_pool.hpp"
+#endif
+
 namespace s5r
 {
     enum class S5HandshakeStatus
@@ -75,7 +90,7 @@ namespace s5r
             case Type::IPv4Address:
                 return sizeof(in_addr) + 1;
             case Type::DomainName:
-                return 2 + addr_start;
+                return 2 + (unsigned char)addr_start;
             case Type::IPv6Address:
                 return sizeof(in6_addr) + 1;
             }
@@ -125,49 +140,530 @@ namespace s5r
         }
     };
 
-    struct Destination {
-        in_addr address;
-        uint16_t port;
+    // greeting/request header + longest domain (1 + 255) + port
+    static constexpr int S5_MAX_REQUEST_SIZE = 3 + 1 + 1 + 255 + 2;
+
+    // version, method count and every possible method
+    static constexpr int S5_MAX_GREETING_SIZE = 2 + 255;
+
+    // client handshake input, the longest greeting and request
+    // fit with room to spare for payload sent along with them
+    static constexpr int S5_HANDSHAKE_BUFFER_SIZE = 1024;
+
+    /**
+     * Resumable parser of what a client sends during the handshake.
+     * Input is taken in whatever pieces it arrives, messages split
+     * across segments wait for the rest and pipelined ones (greeting,
+     * request and first payload at once) are picked apart.
+     * Bytes received past the request are early data for the relay
+     **/
+    class S5HandshakeParser
+    {
+    public:
+        enum class Result
+        {
+            // nothing complete, receive more into space()
+            NeedMore,
+
+            // greeting() is complete
+            Greeting,
+
+            // request() is complete, whatever follows is early data
+            Request,
+
+            // not a SOCKS5 handshake
+            Invalid
+        };
+
+        // free part of the buffer to receive into
+        char* space()
+        {
+            return _buffer + _size;
+        }
+
+        int space_size() const
+        {
+            return S5_HANDSHAKE_BUFFER_SIZE - _size;
+        }
+
+        // `size` bytes were received into space()
+        void received(int size)
+        {
+            _size += size;
+        }
+
+        // parses the next message from the received bytes,
+        // the greeting first, then the request
+        Result next();
+
+        // valid after next() returned Greeting
+        char* greeting()
+        {
+            return _buffer + _message;
+        }
+
+        int greeting_size() const
+        {
+            return _message_size;
+        }
+
+        // valid once next() returned Request
+        S5RequestBody* request()
+        {
+            return reinterpret_cast<S5RequestBody*>(_buffer + _message);
+        }
+
+        // received past the request, not relayed yet
+        const char* early_data() const
+        {
+            return _buffer + _parsed;
+        }
+
+        int early_data_size() const
+        {
+            return _stage == Stage::Done ? _size - _parsed : 0;
+        }
+
+        void consume_early_data(int size)
+        {
+            _parsed += size;
+        }
+
+    private:
+        enum class Stage
+        {
+            Greeting,
+            Request,
+            Done
+        };
+
+        char _buffer[S5_HANDSHAKE_BUFFER_SIZE];
+        int _size = 0;
+
+        // where the message being parsed starts
+        int _parsed = 0;
+
+        // last complete message
+        int _message = 0;
+        int _message_size = 0;
+
+        Stage _stage = Stage::Greeting;
+    };
+
+    // UDP reply header with an IPv4 address
+    static constexpr int S5_UDP_REPLY_HEADER_SIZE = 3 + 1 + 4 + 2;
+
+    // holds any UDP datagram
+    static constexpr size_t S5_UDP_BUFFER_SIZE = 65536;
 
-        Destination(in_addr address, uint16_t port)
-            : address{address}, port{port} {}
+    // datagrams moved by one recvmmsg()/sendmmsg() at most
+    static constexpr unsigned int S5_UDP_BATCH_MAX = 64;
+
+    /**
+     * Prebuilt SOCKS5 reply headers of the remote peers one UDP
+     * association talks to. Replies send them as their own iovec
+     * instead of writing a header in front of every payload
+     **/
+    class UdpReplyHeaders
+    {
+    public:
+        // a batch never has more senders, so headers looked up
+        // for one batch stay valid until it is sent
+        static constexpr size_t CAPACITY = S5_UDP_BATCH_MAX;
+
+        // S5_UDP_REPLY_HEADER_SIZE bytes header for datagrams from
+        // `peer`, the least recently used peer makes room for new ones
+        const char* get(const sockaddr_in& peer);
+
+    private:
+        struct Entry
+        {
+            in_addr address;
+            uint16_t port;
+            uint64_t used;
+            char header[S5_UDP_REPLY_HEADER_SIZE];
+        };
+
+        // allocated on the first reply
+        std::unique_ptr<Entry[]> _entries;
+        size_t _size = 0;
+
+        // most associations talk to a single peer
+        size_t _last = 0;
+        uint64_t _clock = 0;
+
+    private:
+        // writes the header for a datagram coming from `sv_addr`
+        static void _build(char buffer[], const sockaddr_in& sv_addr);
+    };
+
+    struct S5UDPRelayState
+    {
+        // destinations of the last client datagram
+        std::vector<Destination> destinations;
+
+        // where replies are sent to
+        sockaddr_in cl_addr;
+
+        UdpReplyHeaders reply_headers;
+
+        // client datagrams split into fragments
+        UdpFragments fragments;
+
+        UdpCounters counters;
+
+        // sockets coalesce datagrams (UDP_GRO), received
+        // buffers have to be split into segments
+        bool gro = false;
+
+        // forwarded segments may leave as one UDP_SEGMENT send,
+        // cleared once the kernel refuses one
+        bool gso = false;
     };
 
+    struct PolicyRule;
+
+#ifdef __linux__
+    class EventLoop;
+#endif
+
+    /**
+     * One client session. Created by SessionPool and returned
+     * to it by the session itself once the client is done
+     **/
     class Socks5Proxy
+#ifdef __linux__
+        : public EventHandler
+#endif
     {
     public:
-        Socks5Proxy(const sockaddr_in& cl_addr, int sock, in_addr route_ip)
-            : _cl_addr{cl_addr}, _sock{sock}, _route_ip{route_ip} {}
+        Socks5Proxy(const sockaddr_in& cl_addr, int sock, in_addr route_ip, const S5Settings* settings)
+            : _cl_addr{cl_addr}, _sock{sock}, _route_ip{route_ip}, _settings{settings}
+        {
+            for (auto& tuner : _tuners)
+            {
+                tuner.configure(settings->relay_buffer_min, settings->relay_buffer_max, RING_BUFFER_SIZE);
+            }
+        }
 
         ~Socks5Proxy();
 
+        // serves the client on the calling thread (blocking)
         void serve();
 
+        const sockaddr_in& client_address() const
+        {
+            return _cl_addr;
+        }
+
+        // current relay buffer sizes (client -> route, route -> client)
+        size_t upstream_buffer_size() const
+        {
+            return _tuners[0].size();
+        }
+
+        size_t downstream_buffer_size() const
+        {
+            return _tuners[1].size();
+        }
+
+#ifdef __linux__
+        // serves the client from `loop` (non-blocking sockets only),
+        // the proxy destroys itself on the loop once finished
+        void start(EventLoop* loop);
+
+        void on_event(EventSource* source, uint32_t events) override;
+#endif
+
     private:
         sockaddr_in _cl_addr;
         int _sock;
         in_addr _route_ip;
+        const S5Settings* _settings;
+
+        // policy rules picked the route before the name was resolved
+        bool _policy_decided = false;
+
+        // 0: client -> route, 1: route -> client
+        BufferTuner _tuners[2];
+
+        S5HandshakeParser _parser;
+
+        // request was replied to
+        bool _replied = false;
+
+#ifdef __linux__
+    private:
+        // Reactor mode
+        enum class State
+        {
+            Greeting,
+            Request,
+            Resolving,
+            Connecting,
+            TCPRelay,
+            UDPRelay,
+            Closed
+        };
+
+        struct RelayBuffer
+        {
+            RingBuffer ring;
+
+            // valid when relaying through splice() instead of `ring`
+            Pipe pipe;
+
+            // source reached end of stream
+            bool eof = false;
+
+            // eof forwarded to destination
+            bool shut = false;
+
+            // source hung up: it isn't polled anymore and what
+            // the kernel still holds is read as the destination drains
+            bool hup = false;
+
+            bool is_spliced() const
+            {
+                return pipe.read_fd != -1;
+            }
+
+            // bytes read from the source, not written to destination yet
+            int pending() const
+            {
+                return is_spliced() ? pipe.size : (int)ring.size();
+            }
+
+            bool can_read() const
+            {
+                if (eof)
+                    return false;
+
+                return is_spliced() ? pipe.size < pipe.capacity : !ring.full();
+            }
+        };
+
+        State _state = State::Greeting;
+        EventLoop* _loop = nullptr;
+
+        EventSource _cl_source;
+        EventSource _rt_source;
+        EventSource _udp_source;
+
+        std::vector<Destination> _destinations;
+
+        // Resolver query of the request domain
+        uint64_t _resolve_query = 0;
+
+        ConnectRace _race;
+        uint64_t _connect_timer = 0;
+
+        // client -> route
+        RelayBuffer _upstream;
+        // route -> client
+        RelayBuffer _downstream;
+
+        S5UDPRelayState _udp;
+
+        // UDP_GRO is on for the association sockets
+        bool _udp_offload = false;
+
+        UdpIdleCheck _udp_idle;
+        uint64_t _udp_idle_timer = 0;
+
+        struct PendingDatagram
+        {
+            std::string domain;
+            uint16_t port;
+            std::vector<char> payload;
+        };
+
+        // client datagrams waiting for their domain to resolve
+        std::vector<PendingDatagram> _udp_pending;
+
+        // domain -> Resolver query
+        std::unordered_map<std::string, uint64_t> _udp_resolving;
+#endif
 
     private:
         int recv(char buffer[], int buffer_size);
         int send(char buffer[], int buffer_size);
 
     private:
+        // recv() into `ring` for `direction`, resizing it and the
+        // socket buffers first when its tuner asks for another size
+        int _tuned_recv(int direction, RingBuffer* ring, int from, int to);
+
         void _tcp_loop(int rt_sock);
         void _udp_loop(int rt_sock, int udp_sock);
+        void _udp_loop_poll(S5UDPRelayState* state, int rt_sock, int udp_sock);
+
+#ifdef __linux__
+        // io_uring variants of the loops, return false without
+        // relaying anything if the ring couldn't be set up
+        bool _tcp_loop_uring(int rt_sock);
+        bool _udp_loop_uring(S5UDPRelayState* state, int rt_sock, int udp_sock);
+
+        // splice() variant of _tcp_loop, returns false without
+        // relaying anything if no pipes could be created or
+        // the sockets can't be spliced
+        bool _tcp_loop_splice(int rt_sock);
+#endif
+
+        // forward received datagrams, returns how many were read
+        // (0 if nothing to read) and -1 on socket error
+        int _udp_from_client(S5UDPRelayState* state, int rt_sock, int udp_sock);
+        int _udp_from_route(S5UDPRelayState* state, int rt_sock, int udp_sock);
+
+#ifdef __linux__
+        // recvmmsg()/sendmmsg() variants moving up to udp_batch
+        // datagrams per call, same results as the ones above
+        int _udp_from_client_batch(S5UDPRelayState* state, int rt_sock, int udp_sock);
+        int _udp_from_route_batch(S5UDPRelayState* state, int rt_sock, int udp_sock);
+
+        // turns on UDP_GRO on both relay sockets when enabled in
+        // settings and supported, their datagrams then have to go
+        // through the batch variants above
+        bool _udp_enable_offload(int rt_sock, int udp_sock);
+#endif
+
+        // parses datagram received from the client, fills its route
+        // address and payload, returns payload size (-1 to drop it).
+        // Last fragment of a datagram gives the whole reassembled
+        // payload, held by state->fragments until the next fragment
+        int _udp_client_datagram(
+            S5UDPRelayState* state,
+            char buffer[],
+            int buffer_size,
+            sockaddr_in* sv_addr,
+            const char** payload
+        );
 
         S5HandshakeStatus _handshake(int* out_sock, S5Command* command, int* out_udp_sock);
 
+        // receives until _parser has the next message (blocking)
+        S5HandshakeParser::Result _recv_handshake();
+
+        // sends what the client pipelined behind its request to the
+        // route, returns false on error. On a non-blocking socket
+        // whatever doesn't fit stays in _parser
+        bool _send_early_data(int rt_sock);
+
+        // hands early data to `race` for the SYN when TCP Fast Open
+        // is on. After an optimistic reply whatever the client sent
+        // since is picked up first
+        void _prepare_fast_open(ConnectRace* race);
+
+        // replies to the greeting with chosen auth method
+        S5HandshakeStatus _negotiate_auth(char buffer[], int buffer_size);
+
+        // takes route/client UDP sockets from the pool and replies with the bound address
+        S5HandshakeStatus _associate_udp(
+            S5RequestBody* request,
+            std::vector<Destination>* destinations,
+            int* out_sock,
+            int* out_udp_sock
+        );
+
+        void _log_tunnel(const sockaddr_in& server_address, const char* suffix);
+
         bool _verify_version(char version);
 
         void _choose_auth_method(char method);
 
         int _create_tcp_socket(std::vector<Destination>* destinations);
-        int _create_udp_socket(std::vector<Destination>* destinations);
+        int _create_udp_socket();
 
-        // returns 0 if success
+        // returns 0 if success, resolves domain names (blocking)
         int _extract_address(S5RequestBody* request, std::vector<Destination>* destinations);
 
+        // decides a CONNECT to a domain name by the policy rules before
+        // it's resolved if they allow it (see PolicyTable::match_name()),
+        // false if they reject it
+        bool _apply_name_policy(S5RequestBody* request);
+
+        // picks _route_ip for a CONNECT by the policy rules unless that
+        // was decided before resolving. Destinations the first allowed
+        // one's rule doesn't match are dropped, false if none is left
+        bool _apply_policy(S5RequestBody* request, std::vector<Destination>* destinations);
+
+        // counts `rule` and picks _route_ip by it, false if it rejects
+        bool _follow_rule(const PolicyRule* rule);
+
+        // UDP datagrams only honor reject rules, the association
+        // sockets are bound already. False if the rules reject a
+        // datagram to `domain` before it's resolved
+        bool _udp_name_allowed(const std::string& domain, uint16_t port);
+
+        // first of `destinations` the rules don't reject a datagram to,
+        // nullptr if they reject every one
+        const Destination* _udp_allowed_destination(
+            const std::vector<Destination>& destinations,
+            const std::string* domain
+        );
+
+        // true if request addresses a domain name, copied to `domain`
+        static bool _get_domain(S5RequestBody* request, std::string* domain);
+
+        static void _add_destinations(
+            const DnsAnswer& answer,
+            uint16_t port,
+            std::vector<Destination>* destinations
+        );
+
+        // replies to the request once, after an optimistic success
+        // reply failures make the client connection reset on close
         void _send_request_status(S5RequestBody* request, char status);
+
+#ifdef __linux__
+    private:
+        // Reactor mode state machine
+        void _on_handshake();
+        void _on_resolved(const DnsAnswer& answer);
+
+        // runs the command of _request once _destinations are known
+        void _on_request();
+        void _on_connecting(EventSource* source);
+        void _on_tcp_relay(EventSource* source, uint32_t events);
+        void _on_udp_relay(EventSource* source, uint32_t events);
+
+        // threaded mode: continues an association on a shared
+        // UDP worker `loop` once the handshake thread is done
+        void _start_udp(EventLoop* loop, int rt_sock, int udp_sock);
+
+        // starts relaying the sockets in _rt_source/_udp_source
+        void _on_udp_associated();
+        void _on_udp_idle();
+
+        // races connects to _destinations, returns false if none could be started
+        bool _start_connect();
+
+        // registers new attempts and re-arms the race timer,
+        // switches to relaying once won, returns false if every attempt failed
+        bool _sync_connect();
+        void _on_connected();
+        void _on_connect_failed();
+
+        // moves early data _send_early_data() left over into _upstream
+        bool _buffer_early_data();
+
+        // returns -1 if tunnel must be closed
+        int _relay_read(int from, RelayBuffer* buffer);
+        int _relay_write(int to, RelayBuffer* buffer);
+
+        // reads a hung up source while `to` takes its data
+        int _drain_hung_up(int from, RelayBuffer* buffer, int to);
+
+        void _update_relay_events();
+
+        // switches both directions to splice() if configured and pipes are available
+        void _setup_splice();
+
+        // queues client datagram until `domain` is resolved
+        void _udp_resolve(const std::string& domain, uint16_t port, const char payload[], int size);
+        void _udp_on_resolved(const std::string& domain, const DnsAnswer& answer);
+
+        void _close();
+#endif
     };
 }
\ No newline at end of file
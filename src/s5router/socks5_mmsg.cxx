@@ -0,0 +1,488 @@
+#include "socks5.hpp"
+#include "buffer_pool.hpp"
+#include "common/error.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+/**
+ * recvmmsg()/sendmmsg() variants of the UDP forwarding helpers.
+ * One wake-up drains up to udp_batch datagrams with a single
+ * receive and forwards them with a single send, instead of a
+ * recvfrom + sendto pair per datagram.
+ * With UDP_GRO the kernel also coalesces a flow's datagrams into
+ * one buffer of equal sized segments, those are split here, their
+ * SOCKS5 headers stripped or added per segment, and sent again as
+ * one UDP_SEGMENT (GSO) send whenever the segments allow it.
+ * Forwarded datagrams are gathered with iovecs, payloads are
+ * never copied and reply headers come from the peer table
+ **/
+
+namespace s5r
+{
+    // room for the UDP_GRO/UDP_SEGMENT segment size control message
+    static constexpr size_t UDP_CONTROL_SIZE = CMSG_SPACE(sizeof(int));
+
+    // limits of a single UDP_SEGMENT send
+    static constexpr size_t UDP_GSO_MAX_BYTES = 65507;
+    static constexpr unsigned int UDP_GSO_MAX_SEGMENTS = 64;
+
+    // iovecs of everything queued for one sendmmsg()
+    static constexpr unsigned int UDP_BATCH_IOVECS = 512;
+
+    struct UdpBatch
+    {
+        int sock;
+        S5UDPRelayState* state;
+
+        PooledBuffer buffers[S5_UDP_BATCH_MAX];
+
+        mmsghdr received[S5_UDP_BATCH_MAX];
+        iovec received_iov[S5_UDP_BATCH_MAX];
+        sockaddr_in senders[S5_UDP_BATCH_MAX];
+        alignas(cmsghdr) char received_control[S5_UDP_BATCH_MAX][UDP_CONTROL_SIZE];
+
+        // forwarded datagrams gathered from received buffers
+        // and reply headers without copying them
+        mmsghdr forwarded[S5_UDP_BATCH_MAX];
+        sockaddr_in destinations[S5_UDP_BATCH_MAX];
+        alignas(cmsghdr) char forwarded_control[S5_UDP_BATCH_MAX][UDP_CONTROL_SIZE];
+        uint16_t segment_sizes[S5_UDP_BATCH_MAX];
+        unsigned int pending = 0;
+
+        iovec iovecs[UDP_BATCH_IOVECS];
+        unsigned int iovecs_used = 0;
+
+        UdpBatch(int sock, S5UDPRelayState* state)
+            : sock(sock), state(state)
+        {
+        }
+
+        // borrows buffers and sets up receive headers.
+        // Returns the batch size
+        unsigned int prepare(unsigned int size)
+        {
+            size = std::min(size, S5_UDP_BATCH_MAX);
+
+            for (unsigned int i = 0; i < size; i++)
+            {
+                if (!buffers[i].acquire(S5_UDP_BUFFER_SIZE))
+                    return i;
+
+                received_iov[i].iov_base = buffers[i].data();
+                received_iov[i].iov_len = S5_UDP_BUFFER_SIZE;
+
+                memset(&received[i], 0, sizeof(mmsghdr));
+                received[i].msg_hdr.msg_name = &senders[i];
+                received[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+                received[i].msg_hdr.msg_iov = &received_iov[i];
+                received[i].msg_hdr.msg_iovlen = 1;
+
+                if (state->gro)
+                {
+                    received[i].msg_hdr.msg_control = received_control[i];
+                    received[i].msg_hdr.msg_controllen = UDP_CONTROL_SIZE;
+                }
+            }
+
+            return size;
+        }
+
+        // segment size of a coalesced datagram, 0 for a plain one
+        int segment_size(unsigned int index)
+        {
+            msghdr* header = &received[index].msg_hdr;
+
+            for (cmsghdr* control = CMSG_FIRSTHDR(header); control; control = CMSG_NXTHDR(header, control))
+            {
+                if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+                {
+                    int size;
+                    memcpy(&size, CMSG_DATA(control), sizeof(int));
+                    return size;
+                }
+            }
+
+            return 0;
+        }
+
+        // room for up to `count` iovecs of the next forward(),
+        // sends what is queued first if there is none left
+        iovec* reserve(unsigned int count)
+        {
+            if (pending == S5_UDP_BATCH_MAX || iovecs_used + count > UDP_BATCH_IOVECS)
+                flush();
+
+            return iovecs + iovecs_used;
+        }
+
+        // queues a datagram gathered from `count` iovecs returned by
+        // the last reserve(), cut into `segment` sized datagrams by
+        // the kernel when it isn't 0
+        void forward(iovec* iov, unsigned int count, const sockaddr_in& destination, int segment = 0)
+        {
+            unsigned int index = pending++;
+            iovecs_used = (iov - iovecs) + count;
+
+            size_t size = 0;
+
+            for (unsigned int i = 0; i < count; i++)
+                size += iov[i].iov_len;
+
+            destinations[index] = destination;
+
+            memset(&forwarded[index], 0, sizeof(mmsghdr));
+            forwarded[index].msg_hdr.msg_name = &destinations[index];
+            forwarded[index].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            forwarded[index].msg_hdr.msg_iov = iov;
+            forwarded[index].msg_hdr.msg_iovlen = count;
+
+            segment_sizes[index] = (segment > 0 && size > (size_t)segment) ? segment : 0;
+
+            if (segment_sizes[index] == 0)
+                return;
+
+            forwarded[index].msg_hdr.msg_control = forwarded_control[index];
+            forwarded[index].msg_hdr.msg_controllen = UDP_CONTROL_SIZE;
+
+            cmsghdr* control = CMSG_FIRSTHDR(&forwarded[index].msg_hdr);
+            control->cmsg_level = SOL_UDP;
+            control->cmsg_type = UDP_SEGMENT;
+            control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+            uint16_t segment_size = segment_sizes[index];
+            memcpy(CMSG_DATA(control), &segment_size, sizeof(uint16_t));
+        }
+
+        // sends everything queued, datagrams the kernel refuses
+        // are dropped like with sendto
+        void flush()
+        {
+            unsigned int sent = 0;
+
+            while (sent < pending)
+            {
+                int result = sendmmsg(sock, forwarded + sent, pending - sent, 0);
+
+                if (result != -1)
+                {
+                    sent += result;
+                    continue;
+                }
+
+                int error = get_last_socket_error();
+
+                // full socket buffer, the rest would fail as well
+                if (socket_would_block())
+                    break;
+
+                // no segmentation offload on this path (or the segments
+                // don't fit its MTU), send them one by one from now on
+                if (segment_sizes[sent] && (error == EINVAL || error == EIO))
+                {
+                    state->gso = false;
+                    _send_segments(sent);
+                }
+
+                // skip the datagram that failed
+                sent++;
+            }
+
+            pending = 0;
+            iovecs_used = 0;
+        }
+
+    private:
+        void _send_segments(unsigned int index)
+        {
+            msghdr& message = forwarded[index].msg_hdr;
+            size_t segment = segment_sizes[index];
+
+            // position in message iovecs
+            size_t from = 0;
+            size_t offset = 0;
+
+            while (from < message.msg_iovlen)
+            {
+                // a segment spans a header and a payload at most
+                iovec parts[2];
+                size_t count = 0;
+                size_t size = 0;
+
+                while (size < segment && from < message.msg_iovlen && count < 2)
+                {
+                    iovec& iov = message.msg_iov[from];
+                    size_t take = std::min(segment - size, iov.iov_len - offset);
+
+                    parts[count].iov_base = (char*)iov.iov_base + offset;
+                    parts[count].iov_len = take;
+                    count++;
+
+                    size += take;
+                    offset += take;
+
+                    if (offset == iov.iov_len)
+                    {
+                        from++;
+                        offset = 0;
+                    }
+                }
+
+                msghdr single;
+                memset(&single, 0, sizeof(msghdr));
+                single.msg_name = message.msg_name;
+                single.msg_namelen = message.msg_namelen;
+                single.msg_iov = parts;
+                single.msg_iovlen = count;
+
+                ::sendmsg(sock, &single, 0);
+            }
+        }
+    };
+
+    // recvmmsg() on a readable socket, 0 if nothing is waiting after all
+    static int _receive_batch(int sock, UdpBatch* batch, unsigned int size)
+    {
+        // don't wait for a full batch, take what is queued
+        int received = recvmmsg(sock, batch->received, size, MSG_DONTWAIT, nullptr);
+
+        if (received == -1)
+            return socket_would_block() ? 0 : -1;
+
+        return received;
+    }
+
+    static bool _same_destination(const sockaddr_in& a, const sockaddr_in& b)
+    {
+        return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+    }
+
+    bool Socks5Proxy::_udp_enable_offload(int rt_sock, int udp_sock)
+    {
+        if (!_settings->udp_offload)
+            return false;
+
+        int enable = 1;
+
+        // kernels without UDP_GRO (< 5.0) refuse it, UDP_SEGMENT is older
+        if (setsockopt(rt_sock, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == -1)
+            return false;
+
+        if (setsockopt(udp_sock, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == -1)
+        {
+            enable = 0;
+            setsockopt(rt_sock, SOL_UDP, UDP_GRO, &enable, sizeof(enable));
+            return false;
+        }
+
+        return true;
+    }
+
+    int Socks5Proxy::_udp_from_client_batch(S5UDPRelayState* state, int rt_sock, int udp_sock)
+    {
+        UdpBatch batch(rt_sock, state);
+        unsigned int size = batch.prepare(_settings->udp_batch);
+
+        if (size == 0)
+            return -1;
+
+        int received = _receive_batch(udp_sock, &batch, size);
+
+        if (received <= 0)
+            return received;
+
+        uint64_t datagrams = 0;
+        uint64_t bytes = 0;
+
+        for (int i = 0; i < received; i++)
+        {
+            msghdr& header = batch.received[i].msg_hdr;
+
+            if (header.msg_flags & MSG_TRUNC)
+                continue;
+
+            char* data = batch.buffers[i].data();
+            int data_size = (int)batch.received[i].msg_len;
+            int segment = batch.segment_size(i);
+
+            if (segment <= 0)
+                segment = std::max(data_size, 1);
+
+            datagrams += (data_size + segment - 1) / segment;
+            bytes += data_size;
+
+            // replies go to whoever sent last
+            state->cl_addr = batch.senders[i];
+
+            // payloads of consecutive segments going to the same place
+            // are gathered into one segmented send
+            iovec* run = nullptr;
+            unsigned int run_count = 0;
+            int run_size = 0;
+            int run_segment = 0;
+            sockaddr_in run_addr;
+
+            for (int position = 0; position < data_size; position += segment)
+            {
+                char* datagram = data + position;
+                int datagram_size = std::min(segment, data_size - position);
+
+                sockaddr_in sv_addr;
+                const char* payload;
+                int payload_size = _udp_client_datagram(state, datagram, datagram_size, &sv_addr, &payload);
+
+                if (payload_size == -1)
+                    continue;
+
+                if (state->fragments.holds(payload))
+                {
+                    // reassembled, has to leave before the next fragment
+                    // of this batch reuses its buffer
+                    if (run)
+                        batch.forward(run, run_count, run_addr, run_segment);
+
+                    run = nullptr;
+
+                    iovec* whole = batch.reserve(1);
+                    whole->iov_base = (void*)payload;
+                    whole->iov_len = payload_size;
+
+                    batch.forward(whole, 1, sv_addr);
+                    batch.flush();
+                    continue;
+                }
+
+                // only the last segment of a send may be shorter
+                bool joins = run
+                    && state->gso
+                    && payload_size <= run_segment
+                    && run_count < UDP_GSO_MAX_SEGMENTS
+                    && (size_t)(run_size + payload_size) <= UDP_GSO_MAX_BYTES
+                    && _same_destination(sv_addr, run_addr);
+
+                if (!joins)
+                {
+                    if (run)
+                        batch.forward(run, run_count, run_addr, run_segment);
+
+                    run = batch.reserve(UDP_GSO_MAX_SEGMENTS);
+                    run_count = 0;
+                    run_size = 0;
+                    run_segment = payload_size;
+                    run_addr = sv_addr;
+                }
+
+                run[run_count].iov_base = (void*)payload;
+                run[run_count].iov_len = payload_size;
+                run_count++;
+                run_size += payload_size;
+
+                if (payload_size < run_segment)
+                {
+                    batch.forward(run, run_count, run_addr, run_segment);
+                    run = nullptr;
+                }
+            }
+
+            if (run)
+                batch.forward(run, run_count, run_addr, run_segment);
+        }
+
+        state->counters.on_client(datagrams, bytes);
+
+        batch.flush();
+        return received;
+    }
+
+    int Socks5Proxy::_udp_from_route_batch(S5UDPRelayState* state, int rt_sock, int udp_sock)
+    {
+        UdpBatch batch(udp_sock, state);
+        unsigned int size = batch.prepare(_settings->udp_batch);
+
+        if (size == 0)
+            return -1;
+
+        int received = _receive_batch(rt_sock, &batch, size);
+
+        if (received <= 0)
+            return received;
+
+        uint64_t datagrams = 0;
+        uint64_t bytes = 0;
+
+        for (int i = 0; i < received; i++)
+        {
+            int segment = batch.segment_size(i);
+            int data_size = (int)batch.received[i].msg_len;
+
+            datagrams += segment > 0 ? (data_size + segment - 1) / segment : 1;
+            bytes += data_size;
+        }
+
+        state->counters.on_remote(datagrams, bytes);
+
+        // nobody to reply to yet
+        if (state->cl_addr.sin_port == 0)
+            return received;
+
+        for (int i = 0; i < received; i++)
+        {
+            if (batch.received[i].msg_hdr.msg_flags & MSG_TRUNC)
+                continue;
+
+            char* data = batch.buffers[i].data();
+            int data_size = (int)batch.received[i].msg_len;
+            int segment = batch.segment_size(i);
+
+            // every datagram (or segment) is sent behind the
+            // sender's header, gathered from the peer table
+            char* header = (char*)state->reply_headers.get(batch.senders[i]);
+
+            if (segment <= 0 || data_size <= segment)
+            {
+                iovec* iov = batch.reserve(2);
+                iov[0].iov_base = header;
+                iov[0].iov_len = S5_UDP_REPLY_HEADER_SIZE;
+                iov[1].iov_base = data;
+                iov[1].iov_len = data_size;
+
+                batch.forward(iov, 2, state->cl_addr);
+                continue;
+            }
+
+            int reply_segment = segment + S5_UDP_REPLY_HEADER_SIZE;
+
+            // segments per send, one per send without offload
+            int per_send = state->gso
+                ? (int)std::min<size_t>(UDP_GSO_MAX_SEGMENTS, UDP_GSO_MAX_BYTES / reply_segment)
+                : 1;
+
+            for (int position = 0; position < data_size; )
+            {
+                iovec* iov = batch.reserve(2 * per_send);
+                unsigned int count = 0;
+
+                for (int n = 0; n < per_send && position < data_size; n++)
+                {
+                    int payload_size = std::min(segment, data_size - position);
+
+                    iov[count].iov_base = header;
+                    iov[count].iov_len = S5_UDP_REPLY_HEADER_SIZE;
+                    iov[count + 1].iov_base = data + position;
+                    iov[count + 1].iov_len = payload_size;
+                    count += 2;
+
+                    position += payload_size;
+                }
+
+                batch.forward(iov, count, state->cl_addr, reply_segment);
+            }
+        }
+
+        batch.flush();
+        return received;
+    }
+}
@@ -0,0 +1,928 @@
+#include "socks5.hpp"
+#include "dns_cache.hpp"
+#include "memory_budget.hpp"
+#include "pipe_pool.hpp"
+#include "reactor.hpp"
+#include "resolver.hpp"
+#include "session_pool.hpp"
+#include "udp_socket_pool.hpp"
+#include "utils.hpp"
+#include "common/error.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+/**
+ * Reactor mode of Socks5Proxy.
+ * Same protocol as serve(), but driven by EventLoop
+ * events as a state machine instead of blocking calls
+ **/
+
+namespace s5r
+{
+    // datagrams read per wake-up before yielding to other sessions
+    static constexpr int UDP_DRAIN_LIMIT = 64;
+
+    // client datagrams held while their domain is being resolved
+    static constexpr size_t UDP_PENDING_LIMIT = 32;
+
+    void Socks5Proxy::start(EventLoop* loop)
+    {
+        _loop = loop;
+        _state = State::Greeting;
+
+        _cl_source.fd = _sock;
+        _cl_source.handler = this;
+        _rt_source.handler = this;
+        _udp_source.handler = this;
+
+        if (!_loop->add(&_cl_source, EPOLLIN))
+        {
+            std::cerr << "Couldn't register client socket" << std::endl;
+            SessionPool::destroy(this);
+        }
+    }
+
+    void Socks5Proxy::on_event(EventSource* source, uint32_t events)
+    {
+        switch (_state)
+        {
+        case State::Greeting:
+        case State::Request:
+            _on_handshake();
+            break;
+        case State::Resolving:
+            if (events & (EPOLLHUP | EPOLLERR))
+            {
+                // client gave up while resolving
+                _close();
+            }
+            break;
+        case State::Connecting:
+            if (source != &_cl_source)
+            {
+                _on_connecting(source);
+            }
+            else if (events & (EPOLLHUP | EPOLLERR))
+            {
+                // client gave up before route connected
+                _close();
+            }
+            break;
+        case State::TCPRelay:
+            // skip attempts that lost the connect race in this batch
+            if (source == &_cl_source || source == &_rt_source)
+            {
+                _on_tcp_relay(source, events);
+            }
+            break;
+        case State::UDPRelay:
+            _on_udp_relay(source, events);
+            break;
+        case State::Closed:
+            break;
+        }
+    }
+
+    void Socks5Proxy::_on_handshake()
+    {
+        int size = this->recv(_parser.space(), _parser.space_size());
+
+        if (size == -1 && socket_would_block())
+        {
+            return;
+        }
+
+        if (size <= 0)
+        {
+            _close();
+            return;
+        }
+
+        _parser.received(size);
+
+        // a pipelining client may have sent the request along
+        auto result = _parser.next();
+
+        if (result == S5HandshakeParser::Result::Greeting)
+        {
+            if (_negotiate_auth(_parser.greeting(), _parser.greeting_size()) != S5HandshakeStatus::Ok)
+            {
+                _close();
+                return;
+            }
+
+            _state = State::Request;
+            result = _parser.next();
+        }
+
+        if (result == S5HandshakeParser::Result::NeedMore)
+        {
+            return;
+        }
+
+        if (result != S5HandshakeParser::Result::Request)
+        {
+            _close();
+            return;
+        }
+
+        S5RequestBody* request = _parser.request();
+
+        // client must wait for the reply, don't read until then
+        _loop->modify(&_cl_source, 0);
+
+        if (!MemoryBudget::shared().admit())
+        {
+            std::cerr << "Out of memory budget, refusing request" << std::endl;
+            _send_request_status(request, 0x01);
+            _close();
+            return;
+        }
+
+        // the client may send payload while the route is resolved and
+        // connected, it waits in the socket buffer until then
+        if (_settings->optimistic_connect && request->get_cmd() == S5Command::TCPStream)
+        {
+            _send_request_status(request, 0x0);
+        }
+
+        // names the rules reject aren't even resolved
+        if (request->get_cmd() == S5Command::TCPStream && !_apply_name_policy(request))
+        {
+            std::cerr << "[12] Connection not allowed by ruleset" << std::endl;
+            _send_request_status(request, 0x02);
+            _close();
+            return;
+        }
+
+        std::string domain;
+
+        if (_get_domain(request, &domain))
+        {
+            DnsAnswer answer;
+
+            if (Resolver::local(_loop, &_settings->dns).lookup(domain, DnsType::A, &answer))
+            {
+                _on_resolved(answer);
+                return;
+            }
+
+            _state = State::Resolving;
+            _resolve_query = Resolver::local(_loop, &_settings->dns).resolve(
+                domain,
+                DnsType::A,
+                [this](const DnsAnswer& answer) -> void {
+                    _resolve_query = 0;
+                    _on_resolved(answer);
+                }
+            );
+
+            if (_resolve_query == 0)
+            {
+                answer.status = DnsStatus::Error;
+                _on_resolved(answer);
+            }
+
+            return;
+        }
+
+        if (_extract_address(request, &_destinations))
+        {
+            std::cerr << "[4] extract address -1" << std::endl;
+            _send_request_status(request, 0x01);
+            _close();
+            return;
+        }
+
+        _on_request();
+    }
+
+    void Socks5Proxy::_on_resolved(const DnsAnswer& answer)
+    {
+        S5RequestBody* request = _parser.request();
+
+        if (answer.status != DnsStatus::Ok)
+        {
+            std::cerr << "Coudln't resolve IP address (resolver)" << std::endl;
+            _send_request_status(request, 0x04);
+            _close();
+            return;
+        }
+
+        _add_destinations(answer, request->get_port(), &_destinations);
+        _on_request();
+    }
+
+    void Socks5Proxy::_on_request()
+    {
+        S5RequestBody* request = _parser.request();
+
+        switch (request->get_cmd())
+        {
+        case S5Command::TCPStream:
+            if (!_apply_policy(request, &_destinations))
+            {
+                std::cerr << "[12] Connection not allowed by ruleset" << std::endl;
+                _send_request_status(request, 0x02);
+                _close();
+                break;
+            }
+
+            _state = State::Connecting;
+
+            if (!_start_connect())
+            {
+                _on_connect_failed();
+            }
+            break;
+        case S5Command::UDPPort:
+        {
+            int rt_sock = -1;
+            int udp_sock = -1;
+
+            auto status = _associate_udp(request, &_destinations, &rt_sock, &udp_sock);
+
+            // let _close() release whatever was opened
+            _rt_source.fd = rt_sock;
+            _udp_source.fd = udp_sock;
+
+            if ((status != S5HandshakeStatus::Ok)
+                && (status != S5HandshakeStatus::OkUDPAssociationRequired))
+            {
+                _close();
+                return;
+            }
+
+            _on_udp_associated();
+            break;
+        }
+        case S5Command::TCPPort:
+            std::cerr << "[6] TCP port binding failed" << std::endl;
+            _send_request_status(request, 0x07);
+            _close();
+            break;
+        default:
+            std::cerr << "[11] Unknown command" << std::endl;
+            _send_request_status(request, 0x07);
+            _close();
+            break;
+        }
+    }
+
+    bool Socks5Proxy::_start_connect()
+    {
+        _prepare_fast_open(&_race);
+
+        _race.start(
+            _route_ip,
+            _destinations,
+            _settings->connect_delay_ms,
+            _settings->connect_timeout_ms,
+            this
+        );
+
+        return _sync_connect();
+    }
+
+    bool Socks5Proxy::_sync_connect()
+    {
+        if (_race.winner() != -1)
+        {
+            _on_connected();
+            return true;
+        }
+
+        if (_race.is_done())
+        {
+            return false;
+        }
+
+        // closed attempts leave epoll by themselves
+        for (auto& attempt : _race.attempts())
+        {
+            if (attempt.source.fd != -1 && attempt.source.events == 0)
+            {
+                if (!_loop->add(&attempt.source, EPOLLOUT))
+                {
+                    return false;
+                }
+            }
+        }
+
+        _loop->cancel_timer(_connect_timer);
+        _connect_timer = 0;
+
+        int timeout = _race.timeout_ms();
+
+        if (timeout != -1)
+        {
+            _connect_timer = _loop->add_timer(timeout, [this]() -> void {
+                _connect_timer = 0;
+                _race.update();
+
+                if (!_sync_connect())
+                {
+                    _on_connect_failed();
+                }
+            });
+        }
+
+        return true;
+    }
+
+    void Socks5Proxy::_on_connecting(EventSource* source)
+    {
+        _race.on_writable(source);
+
+        if (!_sync_connect())
+        {
+            _on_connect_failed();
+        }
+    }
+
+    void Socks5Proxy::_on_connected()
+    {
+        _loop->cancel_timer(_connect_timer);
+        _connect_timer = 0;
+
+        for (auto& attempt : _race.attempts())
+        {
+            if (attempt.source.fd != -1)
+            {
+                _loop->remove(&attempt.source);
+            }
+        }
+
+        _rt_source.fd = _race.take_winner();
+
+        // what went out with the SYN isn't sent again
+        _parser.consume_early_data(_race.fast_open_sent());
+
+        if (!_loop->add(&_rt_source, 0))
+        {
+            std::cerr << "Couldn't register route socket" << std::endl;
+            _close();
+            return;
+        }
+
+        S5RequestBody* request = _parser.request();
+
+        _send_request_status(request, 0x0);
+        _state = State::TCPRelay;
+
+        // payload pipelined behind the request goes first, what the
+        // new socket doesn't take waits in the ring (no splicing then)
+        if (!_send_early_data(_rt_source.fd) || !_buffer_early_data())
+        {
+            _close();
+            return;
+        }
+
+        if (_upstream.ring.empty())
+        {
+            _setup_splice();
+        }
+
+        sockaddr_in server_address;
+        get_socket_addr(_rt_source.fd, &server_address);
+        _log_tunnel(server_address, "TCP");
+
+        _update_relay_events();
+    }
+
+    bool Socks5Proxy::_buffer_early_data()
+    {
+        while (_parser.early_data_size() > 0)
+        {
+            size_t len;
+            char* ptr = _upstream.ring.write_ptr(&len);
+
+            if (!ptr || len == 0)
+                return false;
+
+            len = std::min<size_t>(len, _parser.early_data_size());
+            memcpy(ptr, _parser.early_data(), len);
+
+            _upstream.ring.produce(len);
+            _parser.consume_early_data((int)len);
+        }
+
+        return true;
+    }
+
+    void Socks5Proxy::_on_connect_failed()
+    {
+        std::cerr << "[5] TCP socket creation failed" << std::endl;
+        _send_request_status(_parser.request(), 0x01);
+        _close();
+    }
+
+    void Socks5Proxy::_on_tcp_relay(EventSource* source, uint32_t events)
+    {
+        if (events & EPOLLERR)
+        {
+            _close();
+            return;
+        }
+
+        bool from_client = source == &_cl_source;
+
+        // data read from `source` and data to be written into it
+        RelayBuffer* in = from_client ? &_upstream : &_downstream;
+        RelayBuffer* out = from_client ? &_downstream : &_upstream;
+        int other = from_client ? _rt_source.fd : _sock;
+
+        if (events & EPOLLHUP)
+        {
+            // end of the stream for reading, the hang up is
+            // reported on every wait so the source is detached
+            _loop->remove(source);
+            in->hup = true;
+
+            if (_drain_hung_up(source->fd, in, other) == -1)
+            {
+                _close();
+                return;
+            }
+        }
+        else if (events & EPOLLIN)
+        {
+            if (_relay_read(source->fd, in) == -1
+                || _relay_write(other, in) == -1)
+            {
+                _close();
+                return;
+            }
+        }
+
+        if (events & EPOLLOUT)
+        {
+            if (_relay_write(source->fd, out) == -1)
+            {
+                _close();
+                return;
+            }
+
+            if (out->hup && _drain_hung_up(other, out, source->fd) == -1)
+            {
+                _close();
+                return;
+            }
+        }
+
+        // both directions reached eof and were flushed
+        if (_upstream.shut && _downstream.shut)
+        {
+            _close();
+            return;
+        }
+
+        _update_relay_events();
+    }
+
+    int Socks5Proxy::_drain_hung_up(int from, RelayBuffer* buffer, int to)
+    {
+        if (_relay_write(to, buffer) == -1)
+            return -1;
+
+        while (!buffer->eof && buffer->can_read())
+        {
+            int size = _relay_read(from, buffer);
+
+            if (size == -1)
+                return -1;
+
+            // nothing more can arrive after a hang up
+            if (size == 0)
+                buffer->eof = true;
+
+            // forwards eof as well once the rest is written
+            if (_relay_write(to, buffer) == -1)
+                return -1;
+        }
+
+        return 0;
+    }
+
+    int Socks5Proxy::_relay_read(int from, RelayBuffer* buffer)
+    {
+        if (!buffer->can_read())
+        {
+            return 0;
+        }
+
+        int size;
+
+        if (buffer->is_spliced())
+        {
+            size = splice(
+                from,
+                nullptr,
+                buffer->pipe.write_fd,
+                nullptr,
+                buffer->pipe.capacity - buffer->pipe.size,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+            );
+
+            if (size == -1 && errno == EINVAL && buffer->pipe.size == 0)
+            {
+                // socket type can't be spliced, copy this direction instead
+                PipePool::local().release(&buffer->pipe);
+                return _relay_read(from, buffer);
+            }
+        }
+        else
+        {
+            int direction = (buffer == &_upstream) ? 0 : 1;
+            int to = (direction == 0) ? _rt_source.fd : _sock;
+
+            size = _tuned_recv(direction, &buffer->ring, from, to);
+        }
+
+        if (size == 0)
+        {
+            buffer->eof = true;
+            return 0;
+        }
+
+        if (size == -1)
+        {
+            return socket_would_block() ? 0 : -1;
+        }
+
+        if (buffer->is_spliced())
+        {
+            buffer->pipe.size += size;
+        }
+
+        return size;
+    }
+
+    int Socks5Proxy::_relay_write(int to, RelayBuffer* buffer)
+    {
+        while (buffer->pending() > 0)
+        {
+            int sent;
+
+            if (buffer->is_spliced())
+            {
+                sent = splice(
+                    buffer->pipe.read_fd,
+                    nullptr,
+                    to,
+                    nullptr,
+                    buffer->pipe.size,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+                );
+            }
+            else
+            {
+                sent = buffer->ring.send(to, MSG_NOSIGNAL);
+            }
+
+            if (sent == -1)
+            {
+                return socket_would_block() ? 0 : -1;
+            }
+
+            if (buffer->is_spliced())
+                buffer->pipe.size -= sent;
+        }
+
+        if (buffer->eof && !buffer->shut)
+        {
+            ::shutdown(to, SHUT_WR);
+            buffer->shut = true;
+        }
+
+        return 0;
+    }
+
+    void Socks5Proxy::_update_relay_events()
+    {
+        uint32_t cl_events = 0;
+        uint32_t rt_events = 0;
+
+        // read a side only while there is room for its data,
+        // wait for writability while data is pending
+        if (_upstream.can_read())
+            cl_events |= EPOLLIN;
+        if (_upstream.pending())
+            rt_events |= EPOLLOUT;
+
+        if (_downstream.can_read())
+            rt_events |= EPOLLIN;
+        if (_downstream.pending())
+            cl_events |= EPOLLOUT;
+
+        // hung up sides were detached from the loop
+        if (!_upstream.hup)
+            _loop->modify(&_cl_source, cl_events);
+        if (!_downstream.hup)
+            _loop->modify(&_rt_source, rt_events);
+    }
+
+    void Socks5Proxy::_setup_splice()
+    {
+        if (_settings->tcp_relay != RelayMode::Splice)
+            return;
+
+        PipePool& pool = PipePool::local();
+
+        if (!pool.acquire(&_upstream.pipe) || !pool.acquire(&_downstream.pipe))
+        {
+            // out of descriptors, copy through user space
+            pool.release(&_upstream.pipe);
+            pool.release(&_downstream.pipe);
+        }
+    }
+
+    void Socks5Proxy::_on_udp_relay(EventSource* source, uint32_t events)
+    {
+        if (source == &_cl_source)
+        {
+            // association lives as long as the control connection
+            if (events & (EPOLLHUP | EPOLLERR))
+            {
+                _close();
+                return;
+            }
+
+            char buffer[256];
+            int buffer_size = this->recv(buffer, sizeof(buffer));
+
+            if (buffer_size == 0 || (buffer_size == -1 && !socket_would_block()))
+            {
+                _close();
+            }
+
+            return;
+        }
+
+        if (events & (EPOLLHUP | EPOLLERR))
+        {
+            std::cerr << "UDP socket error" << std::endl;
+            _close();
+            return;
+        }
+
+        int forwarded = 0;
+
+        while (forwarded < UDP_DRAIN_LIMIT)
+        {
+            int result = (source == &_udp_source)
+                ? _udp_from_client(&_udp, _rt_source.fd, _udp_source.fd)
+                : _udp_from_route(&_udp, _rt_source.fd, _udp_source.fd);
+
+            if (result == -1)
+            {
+                _close();
+                return;
+            }
+
+            // a short batch already emptied the socket
+            if (result == 0 || (unsigned int)result < _settings->udp_batch)
+            {
+                break;
+            }
+
+            forwarded += result;
+        }
+    }
+
+    void Socks5Proxy::_start_udp(EventLoop* loop, int rt_sock, int udp_sock)
+    {
+        _loop = loop;
+
+        _cl_source.fd = _sock;
+        _cl_source.handler = this;
+        _rt_source.fd = rt_sock;
+        _rt_source.handler = this;
+        _udp_source.fd = udp_sock;
+        _udp_source.handler = this;
+
+        if (set_socket_nonblocking(_sock) == -1 || !_loop->add(&_cl_source, 0))
+        {
+            std::cerr << "Couldn't register UDP control connection" << std::endl;
+            _close();
+            return;
+        }
+
+        _on_udp_associated();
+    }
+
+    void Socks5Proxy::_on_udp_associated()
+    {
+        set_socket_nonblocking(_rt_source.fd);
+        set_socket_nonblocking(_udp_source.fd);
+
+        _udp.cl_addr.sin_addr.s_addr = 0;
+        _udp.cl_addr.sin_port = 0;
+        _udp.gro = _udp_offload;
+        _udp.gso = _udp_offload;
+        _udp.fragments.configure(_settings->udp_reassembly_max, _settings->udp_reassembly_timeout_ms);
+
+        // control connection is watched for the end of the association
+        if (!_loop->add(&_rt_source, EPOLLIN)
+            || !_loop->add(&_udp_source, EPOLLIN)
+            || !_loop->modify(&_cl_source, EPOLLIN))
+        {
+            std::cerr << "Couldn't register UDP sockets" << std::endl;
+            _close();
+            return;
+        }
+
+        _state = State::UDPRelay;
+
+        sockaddr_in relay_address;
+        get_socket_addr(_udp_source.fd, &relay_address);
+        UdpAssociations::shared().add(_cl_addr, relay_address, &_udp.counters);
+
+        _udp_idle.start(_settings->udp_idle_timeout_ms);
+
+        if (_udp_idle.is_enabled())
+        {
+            _udp_idle_timer = _loop->add_timer(_udp_idle.interval_ms(), [this]() -> void {
+                _udp_idle_timer = 0;
+                _on_udp_idle();
+            });
+        }
+
+        sockaddr_in server_address;
+        get_socket_addr(_rt_source.fd, &server_address);
+        _log_tunnel(server_address, "UDP");
+    }
+
+    void Socks5Proxy::_on_udp_idle()
+    {
+        if (_udp_idle.is_idle(_udp.counters))
+        {
+            UdpAssociations::shared().expire(_cl_addr);
+            _close();
+            return;
+        }
+
+        _udp_idle_timer = _loop->add_timer(_udp_idle.interval_ms(), [this]() -> void {
+            _udp_idle_timer = 0;
+            _on_udp_idle();
+        });
+    }
+
+    void Socks5Proxy::_udp_resolve(const std::string& domain, uint16_t port, const char payload[], int size)
+    {
+        // resolver can't keep up, drop like a full socket buffer would
+        if (_udp_pending.size() >= UDP_PENDING_LIMIT
+            || MemoryBudget::shared().pressure() == MemoryPressure::Exhausted)
+        {
+            return;
+        }
+
+        _udp_pending.push_back(PendingDatagram{domain, port, std::vector<char>(payload, payload + size)});
+        MemoryBudget::shared().charge(MemoryUse::Udp, size);
+
+        if (_udp_resolving.count(domain))
+        {
+            // already asked, the answer will flush this one too
+            return;
+        }
+
+        uint64_t query = Resolver::local(_loop, &_settings->dns).resolve(
+            domain,
+            DnsType::A,
+            [this, domain](const DnsAnswer& answer) -> void {
+                _udp_resolving.erase(domain);
+                _udp_on_resolved(domain, answer);
+            }
+        );
+
+        if (query == 0)
+        {
+            // drops what waits for it
+            DnsAnswer answer;
+            answer.status = DnsStatus::Error;
+            _udp_on_resolved(domain, answer);
+            return;
+        }
+
+        _udp_resolving[domain] = query;
+    }
+
+    void Socks5Proxy::_udp_on_resolved(const std::string& domain, const DnsAnswer& answer)
+    {
+        auto it = _udp_pending.begin();
+
+        while (it != _udp_pending.end())
+        {
+            if (it->domain != domain)
+            {
+                ++it;
+                continue;
+            }
+
+            std::vector<Destination> destinations;
+
+            // an Ok answer may still carry no usable record
+            if (answer.status == DnsStatus::Ok)
+            {
+                _add_destinations(answer, it->port, &destinations);
+            }
+
+            const Destination* destination = _udp_allowed_destination(destinations, &domain);
+
+            if (destination)
+            {
+                sockaddr_in sv_addr;
+                sv_addr.sin_family = AF_INET;
+                sv_addr.sin_addr = destination->address;
+                sv_addr.sin_port = destination->port;
+
+                ::sendto(_rt_source.fd, it->payload.data(), it->payload.size(), 0,
+                    (sockaddr*)&sv_addr, sizeof(sockaddr_in));
+            }
+
+            MemoryBudget::shared().release(MemoryUse::Udp, it->payload.size());
+            it = _udp_pending.erase(it);
+        }
+    }
+
+    void Socks5Proxy::_close()
+    {
+        if (_state == State::Closed)
+            return;
+
+        if (_state == State::TCPRelay || _state == State::UDPRelay)
+        {
+            sockaddr_in server_address;
+            get_socket_addr(_rt_source.fd, &server_address);
+            _log_tunnel(
+                server_address,
+                _state == State::TCPRelay ? "TCP closed" : "UDP closed"
+            );
+        }
+
+        // sockets of a finished association go back to the pool
+        bool pool_udp = _state == State::UDPRelay;
+
+        if (_state == State::UDPRelay)
+        {
+            UdpAssociations::shared().remove(_cl_addr);
+        }
+
+        _state = State::Closed;
+
+        _loop->cancel_timer(_connect_timer);
+        _connect_timer = 0;
+
+        _loop->cancel_timer(_udp_idle_timer);
+        _udp_idle_timer = 0;
+
+        Resolver& resolver = Resolver::local(_loop, &_settings->dns);
+        resolver.cancel(_resolve_query);
+
+        for (auto& entry : _udp_resolving)
+        {
+            resolver.cancel(entry.second);
+        }
+
+        for (auto& datagram : _udp_pending)
+        {
+            MemoryBudget::shared().release(MemoryUse::Udp, datagram.payload.size());
+        }
+
+        _udp_pending.clear();
+
+        for (EventSource* source : {&_rt_source, &_udp_source})
+        {
+            if (source->fd == -1)
+                continue;
+
+            _loop->remove(source);
+
+            if (pool_udp)
+            {
+                UdpSocketSide side = source == &_rt_source ? UdpSocketSide::Route : UdpSocketSide::Client;
+                UdpSocketPool::shared().release(side, source->fd);
+            }
+            else
+            {
+                ::close(source->fd);
+            }
+
+            source->fd = -1;
+        }
+
+        PipePool::local().release(&_upstream.pipe);
+        PipePool::local().release(&_downstream.pipe);
+
+        // _sock itself is closed by the destructor
+        _loop->remove(&_cl_source);
+
+        // events for this proxy may still be pending in the current batch
+        _loop->defer([this]() -> void {
+            SessionPool::destroy(this);
+        });
+    }
+}
@@ -0,0 +1,141 @@
+#include "socks5.hpp"
+#include "pipe_pool.hpp"
+
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <unistd.h>
+
+/**
+ * splice() variant of the threaded TCP relay loop.
+ * Payload goes socket -> pipe -> socket without being copied
+ * to user space, the pipe is drained before reading more
+ **/
+
+namespace s5r
+{
+    bool Socks5Proxy::_tcp_loop_splice(int rt_sock)
+    {
+        PipePool& pool = PipePool::local();
+
+        // 0: client -> route, 1: route -> client
+        Pipe pipes[2];
+
+        if (!pool.acquire(&pipes[0]))
+            return false;
+
+        if (!pool.acquire(&pipes[1]))
+        {
+            pool.release(&pipes[0]);
+            return false;
+        }
+
+        int from[2] = {_sock, rt_sock};
+        int to[2] = {rt_sock, _sock};
+
+        pollfd fds[2];
+
+        for (int d = 0; d < 2; d++)
+        {
+            fds[d].fd = from[d];
+            fds[d].events = POLLIN;
+            fds[d].revents = 0;
+        }
+
+        bool failed = false;
+
+        // nothing read yet, copying can still take over
+        bool started = false;
+
+        while (!failed && (fds[0].fd != -1 || fds[1].fd != -1))
+        {
+            int poll_result = poll(fds, 2, 10000);
+
+            if (poll_result == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                std::cerr << "Client poll error" << std::endl;
+                break;
+            }
+
+            for (int d = 0; d < 2 && !failed; d++)
+            {
+                if (!(fds[d].revents & (POLLIN | POLLHUP | POLLERR)))
+                    continue;
+
+                fds[d].revents = 0;
+                Pipe& pipe = pipes[d];
+
+                // socket is readable, don't block on it
+                int size = splice(
+                    from[d],
+                    nullptr,
+                    pipe.write_fd,
+                    nullptr,
+                    pipe.capacity,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+                );
+
+                if (size == -1)
+                {
+                    if (errno == EAGAIN || errno == EINTR)
+                        continue;
+
+                    if (!started && (errno == EINVAL || errno == ENOSYS))
+                    {
+                        // socket type can't be spliced, copy instead
+                        pool.release(&pipes[0]);
+                        pool.release(&pipes[1]);
+                        return false;
+                    }
+
+                    failed = true;
+                    break;
+                }
+
+                started = true;
+
+                if (size == 0)
+                {
+                    // forward end of stream, keep the other direction going
+                    ::shutdown(to[d], SHUT_WR);
+                    fds[d].fd = -1;
+                    continue;
+                }
+
+                pipe.size += size;
+
+                // destination is blocking, drain the whole pipe
+                while (pipe.size > 0)
+                {
+                    int sent = splice(
+                        pipe.read_fd,
+                        nullptr,
+                        to[d],
+                        nullptr,
+                        pipe.size,
+                        SPLICE_F_MOVE
+                    );
+
+                    if (sent == -1 && errno == EINTR)
+                        continue;
+
+                    if (sent <= 0)
+                    {
+                        failed = true;
+                        break;
+                    }
+
+                    pipe.size -= sent;
+                }
+            }
+        }
+
+        pool.release(&pipes[0]);
+        pool.release(&pipes[1]);
+
+        return true;
+    }
+}
@@ -0,0 +1,436 @@
+#include "socks5.hpp"
+#include "uring.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <poll.h>
+
+/**
+ * io_uring variants of Socks5Proxy relay loops.
+ * Every recv/send is an SQE on a per-session ring with fixed
+ * files, so one io_uring_enter both submits the next operations
+ * and reaps finished ones instead of poll + recv + send per chunk
+ **/
+
+namespace s5r
+{
+    // bytes per registered relay buffer (one per direction)
+    static constexpr uint32_t URING_TCP_CHUNK = 65536;
+
+    static constexpr unsigned int URING_ENTRIES = 8;
+
+    // user_data layout: bit 0 = direction, bit 1 = write/send
+    static constexpr uint64_t URING_WRITE = 2;
+    static constexpr uint64_t URING_CONTROL = 4;
+    static constexpr uint64_t URING_CANCEL = 8;
+    static constexpr uint64_t URING_TIMEOUT = 16;
+
+    /**
+     * Cancels pending requests and waits for their completions,
+     * buffers they point to can't be released before that
+     **/
+    static void _uring_drain(URing& ring, const uint64_t pending[], int pending_count, int inflight)
+    {
+        for (int i = 0; i < pending_count; i++)
+        {
+            io_uring_sqe* sqe = ring.get_sqe();
+
+            if (!sqe)
+                break;
+
+            URing::prep_cancel(sqe, pending[i], URING_CANCEL);
+        }
+
+        while (inflight > 0)
+        {
+            if (ring.submit_and_wait(1) == -1 && errno != EINTR)
+                return;
+
+            while (io_uring_cqe* cqe = ring.peek_cqe())
+            {
+                if (cqe->user_data != URING_CANCEL)
+                    inflight--;
+
+                ring.cqe_seen();
+            }
+        }
+    }
+
+    bool Socks5Proxy::_tcp_loop_uring(int rt_sock)
+    {
+        if (!URing::is_supported())
+            return false;
+
+        URing ring;
+
+        if (!ring.init(URING_ENTRIES))
+            return false;
+
+        // fixed file indices: 0 - client, 1 - route
+        int fds[2] = {_sock, rt_sock};
+
+        if (ring.register_files(fds, 2) != 0)
+            return false;
+
+        std::unique_ptr<char[]> memory(new char[2 * URING_TCP_CHUNK]);
+
+        // fixed buffer index matches direction
+        iovec buffers[2];
+        buffers[0].iov_base = memory.get();
+        buffers[0].iov_len = URING_TCP_CHUNK;
+        buffers[1].iov_base = memory.get() + URING_TCP_CHUNK;
+        buffers[1].iov_len = URING_TCP_CHUNK;
+
+        if (ring.register_buffers(buffers, 2) != 0)
+            return false;
+
+        struct Direction
+        {
+            int from;
+            int to;
+            char* buffer;
+            uint32_t size;
+            uint32_t offset;
+            bool writing;
+            bool done;
+        };
+
+        // 0: client -> route, 1: route -> client
+        Direction directions[2] = {
+            {0, 1, memory.get(), 0, 0, false, false},
+            {1, 0, memory.get() + URING_TCP_CHUNK, 0, 0, false, false}
+        };
+
+        int inflight = 0;
+
+        auto submit_read = [&](int d) -> void {
+            Direction& dir = directions[d];
+            dir.writing = false;
+
+            URing::prep_read_fixed(ring.get_sqe(), dir.from, dir.buffer, URING_TCP_CHUNK, d, d);
+            inflight++;
+        };
+
+        auto submit_write = [&](int d) -> void {
+            Direction& dir = directions[d];
+            dir.writing = true;
+
+            URing::prep_write_fixed(
+                ring.get_sqe(),
+                dir.to,
+                dir.buffer + dir.offset,
+                dir.size - dir.offset,
+                d,
+                d | URING_WRITE
+            );
+            inflight++;
+        };
+
+        submit_read(0);
+        submit_read(1);
+
+        bool failed = false;
+
+        while (!failed && !(directions[0].done && directions[1].done))
+        {
+            if (ring.submit_and_wait(1) == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                std::cerr << "io_uring_enter error" << std::endl;
+                break;
+            }
+
+            while (io_uring_cqe* cqe = ring.peek_cqe())
+            {
+                int d = cqe->user_data & 1;
+                bool is_write = cqe->user_data & URING_WRITE;
+                int result = cqe->res;
+
+                ring.cqe_seen();
+                inflight--;
+
+                Direction& dir = directions[d];
+
+                if (result < 0)
+                {
+                    failed = true;
+                    continue;
+                }
+
+                if (failed)
+                    continue;
+
+                if (!is_write)
+                {
+                    if (result == 0)
+                    {
+                        // forward end of stream, keep the other direction going
+                        ::shutdown(fds[dir.to], SHUT_WR);
+                        dir.done = true;
+                        continue;
+                    }
+
+                    dir.size = result;
+                    dir.offset = 0;
+                    submit_write(d);
+                }
+                else
+                {
+                    dir.offset += result;
+
+                    if (dir.offset < dir.size)
+                        submit_write(d);
+                    else
+                        submit_read(d);
+                }
+            }
+        }
+
+        uint64_t pending[2];
+        int pending_count = 0;
+
+        for (int d = 0; d < 2; d++)
+        {
+            if (!directions[d].done)
+                pending[pending_count++] = d | (directions[d].writing ? URING_WRITE : 0);
+        }
+
+        _uring_drain(ring, pending, pending_count, inflight);
+
+        return true;
+    }
+
+    bool Socks5Proxy::_udp_loop_uring(S5UDPRelayState* state, int rt_sock, int udp_sock)
+    {
+        if (!URing::is_supported())
+            return false;
+
+        URing ring;
+
+        if (!ring.init(URING_ENTRIES))
+            return false;
+
+        // fixed file indices
+        static constexpr int CLIENT_UDP = 0;
+        static constexpr int ROUTE = 1;
+        static constexpr int CONTROL = 2;
+
+        int fds[3] = {udp_sock, rt_sock, _sock};
+
+        if (ring.register_files(fds, 3) != 0)
+            return false;
+
+        struct Direction
+        {
+            int from;
+            int to;
+            // replies to reassembled datagrams can be as large
+            char buffer[S5_UDP_BUFFER_SIZE];
+
+            // sender on receive, destination on send
+            sockaddr_in addr;
+
+            // replies are sent behind a header from the peer table
+            iovec iov[2];
+            msghdr msg;
+            bool sending;
+        };
+
+        // 0: client -> route, 1: route -> client
+        std::unique_ptr<Direction[]> directions(new Direction[2]);
+        directions[0].from = CLIENT_UDP;
+        directions[0].to = ROUTE;
+        directions[1].from = ROUTE;
+        directions[1].to = CLIENT_UDP;
+
+        int inflight = 0;
+
+        auto submit_recv = [&](int d) -> void {
+            Direction& dir = directions[d];
+
+            dir.iov[0].iov_base = dir.buffer;
+            dir.iov[0].iov_len = sizeof(dir.buffer);
+
+            memset(&dir.msg, 0, sizeof(msghdr));
+            dir.msg.msg_name = &dir.addr;
+            dir.msg.msg_namelen = sizeof(sockaddr_in);
+            dir.msg.msg_iov = dir.iov;
+            dir.msg.msg_iovlen = 1;
+            dir.sending = false;
+
+            URing::prep_recvmsg(ring.get_sqe(), dir.from, &dir.msg, d);
+            inflight++;
+        };
+
+        auto submit_send = [&](int d, const char* header, const char* data, int size) -> void {
+            Direction& dir = directions[d];
+            int count = 0;
+
+            if (header)
+            {
+                dir.iov[count].iov_base = (void*)header;
+                dir.iov[count].iov_len = S5_UDP_REPLY_HEADER_SIZE;
+                count++;
+            }
+
+            dir.iov[count].iov_base = (void*)data;
+            dir.iov[count].iov_len = size;
+            count++;
+
+            dir.msg.msg_iovlen = count;
+            dir.msg.msg_namelen = sizeof(sockaddr_in);
+            dir.sending = true;
+
+            URing::prep_sendmsg(ring.get_sqe(), dir.to, &dir.msg, d | URING_WRITE);
+            inflight++;
+        };
+
+        submit_recv(0);
+        submit_recv(1);
+
+        // association lives as long as the control connection
+        URing::prep_poll_add(ring.get_sqe(), CONTROL, POLLRDHUP | POLLHUP | POLLERR, URING_CONTROL);
+        inflight++;
+
+        UdpIdleCheck idle;
+        idle.start(_settings->udp_idle_timeout_ms);
+
+        uint32_t interval = idle.interval_ms();
+        __kernel_timespec idle_interval = {interval / 1000, (long long)(interval % 1000) * 1000000};
+        bool timeout_pending = false;
+
+        auto submit_timeout = [&]() -> void {
+            URing::prep_timeout(ring.get_sqe(), &idle_interval, URING_TIMEOUT);
+            timeout_pending = true;
+            inflight++;
+        };
+
+        if (idle.is_enabled())
+            submit_timeout();
+
+        bool running = true;
+        bool control_pending = true;
+
+        while (running)
+        {
+            if (ring.submit_and_wait(1) == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                std::cerr << "io_uring_enter error" << std::endl;
+                break;
+            }
+
+            while (io_uring_cqe* cqe = ring.peek_cqe())
+            {
+                uint64_t user_data = cqe->user_data;
+                int result = cqe->res;
+
+                ring.cqe_seen();
+                inflight--;
+
+                if (user_data == URING_CONTROL)
+                {
+                    control_pending = false;
+                    running = false;
+                    continue;
+                }
+
+                if (user_data == URING_TIMEOUT)
+                {
+                    timeout_pending = false;
+
+                    if (!running)
+                        continue;
+
+                    if (idle.is_idle(state->counters))
+                    {
+                        UdpAssociations::shared().expire(_cl_addr);
+                        running = false;
+                        continue;
+                    }
+
+                    submit_timeout();
+                    continue;
+                }
+
+                int d = user_data & 1;
+                bool is_send = user_data & URING_WRITE;
+                Direction& dir = directions[d];
+
+                if (!running)
+                    continue;
+
+                if (is_send)
+                {
+                    // failed sends are dropped like with sendto
+                    submit_recv(d);
+                    continue;
+                }
+
+                if (result < 0)
+                {
+                    std::cerr << (d == 0 ? "Client" : "Route")
+                        << " socket recv == -1" << std::endl;
+                    running = false;
+                    continue;
+                }
+
+                if (d == 0)
+                {
+                    state->counters.on_client(1, result);
+                    state->cl_addr = dir.addr;
+
+                    const char* payload;
+                    int payload_size = _udp_client_datagram(state, dir.buffer, result, &dir.addr, &payload);
+
+                    if (payload_size == -1)
+                    {
+                        submit_recv(d);
+                        continue;
+                    }
+
+                    submit_send(d, nullptr, payload, payload_size);
+                }
+                else
+                {
+                    state->counters.on_remote(1, result);
+
+                    if (state->cl_addr.sin_port == 0)
+                    {
+                        // nobody to reply to yet
+                        submit_recv(d);
+                        continue;
+                    }
+
+                    const char* header = state->reply_headers.get(dir.addr);
+                    dir.addr = state->cl_addr;
+
+                    submit_send(d, header, dir.buffer, result);
+                }
+            }
+        }
+
+        uint64_t pending[4];
+        int pending_count = 0;
+
+        for (int d = 0; d < 2; d++)
+        {
+            pending[pending_count++] = d | (directions[d].sending ? URING_WRITE : 0);
+        }
+
+        if (control_pending)
+            pending[pending_count++] = URING_CONTROL;
+
+        if (timeout_pending)
+            pending[pending_count++] = URING_TIMEOUT;
+
+        _uring_drain(ring, pending, pending_count, inflight);
+
+        return true;
+    }
+}
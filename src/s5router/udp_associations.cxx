@@ -0,0 +1,140 @@
+#include "udp_associations.hpp"
+
+#include <algorithm>
+
+#ifdef __linux__
+    #include "reactor.hpp"
+#endif
+
+namespace s5r
+{
+    UdpAssociations& UdpAssociations::shared()
+    {
+        static UdpAssociations associations;
+        return associations;
+    }
+
+#ifdef __linux__
+    bool UdpAssociations::start(unsigned int workers)
+    {
+        std::lock_guard<std::mutex> lock(_workers_mutex);
+
+        if (_reactor)
+            return true;
+
+        Reactor* reactor = new Reactor(workers);
+
+        if (!reactor->start())
+        {
+            delete reactor;
+            return false;
+        }
+
+        _reactor = reactor;
+        return true;
+    }
+
+    void UdpAssociations::stop()
+    {
+        std::lock_guard<std::mutex> lock(_workers_mutex);
+
+        if (!_reactor)
+            return;
+
+        _reactor->stop();
+        delete _reactor;
+        _reactor = nullptr;
+    }
+
+    bool UdpAssociations::post(std::function<void(EventLoop* loop)> task)
+    {
+        // held so stop() can't delete the loop in between
+        std::lock_guard<std::mutex> lock(_workers_mutex);
+
+        if (!_reactor)
+            return false;
+
+        EventLoop* loop = _reactor->next_loop();
+
+        loop->post([loop, task]() -> void {
+            task(loop);
+        });
+
+        return true;
+    }
+
+    size_t UdpAssociations::workers()
+    {
+        std::lock_guard<std::mutex> lock(_workers_mutex);
+        return _reactor ? _reactor->size() : 0;
+    }
+#endif
+
+    void UdpAssociations::add(const sockaddr_in& client, const sockaddr_in& relay, const UdpCounters* counters)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        _entries[_key(client)] = Entry{client, relay, counters, std::chrono::steady_clock::now()};
+        _peak = std::max(_peak, _entries.size());
+        _opened++;
+    }
+
+    void UdpAssociations::remove(const sockaddr_in& client)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _remove(client);
+    }
+
+    void UdpAssociations::expire(const sockaddr_in& client)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (_remove(client))
+            _expired++;
+    }
+
+    void UdpAssociations::for_each(const std::function<void(const UdpAssociationInfo& info)>& visit) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto now = std::chrono::steady_clock::now();
+
+        for (auto& it : _entries)
+        {
+            const Entry& entry = it.second;
+
+            UdpAssociationInfo info;
+            info.client = entry.client;
+            info.relay = entry.relay;
+            info.client_datagrams = entry.counters->client_datagrams.load(std::memory_order_relaxed);
+            info.client_bytes = entry.counters->client_bytes.load(std::memory_order_relaxed);
+            info.remote_datagrams = entry.counters->remote_datagrams.load(std::memory_order_relaxed);
+            info.remote_bytes = entry.counters->remote_bytes.load(std::memory_order_relaxed);
+            info.age = (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(now - entry.opened).count();
+
+            visit(info);
+        }
+    }
+
+    UdpAssociationStats UdpAssociations::stats() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        UdpAssociationStats stats;
+        stats.active = _entries.size();
+        stats.peak = _peak;
+        stats.opened = _opened;
+        stats.expired = _expired;
+
+        return stats;
+    }
+
+    uint64_t UdpAssociations::_key(const sockaddr_in& client)
+    {
+        return ((uint64_t)client.sin_addr.s_addr << 16) | client.sin_port;
+    }
+
+    bool UdpAssociations::_remove(const sockaddr_in& client)
+    {
+        return _entries.erase(_key(client)) > 0;
+    }
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "common/net.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+namespace s5r
+{
+#ifdef __linux__
+    class EventLoop;
+    class Reactor;
+#endif
+
+    // traffic of one association, written by whoever relays it
+    struct UdpCounters
+    {
+        // received from the client
+        std::atomic<uint64_t> client_datagrams{0};
+        std::atomic<uint64_t> client_bytes{0};
+
+        // received from remote hosts
+        std::atomic<uint64_t> remote_datagrams{0};
+        std::atomic<uint64_t> remote_bytes{0};
+
+        void on_client(uint64_t datagrams, uint64_t bytes)
+        {
+            client_datagrams.fetch_add(datagrams, std::memory_order_relaxed);
+            client_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+        void on_remote(uint64_t datagrams, uint64_t bytes)
+        {
+            remote_datagrams.fetch_add(datagrams, std::memory_order_relaxed);
+            remote_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+        // changes whenever anything was relayed, for idle checks
+        uint64_t datagrams() const
+        {
+            return client_datagrams.load(std::memory_order_relaxed)
+                + remote_datagrams.load(std::memory_order_relaxed);
+        }
+    };
+
+    /**
+     * Tells when an association relayed nothing for its idle
+     * timeout. Polled every interval_ms(), so closing lags the
+     * timeout by at most that much
+     **/
+    class UdpIdleCheck
+    {
+    public:
+        // 0 disables the check
+        void start(uint32_t timeout_ms)
+        {
+            _timeout = std::chrono::milliseconds(timeout_ms);
+            _seen = 0;
+            _active = std::chrono::steady_clock::now();
+        }
+
+        bool is_enabled() const
+        {
+            return _timeout.count() > 0;
+        }
+
+        uint32_t interval_ms() const
+        {
+            return std::max<uint32_t>(1, (uint32_t)_timeout.count() / 4);
+        }
+
+        bool is_idle(const UdpCounters& counters)
+        {
+            auto now = std::chrono::steady_clock::now();
+            uint64_t datagrams = counters.datagrams();
+
+            if (datagrams != _seen)
+            {
+                _seen = datagrams;
+                _active = now;
+                return false;
+            }
+
+            return now - _active >= _timeout;
+        }
+
+    private:
+        std::chrono::milliseconds _timeout{0};
+        std::chrono::steady_clock::time_point _active;
+        uint64_t _seen = 0;
+    };
+
+    struct UdpAssociationInfo
+    {
+        // control connection endpoint of the client
+        sockaddr_in client;
+
+        // address the client sends its datagrams to
+        sockaddr_in relay;
+
+        uint64_t client_datagrams = 0;
+        uint64_t client_bytes = 0;
+        uint64_t remote_datagrams = 0;
+        uint64_t remote_bytes = 0;
+
+        // seconds since the association was opened
+        uint32_t age = 0;
+    };
+
+    struct UdpAssociationStats
+    {
+        // associations currently open
+        size_t active = 0;
+
+        // most associations open at once
+        size_t peak = 0;
+
+        uint64_t opened = 0;
+
+        // closed after relaying nothing for the idle timeout
+        uint64_t expired = 0;
+    };
+
+    /**
+     * Process-wide table of UDP associations keyed by the client
+     * endpoint of their control connection.
+     * In threaded mode it also runs a few shared workers sessions
+     * hand their associations over to, instead of keeping a
+     * thread with a poll loop for each of them
+     **/
+    class UdpAssociations
+    {
+    public:
+        static UdpAssociations& shared();
+
+#ifdef __linux__
+        // starts worker loops, returns false if they couldn't be created
+        bool start(unsigned int workers);
+
+        // stops and joins the workers, associations still
+        // on them are abandoned like on reactor shutdown
+        void stop();
+
+        // runs task on the next worker (round robin),
+        // returns false if the workers aren't running
+        bool post(std::function<void(EventLoop* loop)> task);
+
+        // running workers, 0 if not started
+        size_t workers();
+#endif
+
+        // `counters` must stay valid until the association is removed
+        void add(const sockaddr_in& client, const sockaddr_in& relay, const UdpCounters* counters);
+
+        // no-op if `client` has no association
+        void remove(const sockaddr_in& client);
+
+        // remove() of an association closed for being idle
+        void expire(const sockaddr_in& client);
+
+        // associations can't be removed while `visit` runs
+        void for_each(const std::function<void(const UdpAssociationInfo& info)>& visit) const;
+
+        UdpAssociationStats stats() const;
+
+    private:
+        struct Entry
+        {
+            sockaddr_in client;
+            sockaddr_in relay;
+            const UdpCounters* counters;
+            std::chrono::steady_clock::time_point opened;
+        };
+
+        mutable std::mutex _mutex;
+        std::unordered_map<uint64_t, Entry> _entries;
+
+        size_t _peak = 0;
+        uint64_t _opened = 0;
+        uint64_t _expired = 0;
+
+#ifdef __linux__
+        std::mutex _workers_mutex;
+        Reactor* _reactor = nullptr;
+#endif
+
+    private:
+        static uint64_t _key(const sockaddr_in& client);
+
+        // returns false if there was nothing to remove
+        bool _remove(const sockaddr_in& client);
+    };
+}
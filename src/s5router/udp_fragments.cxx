@@ -0,0 +1,136 @@
+#include "udp_fragments.hpp"
+#include "memory_budget.hpp"
+
+#include <atomic>
+#include <cstring>
+
+namespace s5r
+{
+    // FRAG bit marking the last fragment of a datagram
+    static constexpr uint8_t FRAG_LAST = 0x80;
+
+    static std::atomic<uint64_t> s_reassembled{0};
+    static std::atomic<uint64_t> s_dropped{0};
+    static std::atomic<uint64_t> s_expired{0};
+
+    UdpFragments::~UdpFragments()
+    {
+        MemoryBudget::shared().release(MemoryUse::Udp, _buffer.capacity());
+    }
+
+    void UdpFragments::configure(size_t max_size, uint32_t timeout_ms)
+    {
+        _max_size = max_size;
+        _timeout = std::chrono::milliseconds(timeout_ms);
+    }
+
+    bool UdpFragments::add(uint8_t frag, const char payload[], int size, const char** datagram, int* datagram_size)
+    {
+        uint8_t position = frag & ~FRAG_LAST;
+        auto now = Clock::now();
+
+        // the last datagram may still have been in use until now
+        if (_complete)
+        {
+            _complete = false;
+            _size = 0;
+        }
+
+        if (_position && now - _started >= _timeout)
+        {
+            s_expired.fetch_add(_position, std::memory_order_relaxed);
+            _reset();
+        }
+
+        if (position != _position + 1)
+        {
+            // lost or reordered fragment, the queued ones are of no use
+            s_dropped.fetch_add(_position, std::memory_order_relaxed);
+            _reset();
+
+            // anything but a first fragment can only be dropped
+            if (position != 1)
+            {
+                s_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        if (position == 1)
+        {
+            // no new datagrams once the budget is used up
+            if (_max_size == 0 || MemoryBudget::shared().pressure() == MemoryPressure::Exhausted)
+            {
+                s_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            _started = now;
+        }
+
+        if (!_append(payload, size))
+        {
+            s_dropped.fetch_add(_position + 1, std::memory_order_relaxed);
+            _reset();
+            return false;
+        }
+
+        _position = position;
+
+        if (!(frag & FRAG_LAST))
+            return false;
+
+        s_reassembled.fetch_add(1, std::memory_order_relaxed);
+
+        _position = 0;
+        _complete = true;
+
+        *datagram = _buffer.data();
+        *datagram_size = (int)_size;
+        return true;
+    }
+
+    bool UdpFragments::holds(const char* data) const
+    {
+        return _complete && data >= _buffer.data() && data <= _buffer.data() + _size;
+    }
+
+    UdpFragmentStats UdpFragments::stats()
+    {
+        UdpFragmentStats stats;
+        stats.reassembled = s_reassembled.load(std::memory_order_relaxed);
+        stats.dropped = s_dropped.load(std::memory_order_relaxed);
+        stats.expired = s_expired.load(std::memory_order_relaxed);
+
+        return stats;
+    }
+
+    void UdpFragments::_reset()
+    {
+        _position = 0;
+        _size = 0;
+    }
+
+    bool UdpFragments::_append(const char payload[], int size)
+    {
+        if (_size + size > _max_size)
+            return false;
+
+        size_t capacity = _buffer.capacity();
+
+        if (_buffer.size() < _size + size)
+        {
+            _buffer.resize(_size + size);
+        }
+
+        if (_buffer.capacity() != capacity)
+        {
+            MemoryBudget::shared().charge(MemoryUse::Udp, _buffer.capacity() - capacity);
+        }
+
+        memcpy(_buffer.data() + _size, payload, size);
+        _size += size;
+
+        return true;
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace s5r
+{
+    struct UdpFragmentStats
+    {
+        // datagrams put back together from their fragments
+        uint64_t reassembled = 0;
+
+        // fragments dropped: out of order, over the size
+        // limit, or received with reassembly disabled
+        uint64_t dropped = 0;
+
+        // fragments abandoned for not completing in time
+        uint64_t expired = 0;
+    };
+
+    /**
+     * Reassembly queue of one UDP association (RFC 1928, section 7).
+     * FRAG of a fragment holds its position (1-127) and the high bit
+     * marks the last one. There's no datagram id, so an association
+     * reassembles one datagram at a time and a fragment arriving out
+     * of order abandons the queue
+     **/
+    class UdpFragments
+    {
+    public:
+        ~UdpFragments();
+
+        // payload bytes a reassembled datagram may have (0 drops
+        // every fragment) and how long its fragments may take
+        void configure(size_t max_size, uint32_t timeout_ms);
+
+        // queues payload of a fragment (`frag` not 0), returns true
+        // once it completed a datagram. That stays at `*datagram`
+        // until the next fragment is added
+        bool add(uint8_t frag, const char payload[], int size, const char** datagram, int* datagram_size);
+
+        // true if `data` points into the last reassembled datagram
+        bool holds(const char* data) const;
+
+        // process-wide counters of all associations
+        static UdpFragmentStats stats();
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        size_t _max_size = 0;
+        Clock::duration _timeout{0};
+
+        // capacity is charged to the memory budget
+        std::vector<char> _buffer;
+        size_t _size = 0;
+
+        // position of the last queued fragment, 0 if none are
+        uint8_t _position = 0;
+        bool _complete = false;
+
+        Clock::time_point _started;
+
+    private:
+        // empties the queue, the buffer is kept for the next one
+        void _reset();
+
+        // appends to _buffer, returns false past the size limit
+        bool _append(const char payload[], int size);
+    };
+}
@@ -0,0 +1,209 @@
+#include "udp_socket_pool.hpp"
+#include "utils.hpp"
+#include "common/error.hpp"
+
+#include <cstring>
+
+namespace s5r
+{
+    UdpSocketPool::~UdpSocketPool()
+    {
+        clear();
+    }
+
+    UdpSocketPool& UdpSocketPool::shared()
+    {
+        static UdpSocketPool pool;
+        return pool;
+    }
+
+    void UdpSocketPool::configure(size_t size, PortRange client_ports, PortRange route_ports)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        _size = size;
+        _ports[(size_t)UdpSocketSide::Client] = client_ports;
+        _ports[(size_t)UdpSocketSide::Route] = route_ports;
+    }
+
+    void UdpSocketPool::fill(UdpSocketSide side, in_addr address)
+    {
+        uint64_t key = _key(side, address);
+
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+
+                if (_sockets[key].size() >= _size)
+                    return;
+            }
+
+            uint16_t port;
+            int sock = _bind(side, address, &port);
+
+            if (sock == -1)
+                return;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            _sockets[key].push_back(Entry{sock, port});
+            _pooled++;
+        }
+    }
+
+    int UdpSocketPool::acquire(UdpSocketSide side, in_addr address, uint16_t* port)
+    {
+        Entry entry{-1, 0};
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _sockets.find(_key(side, address));
+
+            if (it != _sockets.end() && !it->second.empty())
+            {
+                entry = it->second.front();
+                it->second.pop_front();
+                _pooled--;
+                _reused++;
+            }
+        }
+
+        if (entry.sock == -1)
+            return _bind(side, address, port);
+
+        _drain(entry.sock);
+
+        if (port)
+            *port = entry.port;
+        return entry.sock;
+    }
+
+    void UdpSocketPool::release(UdpSocketSide side, int sock)
+    {
+        sockaddr_in addr;
+
+        if (get_socket_addr(sock, &addr) == 0)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            std::deque<Entry>& sockets = _sockets[_key(side, addr.sin_addr)];
+
+            if (sockets.size() < _size)
+            {
+                sockets.push_back(Entry{sock, addr.sin_port});
+                _pooled++;
+                return;
+            }
+        }
+
+        ::close(sock);
+    }
+
+    void UdpSocketPool::clear()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        for (auto& it : _sockets)
+        {
+            for (Entry& entry : it.second)
+            {
+                ::close(entry.sock);
+            }
+        }
+
+        _sockets.clear();
+        _pooled = 0;
+    }
+
+    UdpSocketPoolStats UdpSocketPool::stats() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        UdpSocketPoolStats stats;
+        stats.pooled = _pooled;
+        stats.reused = _reused;
+        stats.created = _created;
+        stats.failed = _failed;
+
+        return stats;
+    }
+
+    uint64_t UdpSocketPool::_key(UdpSocketSide side, in_addr address)
+    {
+        return ((uint64_t)side << 32) | address.s_addr;
+    }
+
+    int UdpSocketPool::_bind(UdpSocketSide side, in_addr address, uint16_t* port)
+    {
+        PortRange range;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            range = _ports[(size_t)side];
+        }
+
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (sock == -1)
+            return -1;
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(sockaddr_in));
+        addr.sin_family = AF_INET;
+        addr.sin_addr = address;
+
+        if (range.first == 0)
+        {
+            if (::bind(sock, (sockaddr*)&addr, sizeof(sockaddr_in)) == 0
+                && get_socket_addr(sock, &addr) == 0)
+            {
+                _created++;
+
+                if (port)
+                    *port = addr.sin_port;
+
+                return sock;
+            }
+        }
+        else
+        {
+            uint32_t count = range.last > range.first ? range.last - range.first + 1 : 1;
+
+            // ports still held by other sockets are skipped
+            for (uint32_t i = 0; i < count; i++)
+            {
+                uint32_t offset = _next_port[(size_t)side].fetch_add(1, std::memory_order_relaxed) % count;
+                addr.sin_port = htons((uint16_t)(range.first + offset));
+
+                if (::bind(sock, (sockaddr*)&addr, sizeof(sockaddr_in)) == 0)
+                {
+                    _created++;
+
+                    if (port)
+                        *port = addr.sin_port;
+
+                    return sock;
+                }
+
+                if (get_last_socket_error() != EADDRINUSE)
+                    break;
+            }
+        }
+
+        _failed++;
+        ::close(sock);
+        return -1;
+    }
+
+    void UdpSocketPool::_drain(int sock)
+    {
+#ifdef __linux__
+        char byte;
+
+        // an ICMP error pending from the last association reads as
+        // ECONNREFUSED once, the datagrams behind it are dropped too
+        while (::recv(sock, &byte, 1, MSG_DONTWAIT) >= 0 || errno == ECONNREFUSED)
+        {
+        }
+#endif
+    }
+}
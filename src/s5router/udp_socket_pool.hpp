@@ -0,0 +1,103 @@
+#pragma once
+
+#include "common/net.hpp"
+#include "settings.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace s5r
+{
+    enum class UdpSocketSide
+    {
+        // bound to the listening address, clients send to it
+        Client,
+
+        // bound to the route address, talks to remote hosts
+        Route,
+
+        Count
+    };
+
+    struct UdpSocketPoolStats
+    {
+        // bound sockets waiting for an association
+        size_t pooled = 0;
+
+        // associations served from the pool
+        uint64_t reused = 0;
+
+        // sockets that had to be created and bound
+        uint64_t created = 0;
+
+        // sockets that couldn't be bound (port range used up)
+        uint64_t failed = 0;
+    };
+
+    /**
+     * Process-wide pool of bound UDP sockets for associations.
+     * Saves socket() + bind() + close() per side and keeps a busy
+     * relay from running through ephemeral ports. Sockets are
+     * pooled per side and address, oldest released goes out first
+     **/
+    class UdpSocketPool
+    {
+    public:
+        ~UdpSocketPool();
+
+        static UdpSocketPool& shared();
+
+        // `size` sockets are kept per side and address at most,
+        // 0 closes released sockets instead of pooling them
+        void configure(size_t size, PortRange client_ports, PortRange route_ports);
+
+        // binds sockets ahead of time until `address` has size of them
+        void fill(UdpSocketSide side, in_addr address);
+
+        // pooled socket bound to `address` or a new one, its port
+        // is stored to `port` (network order) unless it's nullptr.
+        // -1 on failure
+        int acquire(UdpSocketSide side, in_addr address, uint16_t* port = nullptr);
+
+        // hands `sock` back once its association is done
+        void release(UdpSocketSide side, int sock);
+
+        // closes every pooled socket
+        void clear();
+
+        UdpSocketPoolStats stats() const;
+
+    private:
+        struct Entry
+        {
+            int sock;
+            uint16_t port;
+        };
+
+        mutable std::mutex _mutex;
+        std::unordered_map<uint64_t, std::deque<Entry>> _sockets;
+        size_t _pooled = 0;
+
+        size_t _size = 0;
+        PortRange _ports[(size_t)UdpSocketSide::Count];
+
+        // where the next bind in a port range starts
+        std::atomic<uint32_t> _next_port[(size_t)UdpSocketSide::Count] = {};
+
+        uint64_t _reused = 0;
+        std::atomic<uint64_t> _created{0};
+        std::atomic<uint64_t> _failed{0};
+
+    private:
+        static uint64_t _key(UdpSocketSide side, in_addr address);
+
+        // new socket bound to `address` and a port of the side's range
+        int _bind(UdpSocketSide side, in_addr address, uint16_t* port);
+
+        // drops datagrams and errors left by the last association
+        static void _drain(int sock);
+    };
+}
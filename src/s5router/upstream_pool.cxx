@@ -0,0 +1,420 @@
+#include "upstream_pool.hpp"
+#include "utils.hpp"
+#include "common/error.hpp"
+#include "common/poll.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace s5r
+{
+    // how often pools are checked and refilled
+    static constexpr std::chrono::milliseconds UPSTREAM_MAINTAIN_INTERVAL{200};
+
+    // request counts are halved this often
+    static constexpr std::chrono::seconds UPSTREAM_DECAY_INTERVAL{10};
+
+    // CONNECTs within about a decay interval before a destination is hot
+    static constexpr uint32_t UPSTREAM_HOT_REQUESTS = 4;
+
+    // destinations counted at most, the rest isn't tracked until decay
+    static constexpr size_t UPSTREAM_MAX_TARGETS = 4096;
+
+    // connects ahead of time give up after this
+    static constexpr int UPSTREAM_CONNECT_TIMEOUT_MS = 2000;
+
+    // pause after a destination failed to connect
+    static constexpr std::chrono::seconds UPSTREAM_RETRY_DELAY{5};
+
+    UpstreamPool::~UpstreamPool()
+    {
+        stop();
+    }
+
+    UpstreamPool& UpstreamPool::shared()
+    {
+        static UpstreamPool pool;
+        return pool;
+    }
+
+    void UpstreamPool::configure(size_t size, size_t destinations, uint32_t idle_ms)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        _size = size;
+        _destinations = destinations;
+        _idle = std::chrono::milliseconds(idle_ms);
+    }
+
+    void UpstreamPool::start(in_addr bind_ip)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (_running || _size == 0 || _destinations == 0)
+            return;
+
+        _bind_ip = bind_ip;
+        _last_decay = Clock::now();
+        _running = true;
+        _thread = std::thread(&UpstreamPool::_run, this);
+    }
+
+    void UpstreamPool::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            if (!_running)
+                return;
+
+            _running = false;
+        }
+
+        _wakeup.notify_all();
+        _thread.join();
+
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        for (auto& it : _targets)
+        {
+            _drop(&it.second);
+        }
+
+        _targets.clear();
+        _hot = 0;
+    }
+
+    int UpstreamPool::acquire(in_addr bind_ip, const Destination& destination)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (!_running || bind_ip.s_addr != _bind_ip.s_addr)
+            return -1;
+
+        uint64_t key = _key(destination.address, destination.port);
+        auto it = _targets.find(key);
+
+        if (it == _targets.end())
+        {
+            _misses++;
+
+            if (_targets.size() >= UPSTREAM_MAX_TARGETS)
+                return -1;
+
+            Target& target = _targets[key];
+            target.address = destination.address;
+            target.port = destination.port;
+            target.requests = 1;
+            return -1;
+        }
+
+        Target& target = it->second;
+        target.requests++;
+
+        while (!target.sockets.empty())
+        {
+            Entry entry = target.sockets.back();
+            target.sockets.pop_back();
+            _pooled--;
+
+            if (_is_alive(entry.sock))
+            {
+                _hits++;
+                return entry.sock;
+            }
+
+            ::close(entry.sock);
+            _expired++;
+        }
+
+        _misses++;
+        return -1;
+    }
+
+    UpstreamPoolStats UpstreamPool::stats() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        UpstreamPoolStats stats;
+        stats.pooled = _pooled;
+        stats.hot = _hot;
+        stats.hits = _hits;
+        stats.misses = _misses;
+        stats.connected = _connected;
+        stats.expired = _expired;
+
+        return stats;
+    }
+
+    uint64_t UpstreamPool::_key(in_addr address, uint16_t port)
+    {
+        return ((uint64_t)port << 32) | address.s_addr;
+    }
+
+    void UpstreamPool::_run()
+    {
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wakeup.wait_for(lock, UPSTREAM_MAINTAIN_INTERVAL, [this]() -> bool {
+                    return !_running;
+                });
+
+                if (!_running)
+                    return;
+            }
+
+            std::vector<Destination> wanted = _maintain();
+
+            if (!wanted.empty())
+            {
+                _connect(wanted);
+            }
+        }
+    }
+
+    std::vector<Destination> UpstreamPool::_maintain()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto now = Clock::now();
+
+        for (auto& it : _targets)
+        {
+            std::deque<Entry>& sockets = it.second.sockets;
+
+            // oldest at the front go first
+            while (!sockets.empty()
+                && (now - sockets.front().pooled >= _idle || !_is_alive(sockets.front().sock)))
+            {
+                ::close(sockets.front().sock);
+                sockets.pop_front();
+                _pooled--;
+                _expired++;
+            }
+        }
+
+        std::vector<Target*> candidates;
+
+        for (auto& it : _targets)
+        {
+            if (it.second.requests >= UPSTREAM_HOT_REQUESTS)
+            {
+                candidates.push_back(&it.second);
+            }
+        }
+
+        size_t hot = std::min(candidates.size(), _destinations);
+
+        std::partial_sort(candidates.begin(), candidates.begin() + hot, candidates.end(),
+            [](const Target* a, const Target* b) -> bool {
+                return a->requests > b->requests;
+            }
+        );
+
+        for (auto& it : _targets)
+        {
+            it.second.hot = false;
+        }
+
+        for (size_t i = 0; i < hot; i++)
+        {
+            candidates[i]->hot = true;
+        }
+
+        _hot = hot;
+
+        if (now - _last_decay >= UPSTREAM_DECAY_INTERVAL)
+        {
+            _last_decay = now;
+
+            for (auto& it : _targets)
+            {
+                it.second.requests /= 2;
+            }
+        }
+
+        std::vector<Destination> wanted;
+
+        for (auto it = _targets.begin(); it != _targets.end();)
+        {
+            Target& target = it->second;
+
+            if (!target.hot)
+            {
+                _drop(&target);
+
+                if (target.requests == 0)
+                {
+                    it = _targets.erase(it);
+                    continue;
+                }
+            }
+            else if (now >= target.retry_after)
+            {
+                for (size_t i = target.sockets.size(); i < _size; i++)
+                {
+                    wanted.emplace_back(target.address, target.port);
+                }
+            }
+
+            ++it;
+        }
+
+        return wanted;
+    }
+
+    void UpstreamPool::_connect(const std::vector<Destination>& wanted)
+    {
+        std::vector<pollfd> fds;
+        std::vector<const Destination*> destinations;
+
+        for (auto& destination : wanted)
+        {
+            int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+            if (sock == -1)
+                continue;
+
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(sockaddr_in));
+            addr.sin_family = AF_INET;
+            addr.sin_addr = _bind_ip;
+
+            if (set_socket_nonblocking(sock) == -1
+                || ::bind(sock, (sockaddr*)&addr, sizeof(sockaddr_in)) == -1)
+            {
+                ::close(sock);
+                continue;
+            }
+
+            addr.sin_port = destination.port;
+            addr.sin_addr = destination.address;
+
+            if (::connect(sock, (sockaddr*)&addr, sizeof(sockaddr_in)) == -1
+                && get_last_socket_error() != EINPROGRESS && !socket_would_block())
+            {
+                ::close(sock);
+                continue;
+            }
+
+            pollfd fd;
+            fd.fd = sock;
+            fd.events = POLLOUT;
+            fd.revents = 0;
+
+            fds.push_back(fd);
+            destinations.push_back(&destination);
+        }
+
+        auto deadline = Clock::now() + std::chrono::milliseconds(UPSTREAM_CONNECT_TIMEOUT_MS);
+        size_t pending = fds.size();
+
+        while (pending > 0)
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+
+            if (left.count() <= 0)
+                break;
+
+            int poll_result = poll(fds.data(), fds.size(), (int)left.count());
+
+            if (poll_result == -1)
+            {
+                if (get_last_socket_error() == EINTR)
+                    continue;
+
+                break;
+            }
+
+            for (size_t i = 0; i < fds.size(); i++)
+            {
+                if (fds[i].fd == -1 || !fds[i].revents)
+                    continue;
+
+                int sock = fds[i].fd;
+                const Destination& destination = *destinations[i];
+
+                // no longer polled, a negative fd is skipped
+                fds[i].fd = -1;
+                pending--;
+
+                int error = 0;
+                socklen_t error_len = sizeof(error);
+
+                if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&error, &error_len) == -1)
+                {
+                    error = get_last_socket_error();
+                }
+
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto it = _targets.find(_key(destination.address, destination.port));
+
+                if (error)
+                {
+                    if (it != _targets.end())
+                    {
+                        it->second.retry_after = Clock::now() + UPSTREAM_RETRY_DELAY;
+                    }
+
+                    ::close(sock);
+                    continue;
+                }
+
+                // the destination may have cooled down meanwhile
+                if (!_running || it == _targets.end() || !it->second.hot || it->second.sockets.size() >= _size)
+                {
+                    ::close(sock);
+                    continue;
+                }
+
+                it->second.sockets.push_back(Entry{sock, Clock::now()});
+                _pooled++;
+                _connected++;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // timed out
+        for (size_t i = 0; i < fds.size(); i++)
+        {
+            if (fds[i].fd == -1)
+                continue;
+
+            ::close(fds[i].fd);
+
+            auto it = _targets.find(_key(destinations[i]->address, destinations[i]->port));
+
+            if (it != _targets.end())
+            {
+                it->second.retry_after = Clock::now() + UPSTREAM_RETRY_DELAY;
+            }
+        }
+    }
+
+    void UpstreamPool::_drop(Target* target)
+    {
+        for (Entry& entry : target->sockets)
+        {
+            ::close(entry.sock);
+            _pooled--;
+            _expired++;
+        }
+
+        target->sockets.clear();
+    }
+
+    bool UpstreamPool::_is_alive(int sock)
+    {
+        char byte;
+        int result = (int)::recv(sock, &byte, 1, MSG_PEEK);
+
+        // the remote host may speak first, that's relayed once taken
+        if (result > 0)
+            return true;
+
+        return result == -1 && socket_would_block();
+    }
+}
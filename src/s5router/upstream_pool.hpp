@@ -0,0 +1,134 @@
+#pragma once
+
+#include "common/net.hpp"
+#include "destination.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace s5r
+{
+    struct UpstreamPoolStats
+    {
+        // connected sockets waiting for a CONNECT
+        size_t pooled = 0;
+
+        // destinations kept warm right now
+        size_t hot = 0;
+
+        // CONNECTs served from the pool
+        uint64_t hits = 0;
+
+        // CONNECTs that had to connect themselves
+        uint64_t misses = 0;
+
+        // sockets connected ahead of time
+        uint64_t connected = 0;
+
+        // pooled sockets closed unused: idle for too long, closed
+        // by the remote host or their destination cooled down
+        uint64_t expired = 0;
+    };
+
+    /**
+     * Process-wide pool of connected route sockets for the hottest
+     * destinations. CONNECTs are counted per address and port, the
+     * busiest ones get sockets connected ahead of time by a
+     * background thread so a CONNECT to them skips the handshake.
+     * Counts are halved regularly, destinations going quiet
+     * lose their sockets
+     **/
+    class UpstreamPool
+    {
+    public:
+        ~UpstreamPool();
+
+        static UpstreamPool& shared();
+
+        // `size` sockets are kept for each of the `destinations`
+        // hottest destinations and closed after `idle_ms` unused.
+        // 0 disables the pool
+        void configure(size_t size, size_t destinations, uint32_t idle_ms);
+
+        // starts connecting sockets bound to `bind_ip` if enabled
+        void start(in_addr bind_ip);
+
+        // stops the pool and closes every pooled socket
+        void stop();
+
+        // counts a CONNECT to `destination` and hands out a pooled
+        // (non-blocking) socket connected to it, -1 if there's none
+        int acquire(in_addr bind_ip, const Destination& destination);
+
+        UpstreamPoolStats stats() const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Entry
+        {
+            int sock;
+            Clock::time_point pooled;
+        };
+
+        struct Target
+        {
+            in_addr address;
+            uint16_t port;
+
+            // CONNECTs seen, halved every decay interval
+            uint32_t requests = 0;
+            bool hot = false;
+
+            // newest at the back
+            std::deque<Entry> sockets;
+
+            // connects failed, the destination gets a break
+            Clock::time_point retry_after;
+        };
+
+        mutable std::mutex _mutex;
+        std::condition_variable _wakeup;
+        std::thread _thread;
+        bool _running = false;
+
+        size_t _size = 0;
+        size_t _destinations = 0;
+        Clock::duration _idle{0};
+        in_addr _bind_ip;
+
+        std::unordered_map<uint64_t, Target> _targets;
+        size_t _pooled = 0;
+        size_t _hot = 0;
+        Clock::time_point _last_decay;
+
+        uint64_t _hits = 0;
+        uint64_t _misses = 0;
+        uint64_t _connected = 0;
+        uint64_t _expired = 0;
+
+    private:
+        static uint64_t _key(in_addr address, uint16_t port);
+
+        void _run();
+
+        // expires sockets, picks hot destinations and returns
+        // the connects needed to fill their pools
+        std::vector<Destination> _maintain();
+
+        // connects to `wanted` at once and pools what succeeded
+        void _connect(const std::vector<Destination>& wanted);
+
+        // closes every socket of `target`
+        void _drop(Target* target);
+
+        // false if the remote host closed or reset the connection
+        static bool _is_alive(int sock);
+    };
+}
@@ -0,0 +1,310 @@
+#include "uring.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace s5r
+{
+    static int _io_uring_setup(unsigned int entries, io_uring_params* params)
+    {
+        return (int)syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    static int _io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+    {
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    static int _io_uring_register(int fd, unsigned int opcode, const void* arg, unsigned int nr_args)
+    {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+    URing::URing()
+        : _ring_fd{-1},
+          _sqe_head{0},
+          _sqe_tail{0},
+          _sq_entries{0},
+          _sq_ring_ptr{MAP_FAILED},
+          _sq_ring_size{0},
+          _cq_ring_ptr{MAP_FAILED},
+          _cq_ring_size{0},
+          _sqes_ptr{MAP_FAILED},
+          _sqes_size{0}
+    {
+    }
+
+    URing::~URing()
+    {
+        if (_sqes_ptr != MAP_FAILED)
+            munmap(_sqes_ptr, _sqes_size);
+
+        if (_cq_ring_ptr != MAP_FAILED && _cq_ring_ptr != _sq_ring_ptr)
+            munmap(_cq_ring_ptr, _cq_ring_size);
+
+        if (_sq_ring_ptr != MAP_FAILED)
+            munmap(_sq_ring_ptr, _sq_ring_size);
+
+        if (_ring_fd != -1)
+            ::close(_ring_fd);
+    }
+
+    bool URing::is_supported()
+    {
+        static const bool supported = []() -> bool {
+            static constexpr uint8_t required_ops[] = {
+                IORING_OP_READ_FIXED,
+                IORING_OP_WRITE_FIXED,
+                IORING_OP_RECVMSG,
+                IORING_OP_SENDMSG,
+                IORING_OP_POLL_ADD,
+                IORING_OP_ACCEPT,
+                IORING_OP_TIMEOUT,
+                IORING_OP_ASYNC_CANCEL
+            };
+
+            URing ring;
+
+            if (!ring.init(2))
+                return false;
+
+            static constexpr int PROBE_OPS = 256;
+            size_t probe_size = sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op);
+            char probe_buffer[probe_size];
+            memset(probe_buffer, 0, probe_size);
+
+            io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probe_buffer);
+
+            if (_io_uring_register(ring._ring_fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) == -1)
+                return false;
+
+            for (uint8_t op : required_ops)
+            {
+                if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                    return false;
+            }
+
+            return true;
+        }();
+
+        return supported;
+    }
+
+    bool URing::init(unsigned int entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        _ring_fd = _io_uring_setup(entries, &params);
+
+        if (_ring_fd == -1)
+            return false;
+
+        _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+        if (single_mmap)
+        {
+            if (_cq_ring_size > _sq_ring_size)
+                _sq_ring_size = _cq_ring_size;
+
+            _cq_ring_size = _sq_ring_size;
+        }
+
+        _sq_ring_ptr = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+
+        if (_sq_ring_ptr == MAP_FAILED)
+            return false;
+
+        if (single_mmap)
+        {
+            _cq_ring_ptr = _sq_ring_ptr;
+        }
+        else
+        {
+            _cq_ring_ptr = mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+
+            if (_cq_ring_ptr == MAP_FAILED)
+                return false;
+        }
+
+        _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        _sqes_ptr = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+
+        if (_sqes_ptr == MAP_FAILED)
+            return false;
+
+        char* sq = static_cast<char*>(_sq_ring_ptr);
+        _sq_head = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+        _sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+        _sq_mask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+        _sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+        _sqes = static_cast<io_uring_sqe*>(_sqes_ptr);
+        _sq_entries = params.sq_entries;
+
+        char* cq = static_cast<char*>(_cq_ring_ptr);
+        _cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+        _cq_mask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        return true;
+    }
+
+    int URing::register_files(const int* fds, unsigned int count)
+    {
+        if (_io_uring_register(_ring_fd, IORING_REGISTER_FILES, fds, count) == -1)
+            return -errno;
+
+        return 0;
+    }
+
+    int URing::register_buffers(const iovec* iovecs, unsigned int count)
+    {
+        if (_io_uring_register(_ring_fd, IORING_REGISTER_BUFFERS, iovecs, count) == -1)
+            return -errno;
+
+        return 0;
+    }
+
+    io_uring_sqe* URing::get_sqe()
+    {
+        unsigned int head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+
+        if (_sqe_tail - head >= _sq_entries)
+            return nullptr;
+
+        io_uring_sqe* sqe = &_sqes[_sqe_tail & *_sq_mask];
+        _sqe_tail++;
+
+        memset(sqe, 0, sizeof(io_uring_sqe));
+        return sqe;
+    }
+
+    unsigned int URing::_flush_sq()
+    {
+        unsigned int tail = *_sq_tail;
+        unsigned int count = _sqe_tail - _sqe_head;
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            _sq_array[tail & *_sq_mask] = _sqe_head & *_sq_mask;
+            tail++;
+            _sqe_head++;
+        }
+
+        __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    int URing::submit_and_wait(unsigned int wait_nr)
+    {
+        unsigned int to_submit = _flush_sq();
+
+        // completions might already be waiting
+        if (wait_nr && peek_cqe())
+        {
+            wait_nr = 0;
+        }
+
+        if (!to_submit && !wait_nr)
+            return 0;
+
+        return _io_uring_enter(
+            _ring_fd,
+            to_submit,
+            wait_nr,
+            wait_nr ? IORING_ENTER_GETEVENTS : 0
+        );
+    }
+
+    io_uring_cqe* URing::peek_cqe()
+    {
+        unsigned int head = *_cq_head;
+        unsigned int tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+            return nullptr;
+
+        return &_cqes[head & *_cq_mask];
+    }
+
+    void URing::cqe_seen()
+    {
+        __atomic_store_n(_cq_head, *_cq_head + 1, __ATOMIC_RELEASE);
+    }
+
+    void URing::prep_rw(
+        io_uring_sqe* sqe,
+        uint8_t opcode,
+        int fd,
+        const void* addr,
+        uint32_t len,
+        uint64_t offset,
+        uint64_t user_data
+    ) {
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(addr);
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+    }
+
+    void URing::prep_read_fixed(io_uring_sqe* sqe, int file_index, void* buffer, uint32_t len, uint16_t buffer_index, uint64_t user_data)
+    {
+        prep_rw(sqe, IORING_OP_READ_FIXED, file_index, buffer, len, 0, user_data);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->buf_index = buffer_index;
+    }
+
+    void URing::prep_write_fixed(io_uring_sqe* sqe, int file_index, const void* buffer, uint32_t len, uint16_t buffer_index, uint64_t user_data)
+    {
+        prep_rw(sqe, IORING_OP_WRITE_FIXED, file_index, buffer, len, 0, user_data);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->buf_index = buffer_index;
+    }
+
+    void URing::prep_recvmsg(io_uring_sqe* sqe, int file_index, msghdr* msg, uint64_t user_data)
+    {
+        prep_rw(sqe, IORING_OP_RECVMSG, file_index, msg, 1, 0, user_data);
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+
+    void URing::prep_sendmsg(io_uring_sqe* sqe, int file_index, const msghdr* msg, uint64_t user_data)
+    {
+        prep_rw(sqe, IORING_OP_SENDMSG, file_index, msg, 1, 0, user_data);
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+
+    void URing::prep_poll_add(io_uring_sqe* sqe, int file_index, uint32_t poll_mask, uint64_t user_data)
+    {
+        prep_rw(sqe, IORING_OP_POLL_ADD, file_index, nullptr, 0, 0, user_data);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->poll32_events = poll_mask;
+    }
+
+    void URing::prep_accept(io_uring_sqe* sqe, int fd, sockaddr* addr, socklen_t* addr_len, uint64_t user_data)
+    {
+        prep_rw(sqe, IORING_OP_ACCEPT, fd, addr, 0, reinterpret_cast<uint64_t>(addr_len), user_data);
+    }
+
+    void URing::prep_timeout(io_uring_sqe* sqe, __kernel_timespec* ts, uint64_t user_data)
+    {
+        prep_rw(sqe, IORING_OP_TIMEOUT, -1, ts, 1, 0, user_data);
+    }
+
+    void URing::prep_cancel(io_uring_sqe* sqe, uint64_t target, uint64_t user_data)
+    {
+        prep_rw(sqe, IORING_OP_ASYNC_CANCEL, -1, reinterpret_cast<void*>(target), 0, 0, user_data);
+    }
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace s5r
+{
+    /**
+     * Minimal io_uring wrapper on top of the raw syscalls
+     * (no liburing dependency). Not thread-safe, one ring
+     * is meant to be owned by a single thread
+     **/
+    class URing
+    {
+    public:
+        URing();
+        ~URing();
+
+        URing(const URing&) = delete;
+        URing& operator=(const URing&) = delete;
+
+        // kernel has io_uring enabled with every operation
+        // used by the relay loops (probed once per process)
+        static bool is_supported();
+
+        bool init(unsigned int entries);
+
+        // returns 0 on success, -errno on failure
+        int register_files(const int* fds, unsigned int count);
+        int register_buffers(const iovec* iovecs, unsigned int count);
+
+        // nullptr if submission queue is full
+        io_uring_sqe* get_sqe();
+
+        // submits queued entries and waits for at least `wait_nr`
+        // completions, returns -1 on error (errno is set)
+        int submit_and_wait(unsigned int wait_nr);
+
+        // next completion or nullptr, each one must be released with cqe_seen()
+        io_uring_cqe* peek_cqe();
+        void cqe_seen();
+
+    public:
+        // SQE preparation helpers, `fd` is a registered file index
+        // when sqe->flags has IOSQE_FIXED_FILE set
+        static void prep_rw(
+            io_uring_sqe* sqe,
+            uint8_t opcode,
+            int fd,
+            const void* addr,
+            uint32_t len,
+            uint64_t offset,
+            uint64_t user_data
+        );
+
+        static void prep_read_fixed(io_uring_sqe* sqe, int file_index, void* buffer, uint32_t len, uint16_t buffer_index, uint64_t user_data);
+        static void prep_write_fixed(io_uring_sqe* sqe, int file_index, const void* buffer, uint32_t len, uint16_t buffer_index, uint64_t user_data);
+        static void prep_recvmsg(io_uring_sqe* sqe, int file_index, msghdr* msg, uint64_t user_data);
+        static void prep_sendmsg(io_uring_sqe* sqe, int file_index, const msghdr* msg, uint64_t user_data);
+        static void prep_poll_add(io_uring_sqe* sqe, int file_index, uint32_t poll_mask, uint64_t user_data);
+        static void prep_accept(io_uring_sqe* sqe, int fd, sockaddr* addr, socklen_t* addr_len, uint64_t user_data);
+        static void prep_timeout(io_uring_sqe* sqe, __kernel_timespec* ts, uint64_t user_data);
+
+        // cancels request submitted with `target` user data
+        static void prep_cancel(io_uring_sqe* sqe, uint64_t target, uint64_t user_data);
+
+    private:
+        int _ring_fd;
+
+        // submission queue
+        unsigned int* _sq_head;
+        unsigned int* _sq_tail;
+        unsigned int* _sq_mask;
+        unsigned int* _sq_array;
+        io_uring_sqe* _sqes;
+
+        // entries handed out by get_sqe() but not yet published to the kernel
+        unsigned int _sqe_head;
+        unsigned int _sqe_tail;
+        unsigned int _sq_entries;
+
+        // completion queue
+        unsigned int* _cq_head;
+        unsigned int* _cq_tail;
+        unsigned int* _cq_mask;
+        io_uring_cqe* _cqes;
+
+        void* _sq_ring_ptr;
+        size_t _sq_ring_size;
+        void* _cq_ring_ptr;
+        size_t _cq_ring_size;
+        void* _sqes_ptr;
+        size_t _sqes_size;
+
+    private:
+        unsigned int _flush_sq();
+    };
+}
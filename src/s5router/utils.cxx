@@ -6,10 +6,16 @@
 
 #ifdef __linux__
     #include <arpa/inet.h>
+    #include <ifaddrs.h>
+    #include <net/if.h>
+    #include <cstring>
+    #include <fcntl.h>
+    #include <fstream>
 #endif
 
 namespace s5r
 {
+#ifdef _WIN32
     void get_netifaces(std::vector<NetworkInterface>* netifaces)
     {
         PIP_ADAPTER_ADDRESSES pAdapters = NULL;
@@ -56,6 +62,80 @@ namespace s5r
 
         free(pAdapters);
     }
+#endif
+
+#ifdef __linux__
+    /**
+     * Name of the interface holding the default route,
+     * taken from /proc/net/route (empty if there is none)
+     **/
+    static std::string _default_route_interface()
+    {
+        std::ifstream routes("/proc/net/route");
+        std::string line;
+
+        // skip header
+        std::getline(routes, line);
+
+        while (std::getline(routes, line))
+        {
+            char name[IF_NAMESIZE + 1];
+            unsigned long destination = 0;
+
+            if (sscanf(line.c_str(), "%16s %lx", name, &destination) == 2
+                && destination == 0)
+            {
+                return name;
+            }
+        }
+
+        return "";
+    }
+
+    void get_netifaces(std::vector<NetworkInterface>* netifaces)
+    {
+        ifaddrs* ifaddr = nullptr;
+
+        if (getifaddrs(&ifaddr) == -1)
+        {
+            return;
+        }
+
+        std::string primary = _default_route_interface();
+
+        for (ifaddrs* ifa = ifaddr; ifa; ifa = ifa->ifa_next)
+        {
+            if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET)
+                continue;
+
+            NetworkInterface* netiface = nullptr;
+
+            for (auto& _netiface : *netifaces)
+            {
+                if (_netiface.name == ifa->ifa_name)
+                {
+                    netiface = &_netiface;
+                    break;
+                }
+            }
+
+            if (!netiface)
+            {
+                netiface = &netifaces->emplace_back(NetworkInterface());
+                netiface->name = ifa->ifa_name;
+                netiface->is_running = (ifa->ifa_flags & IFF_UP)
+                    && (ifa->ifa_flags & IFF_RUNNING);
+                netiface->is_primary = primary.empty()
+                    ? !(ifa->ifa_flags & IFF_LOOPBACK)
+                    : netiface->name == primary;
+            }
+
+            netiface->addrs.push_back(((sockaddr_in*)ifa->ifa_addr)->sin_addr);
+        }
+
+        freeifaddrs(ifaddr);
+    }
+#endif
 
     std::vector<in_addr> get_netiface_ips()
     {
@@ -83,6 +163,7 @@ namespace s5r
 
         memset(&hints, 0, sizeof(hints));
         hints.ai_family = AF_INET; // IPv4 only
+        hints.ai_socktype = SOCK_STREAM; // one entry per address
 
         int status = getaddrinfo(domain_name, NULL, &hints, &result);
         if (status != 0) {
@@ -106,4 +187,41 @@ namespace s5r
         socklen_t addrlen = sizeof(sockaddr_in);
         return getsockname(sock, (struct sockaddr *)addr, &addrlen);
     }
+
+    static int _set_socket_nonblocking(int sock, bool nonblocking)
+    {
+#ifdef _WIN32
+        u_long mode = nonblocking ? 1 : 0;
+        return ioctlsocket(sock, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+        int flags = fcntl(sock, F_GETFL, 0);
+
+        if (flags == -1)
+        {
+            return -1;
+        }
+
+        flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+        return fcntl(sock, F_SETFL, flags);
+#endif
+    }
+
+    int set_socket_nonblocking(int sock)
+    {
+        return _set_socket_nonblocking(sock, true);
+    }
+
+    int set_socket_blocking(int sock)
+    {
+        return _set_socket_nonblocking(sock, false);
+    }
+
+    int set_socket_reset_on_close(int sock)
+    {
+        linger option;
+        option.l_onoff = 1;
+        option.l_linger = 0;
+
+        return setsockopt(sock, SOL_SOCKET, SO_LINGER, (const char*)&option, sizeof(option));
+    }
 }
\ No newline at end of file
@@ -19,4 +19,11 @@ namespace s5r
     void get_netifaces(std::vector<NetworkInterface>* netifaces);
     int resolve_dns(const char *domain_name, struct in_addr *ip_addrs, int max_addrs);
     int get_socket_addr(int sock, sockaddr_in* addr);
+
+    // returns -1 on error
+    int set_socket_nonblocking(int sock);
+    int set_socket_blocking(int sock);
+
+    // close() then aborts the connection with RST instead of FIN
+    int set_socket_reset_on_close(int sock);
 }
\ No newline at end of file
@@ -0,0 +1,380 @@
+// DNS client against a stub nameserver: response parsing, the blocking
+// and reactor resolvers, the shared cache, and what CONNECT replies
+// when names fail
+
+#include "s5router/dns.hpp"
+#include "s5router/dns_cache.hpp"
+#include "s5router/reactor.hpp"
+#include "s5router/resolver.hpp"
+#include "s5router/s5router.hpp"
+#include "stub_nameserver.hpp"
+#include "test_net.hpp"
+
+#include <iostream>
+
+using namespace s5r;
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static void check_parser()
+{
+    char query[DNS_MAX_MESSAGE_SIZE];
+    int size = dns_build_query(0x1234, "a.test", DnsType::A, query, sizeof(query));
+    check(size == 12 + 8 + 4, "query size");
+
+    // the query turned into an answer with one record
+    std::vector<char> response(query, query + size);
+    response[2] = (char)0x81;
+    response[3] = (char)0x80;
+    response[7] = 1;
+
+    const char record[] = {(char)0xC0, 12, 0, 1, 0, 1, 0, 0, 1, 0, 0, 4, 10, 1, 2, 3};
+    response.insert(response.end(), record, record + sizeof(record));
+
+    DnsAnswer answer;
+    check(dns_parse_response(response.data(), (int)response.size(), 0x1234, "A.test.", DnsType::A, &answer), "parse answer");
+    check(answer.status == DnsStatus::Ok, "answer status");
+    check(answer.addrs.size() == 1 && answer.addrs[0].s_addr == inet_addr("10.1.2.3"), "answer address");
+    check(answer.ttl == 256, "answer ttl");
+
+    check(!dns_parse_response(response.data(), (int)response.size(), 0x4321, "a.test", DnsType::A, &answer), "other id ignored");
+    check(!dns_parse_response(response.data(), (int)response.size(), 0x1234, "b.test", DnsType::A, &answer), "other name ignored");
+    check(!dns_parse_response(response.data(), 20, 0x1234, "a.test", DnsType::A, &answer), "cut question ignored");
+
+    // records running past the end are dropped
+    check(dns_parse_response(response.data(), (int)response.size() - 2, 0x1234, "a.test", DnsType::A, &answer), "parse cut answer");
+    check(answer.status == DnsStatus::NotFound, "cut answer status");
+
+    std::vector<char> truncated = response;
+    truncated[2] |= 0x02;
+    check(dns_parse_response(truncated.data(), (int)truncated.size(), 0x1234, "a.test", DnsType::A, &answer), "parse truncated");
+    check(answer.status == DnsStatus::ServerFailure && answer.addrs.empty(), "truncated is a failure");
+
+    std::vector<char> nxdomain(query, query + size);
+    nxdomain[2] = (char)0x81;
+    nxdomain[3] = (char)0x83;
+    check(dns_parse_response(nxdomain.data(), (int)nxdomain.size(), 0x1234, "a.test", DnsType::A, &answer), "parse nxdomain");
+    check(answer.status == DnsStatus::NotFound, "nxdomain status");
+
+    std::vector<char> servfail = nxdomain;
+    servfail[3] = (char)0x82;
+    check(dns_parse_response(servfail.data(), (int)servfail.size(), 0x1234, "a.test", DnsType::A, &answer), "parse servfail");
+    check(answer.status == DnsStatus::ServerFailure, "servfail status");
+}
+
+static void check_blocking(StubNameserver* stub)
+{
+    DnsSettings settings;
+    settings.servers.push_back(stub->address());
+    settings.timeout_ms = 200;
+    settings.retries = 1;
+
+    DnsAnswer answer;
+    dns_resolve(settings, "a.test", DnsType::A, &answer);
+    check(answer.status == DnsStatus::Ok && answer.addrs.size() == 1
+        && answer.addrs[0].s_addr == inet_addr("10.1.2.3"), "blocking answer");
+
+    dns_resolve(settings, "missing.test", DnsType::A, &answer);
+    check(answer.status == DnsStatus::NotFound, "blocking nxdomain");
+
+    dns_resolve(settings, "big.test", DnsType::A, &answer);
+    check(answer.status == DnsStatus::ServerFailure, "blocking truncated");
+
+    int before = stub->queries();
+    dns_resolve(settings, "silent.test", DnsType::A, &answer);
+    check(answer.status == DnsStatus::Timeout, "blocking timeout");
+    check(stub->queries() - before == 2, "blocking retry");
+
+    before = stub->queries();
+    dns_resolve(settings, "10.9.8.7", DnsType::A, &answer);
+    check(answer.status == DnsStatus::Ok && answer.addrs.size() == 1
+        && answer.addrs[0].s_addr == inet_addr("10.9.8.7"), "blocking literal");
+
+    dns_resolve(settings, "10.9.8.7", DnsType::AAAA, &answer);
+    check(answer.status == DnsStatus::NotFound, "blocking literal AAAA");
+    check(stub->queries() == before, "literals aren't queried");
+}
+
+static DnsAnswer make_answer(DnsStatus status, uint32_t ttl, const char* address = nullptr)
+{
+    DnsAnswer answer;
+    answer.status = status;
+    answer.ttl = ttl;
+
+    if (address)
+        answer.addrs.push_back(in_addr{inet_addr(address)});
+
+    return answer;
+}
+
+static bool cached(const std::string& name, DnsAnswer* answer = nullptr)
+{
+    DnsAnswer found;
+    bool hit = DnsCache::shared().lookup(name, DnsType::A, &found);
+
+    if (answer)
+        *answer = found;
+
+    return hit;
+}
+
+// `count` names that land in the shard of `anchor`, shards aren't
+// exposed so they are found by evicting each other one per shard
+static std::vector<std::string> shard_mates(const std::string& anchor, size_t count)
+{
+    DnsCache& cache = DnsCache::shared();
+    DnsSettings settings;
+    settings.cache_size = 1;
+    cache.configure(settings);
+
+    std::vector<std::string> names;
+
+    for (int i = 0; names.size() < count && i < 10000; i++)
+    {
+        std::string name = "mate" + std::to_string(i) + ".test";
+
+        cache.clear();
+        cache.insert(anchor, DnsType::A, make_answer(DnsStatus::Ok, 60, "10.0.0.1"));
+        cache.insert(name, DnsType::A, make_answer(DnsStatus::Ok, 60, "10.0.0.2"));
+
+        if (!cached(anchor))
+            names.push_back(name);
+    }
+
+    return names;
+}
+
+static void check_cache()
+{
+    DnsCache& cache = DnsCache::shared();
+
+    // least recently used goes first
+    std::vector<std::string> mates = shard_mates("lru.test", 2);
+    check(mates.size() == 2, "names sharing a shard");
+
+    if (mates.size() == 2)
+    {
+        DnsSettings settings;
+        settings.cache_size = 2 * 16;
+        cache.configure(settings);
+        cache.clear();
+
+        cache.insert("lru.test", DnsType::A, make_answer(DnsStatus::Ok, 60, "10.0.0.1"));
+        cache.insert(mates[0], DnsType::A, make_answer(DnsStatus::Ok, 60, "10.0.0.2"));
+        check(cached("lru.test"), "cache hit");
+
+        uint64_t evictions = cache.stats().evictions;
+        cache.insert(mates[1], DnsType::A, make_answer(DnsStatus::Ok, 60, "10.0.0.3"));
+
+        check(!cached(mates[0]), "least recently used evicted");
+        check(cached("lru.test") && cached(mates[1]), "recently used kept");
+        check(cache.stats().evictions - evictions == 1, "eviction counted");
+    }
+
+    DnsSettings settings;
+    settings.cache_min_ttl = 1;
+    settings.cache_max_ttl = 60;
+    settings.cache_negative_ttl = 30;
+    settings.cache_failure_ttl = 1;
+    cache.configure(settings);
+    cache.clear();
+
+    DnsAnswer answer;
+
+    // TTLs are clamped, names are case-insensitive
+    cache.insert("Long.Test.", DnsType::A, make_answer(DnsStatus::Ok, 100000, "10.0.0.4"));
+    check(cached("long.test", &answer) && answer.ttl <= 60 && answer.ttl >= 59, "TTL clamped to max");
+    check(!DnsCache::shared().lookup("long.test", DnsType::AAAA, &answer), "types cached apart");
+
+    cache.insert("missing.test", DnsType::A, make_answer(DnsStatus::NotFound, 0));
+    check(cached("missing.test", &answer) && answer.status == DnsStatus::NotFound
+        && answer.ttl >= 29, "negative answer cached");
+
+    cache.insert("error.test", DnsType::A, make_answer(DnsStatus::Error, 60));
+    check(!cached("error.test"), "errors aren't cached");
+
+    // a failed refresh keeps the good answer
+    cache.insert("good.test", DnsType::A, make_answer(DnsStatus::Ok, 30, "10.0.0.5"));
+    cache.insert("good.test", DnsType::A, make_answer(DnsStatus::ServerFailure, 0));
+    check(cached("good.test", &answer) && answer.status == DnsStatus::Ok, "failure doesn't replace answer");
+
+    // both expire after a second
+    cache.insert("short.test", DnsType::A, make_answer(DnsStatus::Ok, 0, "10.0.0.6"));
+    cache.insert("failing.test", DnsType::A, make_answer(DnsStatus::Timeout, 0));
+    check(cached("short.test") && cached("failing.test", &answer)
+        && answer.status == DnsStatus::Timeout, "short answers cached");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+
+    check(!cached("short.test"), "answer expired");
+    check(!cached("failing.test"), "failure expired");
+    check(cached("long.test"), "longer answer kept");
+
+    cache.configure(DnsSettings());
+    cache.clear();
+}
+
+// answer of `name`, runs (and stops) the resolver's loop
+static DnsAnswer resolve_on_loop(Resolver* resolver, EventLoop* loop, const std::string& name)
+{
+    DnsAnswer result;
+    result.status = DnsStatus::Timeout;
+
+    uint64_t timeout = loop->add_timer(2000, [loop]() -> void {
+        loop->stop();
+    });
+
+    uint64_t id = resolver->resolve(name, DnsType::A, [&result, loop](const DnsAnswer& answer) -> void {
+        result = answer;
+        loop->stop();
+    });
+
+    if (id != 0)
+        loop->run();
+
+    loop->cancel_timer(timeout);
+    return result;
+}
+
+static void check_resolver(StubNameserver* stub)
+{
+    DnsSettings settings;
+    settings.servers.push_back(stub->address());
+    settings.timeout_ms = 200;
+    settings.retries = 0;
+    settings.cache_size = 0;
+
+    {
+        EventLoop loop;
+        Resolver resolver(&loop, &settings);
+
+        // lookups waiting for the same name still take a slot each
+        std::vector<uint64_t> ids;
+
+        for (int i = 0; i < 5000; i++)
+        {
+            uint64_t id = resolver.resolve("silent.test", DnsType::A, [](const DnsAnswer&) -> void {});
+
+            if (id == 0)
+                break;
+
+            ids.push_back(id);
+        }
+
+        check(ids.size() == 4096, "resolver caps queries in flight");
+
+        for (uint64_t id : ids)
+        {
+            resolver.cancel(id);
+        }
+
+        DnsAnswer answer = resolve_on_loop(&resolver, &loop, "a.test");
+        check(answer.status == DnsStatus::Ok && answer.addrs.size() == 1
+            && answer.addrs[0].s_addr == inet_addr("10.1.2.3"), "resolver answers after the cap");
+    }
+
+    // getaddrinfo() on a helper thread, the loop keeps running
+    settings.servers.clear();
+
+    {
+        EventLoop loop;
+        Resolver resolver(&loop, &settings);
+
+        DnsAnswer answer = resolve_on_loop(&resolver, &loop, "localhost");
+        check(answer.status == DnsStatus::Ok && !answer.addrs.empty()
+            && answer.addrs[0].s_addr == htonl(INADDR_LOOPBACK), "resolver without upstreams");
+    }
+}
+
+static void check_router(StubNameserver* stub, RunMode mode, uint16_t backend_port)
+{
+    in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+
+    S5Settings settings;
+    settings.run_mode = mode;
+    settings.workers = 1;
+    settings.dns.servers.push_back(stub->address());
+    settings.dns.timeout_ms = 200;
+    settings.dns.retries = 0;
+
+    // answers of the previous run must not be served
+    settings.dns.cache_size = 0;
+
+    uint16_t router_port = free_port();
+    S5Router router(router_port, loopback, loopback, settings);
+    std::thread server([&router]() -> void {
+        router.run();
+    });
+
+    // threaded mode reports every failed request as 0x01
+    int unresolved = mode == RunMode::Reactor ? 4 : 1;
+
+    int before = stub->queries();
+    int sock;
+
+    check(socks5_connect(router_port, "route.test", backend_port, &sock) == 0, "CONNECT resolved name");
+    ::close(sock);
+
+    check(socks5_connect(router_port, "missing.test", backend_port, &sock) == unresolved, "CONNECT nxdomain fails");
+    ::close(sock);
+
+    check(socks5_connect(router_port, "silent.test", backend_port, &sock) == unresolved, "CONNECT timeout fails");
+    ::close(sock);
+
+    check(stub->queries() - before == 3, "CONNECT names queried");
+
+    check(socks5_connect(router_port, "127.0.0.1", backend_port, &sock) == 0, "CONNECT literal name");
+    ::close(sock);
+    check(stub->queries() - before == 3, "CONNECT literal isn't queried");
+
+    router.stop();
+    server.join();
+}
+
+int main()
+{
+    StubNameserver stub;
+
+    int backend = bind_loopback(SOCK_STREAM, 0);
+    uint16_t backend_port = local_port(backend);
+
+    std::thread backend_thread([backend]() -> void {
+        while (true)
+        {
+            int sock = accept(backend, nullptr, nullptr);
+
+            if (sock == -1)
+                return;
+
+            ::close(sock);
+        }
+    });
+
+    check_parser();
+    check_blocking(&stub);
+    check_cache();
+    check_resolver(&stub);
+
+    size_t ports = stub.source_ports();
+    check_router(&stub, RunMode::Reactor, backend_port);
+    check(stub.source_ports() - ports >= 2, "reactor queries come from different ports");
+
+    check_router(&stub, RunMode::Threaded, backend_port);
+
+    ::shutdown(backend, SHUT_RDWR);
+    ::close(backend);
+    backend_thread.join();
+
+    std::cout << (failures ? "FAILED" : "OK") << std::endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,235 @@
+// A client half-closing its tunnel still gets every byte relayed
+// in both directions, whatever relay the router runs
+
+#include "s5router/s5router.hpp"
+#include "test_net.hpp"
+
+#include <iostream>
+
+using namespace s5r;
+
+static constexpr size_t STREAM_SIZE = 20 * 1024 * 1024;
+
+static char pattern_byte(size_t offset)
+{
+    return (char)((offset * 31) >> 3);
+}
+
+static bool send_pattern(int sock)
+{
+    std::vector<char> chunk(65536);
+
+    for (size_t offset = 0; offset < STREAM_SIZE; offset += chunk.size())
+    {
+        for (size_t i = 0; i < chunk.size(); i++)
+        {
+            chunk[i] = pattern_byte(offset + i);
+        }
+
+        if (!send_all(sock, chunk.data(), chunk.size()))
+            return false;
+    }
+
+    return true;
+}
+
+// reads until eof, returns bytes matching the pattern in a row
+static size_t recv_pattern(int sock)
+{
+    std::vector<char> chunk(65536);
+    size_t offset = 0;
+    bool intact = true;
+
+    while (true)
+    {
+        ssize_t received = ::recv(sock, chunk.data(), chunk.size(), 0);
+
+        if (received <= 0)
+            break;
+
+        for (ssize_t i = 0; i < received && intact; i++)
+        {
+            intact = chunk[i] == pattern_byte(offset + i);
+        }
+
+        if (!intact)
+            break;
+
+        offset += received;
+    }
+
+    return offset;
+}
+
+// 'E': the stream is echoed until the client half-closes,
+// 'D': client half-closes and downloads the stream
+static void serve_backend(int sock)
+{
+    char command;
+
+    if (!recv_all(sock, &command, 1))
+    {
+        ::close(sock);
+        return;
+    }
+
+    if (command == 'E')
+    {
+        std::vector<char> chunk(65536);
+
+        while (true)
+        {
+            ssize_t received = ::recv(sock, chunk.data(), chunk.size(), 0);
+
+            if (received <= 0 || !send_all(sock, chunk.data(), received))
+                break;
+        }
+    }
+    else if (command == 'D')
+    {
+        char byte;
+
+        // wait for the half-close
+        while (::recv(sock, &byte, 1, 0) > 0);
+
+        send_pattern(sock);
+    }
+
+    ::close(sock);
+}
+
+static bool check_echo(uint16_t router_port, uint16_t backend_port)
+{
+    int sock;
+
+    if (socks5_connect(router_port, "", backend_port, &sock) != 0 || !send_all(sock, "E", 1))
+    {
+        ::close(sock);
+        return false;
+    }
+
+    std::thread sender([sock]() -> void {
+        send_pattern(sock);
+        ::shutdown(sock, SHUT_WR);
+    });
+
+    size_t received = recv_pattern(sock);
+
+    sender.join();
+    ::close(sock);
+
+    if (received != STREAM_SIZE)
+    {
+        std::cerr << "echo: client got " << received << " of " << STREAM_SIZE << " bytes" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+static bool check_download(uint16_t router_port, uint16_t backend_port)
+{
+    int sock;
+
+    if (socks5_connect(router_port, "", backend_port, &sock) != 0)
+    {
+        ::close(sock);
+        return false;
+    }
+
+    size_t received = 0;
+
+    if (send_all(sock, "D", 1) && ::shutdown(sock, SHUT_WR) == 0)
+    {
+        // the backend is done and gone while most of the stream
+        // still waits in the router and the socket buffers
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        received = recv_pattern(sock);
+    }
+
+    ::close(sock);
+
+    if (received != STREAM_SIZE)
+    {
+        std::cerr << "download: client got " << received << " of " << STREAM_SIZE << " bytes" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+static bool check_mode(const char* name, const S5Settings& settings, uint16_t router_port, uint16_t backend_port)
+{
+    in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+
+    S5Router router(router_port, loopback, loopback, settings);
+    std::thread server([&router]() -> void {
+        router.run();
+    });
+
+    bool ok = check_echo(router_port, backend_port)
+        && check_download(router_port, backend_port);
+
+    router.stop();
+    server.join();
+
+    std::cout << name << ": " << (ok ? "OK" : "FAILED") << std::endl;
+    return ok;
+}
+
+int main()
+{
+    int backend = bind_loopback(SOCK_STREAM, 0);
+
+    if (backend == -1)
+    {
+        std::cerr << "backend listen failed" << std::endl;
+        return 1;
+    }
+
+    uint16_t backend_port = local_port(backend);
+
+    std::thread backend_thread([backend]() -> void {
+        while (true)
+        {
+            int sock = accept(backend, nullptr, nullptr);
+
+            if (sock == -1)
+                return;
+
+            std::thread(serve_backend, sock).detach();
+        }
+    });
+
+    // reused by each mode
+    uint16_t router_port = free_port();
+
+    bool ok = true;
+
+    S5Settings settings;
+    settings.run_mode = RunMode::Reactor;
+    settings.workers = 2;
+    ok &= check_mode("reactor copy", settings, router_port, backend_port);
+
+    settings.tcp_relay = RelayMode::Splice;
+    ok &= check_mode("reactor splice", settings, router_port, backend_port);
+
+    settings.tcp_relay = RelayMode::Copy;
+    settings.relay_buffer_min = 65536;
+    settings.relay_buffer_max = 65536;
+    ok &= check_mode("reactor fixed buffers", settings, router_port, backend_port);
+
+    settings = S5Settings();
+    settings.run_mode = RunMode::Threaded;
+    ok &= check_mode("threaded copy", settings, router_port, backend_port);
+
+    settings.tcp_relay = RelayMode::Splice;
+    ok &= check_mode("threaded splice", settings, router_port, backend_port);
+
+    ::shutdown(backend, SHUT_RDWR);
+    ::close(backend);
+    backend_thread.join();
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+// Incremental handshake parser: messages split at any byte, pipelined
+// greeting, request and early data, and what it refuses
+
+#include "s5router/socks5.hpp"
+
+#include <cstring>
+#include <iostream>
+
+using namespace s5r;
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+struct Parsed
+{
+    std::string greeting;
+    std::string request;
+    std::string early_data;
+    bool invalid = false;
+};
+
+// feeds `input` in pieces ending at `cuts`, the last one at its end
+static Parsed parse(const std::string& input, std::vector<size_t> cuts)
+{
+    S5HandshakeParser parser;
+    Parsed parsed;
+
+    cuts.push_back(input.size());
+    size_t from = 0;
+
+    for (size_t cut : cuts)
+    {
+        memcpy(parser.space(), input.data() + from, cut - from);
+        parser.received((int)(cut - from));
+        from = cut;
+
+        while (true)
+        {
+            S5HandshakeParser::Result result = parser.next();
+
+            if (result == S5HandshakeParser::Result::Greeting)
+            {
+                parsed.greeting.assign(parser.greeting(), parser.greeting_size());
+            }
+            else if (result == S5HandshakeParser::Result::Request)
+            {
+                parsed.request.assign((const char*)parser.request(), parser.request()->get_size());
+            }
+            else
+            {
+                parsed.invalid = parsed.invalid || (result == S5HandshakeParser::Result::Invalid && parsed.request.empty());
+                break;
+            }
+        }
+
+        if (!parsed.request.empty() && parser.early_data_size() > 0)
+        {
+            parsed.early_data.append(parser.early_data(), parser.early_data_size());
+            parser.consume_early_data(parser.early_data_size());
+        }
+    }
+
+    return parsed;
+}
+
+static std::string greeting()
+{
+    return std::string("\x05\x02\x00\x02", 4);
+}
+
+static std::string domain_request(const std::string& domain)
+{
+    std::string request("\x05\x01\x00\x03", 4);
+    request += (char)domain.size();
+    request += domain;
+    request += std::string("\x01\xBB", 2);
+    return request;
+}
+
+static void check_split()
+{
+    std::string request = domain_request("example.test");
+    std::string input = greeting() + request + "GET / HTTP/1.1\r\n";
+
+    // in one piece
+    Parsed parsed = parse(input, {});
+    check(parsed.greeting == greeting(), "pipelined greeting");
+    check(parsed.request == request, "pipelined request");
+    check(parsed.early_data == "GET / HTTP/1.1\r\n", "pipelined early data");
+
+    // cut in two at every byte
+    bool intact = true;
+
+    for (size_t cut = 0; cut <= input.size(); cut++)
+    {
+        parsed = parse(input, {cut});
+
+        intact = intact
+            && !parsed.invalid
+            && parsed.greeting == greeting()
+            && parsed.request == request
+            && parsed.early_data == "GET / HTTP/1.1\r\n";
+    }
+
+    check(intact, "split in two");
+
+    // a byte at a time
+    std::vector<size_t> cuts;
+
+    for (size_t cut = 1; cut < input.size(); cut++)
+    {
+        cuts.push_back(cut);
+    }
+
+    parsed = parse(input, cuts);
+    check(parsed.greeting == greeting() && parsed.request == request
+        && parsed.early_data == "GET / HTTP/1.1\r\n", "byte by byte");
+}
+
+static void check_partial()
+{
+    // nothing is complete until the last byte of a message
+    S5HandshakeParser parser;
+    std::string input = greeting() + domain_request("a.test");
+
+    for (size_t i = 0; i < input.size(); i++)
+    {
+        *parser.space() = input[i];
+        parser.received(1);
+
+        S5HandshakeParser::Result result = parser.next();
+
+        if (i == greeting().size() - 1)
+        {
+            check(result == S5HandshakeParser::Result::Greeting, "greeting on its last byte");
+        }
+        else if (i == input.size() - 1)
+        {
+            check(result == S5HandshakeParser::Result::Request, "request on its last byte");
+        }
+        else if (result != S5HandshakeParser::Result::NeedMore)
+        {
+            check(false, "partial message needs more");
+            break;
+        }
+    }
+
+    check(parser.early_data_size() == 0, "no early data");
+
+    // address sizes by type
+    std::string ipv4("\x05\x01\x00\x01\x7F\x00\x00\x01\x00\x50", 10);
+    Parsed parsed = parse(greeting() + ipv4 + "x", {});
+    check(parsed.request == ipv4 && parsed.early_data == "x", "IPv4 request");
+
+    std::string ipv6("\x05\x01\x00\x04", 4);
+    ipv6 += std::string(16, '\0') + std::string("\x00\x50", 2);
+    parsed = parse(greeting() + ipv6 + "x", {});
+    check(parsed.request == ipv6 && parsed.early_data == "x", "IPv6 request");
+}
+
+static void check_invalid()
+{
+    check(parse(std::string("\x04\x01\x00\x50", 4), {}).invalid, "SOCKS4 greeting");
+    check(parse(greeting() + std::string("\x04\x01\x00\x01", 4), {}).invalid, "request version");
+    check(parse(greeting() + std::string("\x05\x01\x00\x09\x00", 5), {}).invalid, "address type");
+
+    // a lone version byte isn't enough to tell
+    check(!parse(std::string("\x05", 1), {}).invalid, "greeting start");
+}
+
+int main()
+{
+    check_split();
+    check_partial();
+    check_invalid();
+
+    std::cout << (failures ? "FAILED" : "OK") << std::endl;
+    return failures ? 1 : 0;
+}
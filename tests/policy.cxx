@@ -0,0 +1,421 @@
+// Policy rules: names decided before they're resolved, resolved
+// addresses matched one by one and UDP datagrams checked as well
+
+#include "s5router/policy.hpp"
+#include "s5router/s5router.hpp"
+#include "stub_nameserver.hpp"
+#include "test_net.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+using namespace s5r;
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static PolicyRule make_rule(const char* domain, const char* destination, uint8_t length, PolicyAction action)
+{
+    PolicyRule rule;
+    rule.domain = domain;
+    rule.action = action;
+
+    if (destination)
+    {
+        inet_pton(AF_INET, destination, &rule.destination);
+        rule.destination_length = length;
+    }
+
+    return rule;
+}
+
+static in_addr address(const char* text)
+{
+    in_addr addr;
+    inet_pton(AF_INET, text, &addr);
+    return addr;
+}
+
+static void check_match_name()
+{
+    const PolicyRule* rule;
+
+    PolicyTable names;
+    names.add(make_rule("a.example", nullptr, 0, PolicyAction::Reject));
+
+    PolicyRule clients = make_rule("", nullptr, 0, PolicyAction::Direct);
+    clients.source = address("192.168.0.0");
+    clients.source_length = 16;
+    names.add(clients);
+
+    PolicyRule smtp = make_rule("", nullptr, 0, PolicyAction::Reject);
+    smtp.ports.first = 25;
+    smtp.ports.last = 25;
+    names.add(smtp);
+
+    names.index();
+
+    check(names.match_name(address("10.0.0.1"), 80, "x.A.example", &rule) && rule
+        && rule->action == PolicyAction::Reject && rule->domain == "a.example", "subdomain decided");
+    check(names.match_name(address("192.168.1.1"), 25, "c.example", &rule) && rule
+        && rule->action == PolicyAction::Direct, "source rule decided");
+    check(names.match_name(address("10.0.0.1"), 25, "c.example", &rule) && rule
+        && rule->action == PolicyAction::Reject, "port rule decided");
+    check(names.match_name(address("10.0.0.1"), 80, "c.example", &rule) && !rule, "unmatched decided");
+
+    PolicyTable networks;
+    networks.add(make_rule("d.example", "10.0.0.0", 8, PolicyAction::Reject));
+    networks.add(make_rule("d.example", nullptr, 0, PolicyAction::Direct));
+    networks.add(make_rule("", "172.16.0.0", 12, PolicyAction::Reject));
+    networks.add(make_rule("e.example", nullptr, 0, PolicyAction::Direct));
+    networks.index();
+
+    check(!networks.match_name(address("10.0.0.1"), 80, "d.example", &rule), "domain network rule waits");
+    check(!networks.match_name(address("10.0.0.1"), 80, "e.example", &rule), "earlier network rule waits");
+
+    check(networks.match(address("10.0.0.1"), address("10.1.1.1"), 80, nullptr) == nullptr, "domain rule needs a name");
+
+    std::string name = "d.example";
+    rule = networks.match(address("10.0.0.1"), address("10.1.1.1"), 80, &name);
+    check(rule && rule->action == PolicyAction::Reject, "domain network rule");
+}
+
+// rules file with `content`, empty path if it couldn't be written
+static std::string write_rules(const std::string& content)
+{
+    char path[] = "/tmp/s5r_policy_XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd == -1)
+        return "";
+
+    bool written = write(fd, content.data(), content.size()) == (ssize_t)content.size();
+    ::close(fd);
+
+    if (!written)
+    {
+        unlink(path);
+        return "";
+    }
+
+    return path;
+}
+
+static bool load_rule(const std::string& line)
+{
+    std::string path = write_rules(line + "\n");
+
+    PolicyTable table;
+    bool loaded = !path.empty() && table.load(path.c_str(), {});
+
+    unlink(path.c_str());
+    return loaded;
+}
+
+static void check_parser()
+{
+    check(load_rule("port 443 reject"), "port");
+    check(load_rule("port 80-90 reject"), "port range");
+    check(load_rule("dst 10.0.0.0/8 reject"), "network");
+
+    check(!load_rule("port 443abc reject"), "port with trailing garbage");
+    check(!load_rule("port 80-90x reject"), "port range with trailing garbage");
+    check(!load_rule("port -80 reject"), "port without first");
+    check(!load_rule("port 80- reject"), "port range without last");
+    check(!load_rule("port 65536 reject"), "port out of range");
+    check(!load_rule("dst 10.0.0.0/8x reject"), "network with trailing garbage");
+    check(!load_rule("dst 10.0.0.0/ reject"), "network without length");
+    check(!load_rule("dst 10.0.0.0/33 reject"), "network too long");
+}
+
+static std::string random_label(std::mt19937* random)
+{
+    std::string label;
+    uint32_t value = (*random)();
+
+    for (int i = 0; i < 6; i++)
+    {
+        label.push_back("abcdefghijklmnopqrstuvwxyz0123456789"[value % 36]);
+        value /= 36;
+    }
+
+    return label;
+}
+
+// half a million random networks and as many random domains,
+// lookups have to stay well under a microsecond (Release builds)
+static void check_scale()
+{
+    constexpr size_t RULES = 1000000;
+    constexpr size_t LOOKUPS = 1000000;
+
+    std::mt19937 random(580);
+    std::vector<std::string> domains;
+
+    PolicyTable table;
+
+    for (size_t i = 0; i < RULES; i++)
+    {
+        PolicyRule rule;
+        rule.action = i % 3 == 0 ? PolicyAction::Reject : PolicyAction::Direct;
+
+        if (i % 2 == 0)
+        {
+            rule.destination_length = (uint8_t)(8 + random() % 25);
+            rule.destination.s_addr = htonl(random() & (~0u << (32 - rule.destination_length)));
+        }
+        else
+        {
+            rule.domain = random_label(&random) + "." + random_label(&random);
+            domains.push_back(rule.domain);
+        }
+
+        if (i % 5 == 0)
+        {
+            rule.ports.first = (uint16_t)(1 + random() % 1024);
+            rule.ports.last = rule.ports.first;
+        }
+
+        table.add(rule);
+    }
+
+    auto indexed = std::chrono::steady_clock::now();
+    table.index();
+
+    double index_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - indexed).count();
+
+    // half of the names are rule domains or their subdomains
+    std::vector<in_addr> addresses;
+    std::vector<std::string> names;
+
+    for (size_t i = 0; i < LOOKUPS; i++)
+    {
+        in_addr addr;
+        addr.s_addr = htonl(random());
+        addresses.push_back(addr);
+
+        if (i % 2 == 0)
+            names.push_back(random_label(&random) + "." + domains[random() % domains.size()]);
+        else
+            names.push_back(random_label(&random) + "." + random_label(&random) + ".test");
+    }
+
+    in_addr source = address("192.168.1.1");
+    size_t matched = 0;
+
+    auto started = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < LOOKUPS; i++)
+    {
+        matched += table.match(source, addresses[i], 443, &names[i]) != nullptr;
+    }
+
+    double match_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count() / LOOKUPS;
+
+    started = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < LOOKUPS; i++)
+    {
+        const PolicyRule* rule;
+        matched += table.match_name(source, 443, names[i], &rule) && rule;
+    }
+
+    double name_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count() / LOOKUPS;
+
+    std::cout << RULES << " rules indexed in " << index_ms << "ms, match " << match_ns
+        << "ns, match_name " << name_ns << "ns (" << matched << " matched)" << std::endl;
+
+    // unoptimized builds only report
+#ifdef NDEBUG
+    check(match_ns < 1000, "match under a microsecond");
+    check(name_ns < 1000, "match_name under a microsecond");
+#endif
+}
+
+// sends the address the client reached it on
+static void serve_backend(int backend)
+{
+    while (true)
+    {
+        int sock = accept(backend, nullptr, nullptr);
+
+        if (sock == -1)
+            return;
+
+        sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        getsockname(sock, (sockaddr*)&addr, &addr_len);
+
+        send_all(sock, (const char*)&addr.sin_addr, sizeof(addr.sin_addr));
+        ::close(sock);
+    }
+}
+
+// echoes datagrams back to where they came from
+static void serve_udp_echo(int sock)
+{
+    char buffer[2048];
+
+    while (true)
+    {
+        sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        ssize_t size = recvfrom(sock, buffer, sizeof(buffer), 0, (sockaddr*)&addr, &addr_len);
+
+        if (size <= 0)
+            return;
+
+        sendto(sock, buffer, size, 0, (sockaddr*)&addr, addr_len);
+    }
+}
+
+static void check_udp(StubNameserver* stub, uint16_t router_port, uint16_t echo_port)
+{
+    int control;
+    sockaddr_in relay = socks5_associate(router_port, &control);
+    check(relay.sin_port != 0, "UDP associated");
+
+    int client = socket(AF_INET, SOCK_DGRAM, 0);
+    set_recv_timeout(client, 1000);
+
+    int before = stub->queries();
+
+    for (auto& datagram : {
+        socks5_datagram("blocked.test", echo_port, "blocked"),
+        socks5_datagram("127.0.0.2", echo_port, "rejected address"),
+        socks5_datagram("pair.test", echo_port, "pair")
+    })
+    {
+        sendto(client, datagram.data(), datagram.size(), 0, (sockaddr*)&relay, sizeof(relay));
+    }
+
+    // dropped datagrams would come back first
+    char reply[2048];
+    ssize_t size = recv(client, reply, sizeof(reply), 0);
+
+    check(size == 10 + 4 && std::string(reply + 10, 4) == "pair", "UDP to rejected destinations dropped");
+    check(size >= 10 && reply[3] == 1 && *(uint32_t*)(reply + 4) == htonl(INADDR_LOOPBACK), "UDP to the allowed address");
+    check(stub->queries() == before + 1, "UDP to a rejected name isn't resolved");
+
+    ::close(client);
+    ::close(control);
+}
+
+static void check_router(StubNameserver* stub, RunMode mode, const std::string& rules, uint16_t backend_port, uint16_t echo_port)
+{
+    in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+
+    S5Settings settings;
+    settings.run_mode = mode;
+    settings.workers = 1;
+    settings.rules_file = rules;
+    settings.dns.servers.push_back(stub->address());
+    settings.dns.timeout_ms = 200;
+    settings.dns.retries = 0;
+    settings.dns.cache_size = 0;
+
+    uint16_t router_port = free_port();
+    S5Router router(router_port, loopback, loopback, settings);
+    std::thread server([&router]() -> void {
+        router.run();
+    });
+
+    int before = stub->queries();
+    int sock;
+
+    check(socks5_connect(router_port, "blocked.test", backend_port, &sock) == 2, "rejected name");
+    ::close(sock);
+    check(stub->queries() == before, "rejected name isn't resolved");
+
+    check(socks5_connect(router_port, "route.test", 7, &sock) == 2, "name rule after a network rule");
+    ::close(sock);
+    check(stub->queries() == before + 1, "name after a network rule is resolved");
+
+    in_addr reached = {};
+
+    check(socks5_connect(router_port, "pair.test", backend_port, &sock) == 0
+        && recv_all(sock, (char*)&reached, sizeof(reached)), "allowed address of a name");
+    ::close(sock);
+    check(reached.s_addr == htonl(INADDR_LOOPBACK), "rejected address isn't connected");
+
+    check(socks5_connect(router_port, "pair.test", 9, &sock) == 2, "every address rejected");
+    ::close(sock);
+
+    check_udp(stub, router_port, echo_port);
+
+    router.stop();
+    server.join();
+}
+
+int main()
+{
+    check_match_name();
+    check_parser();
+    check_scale();
+
+    std::string rules = write_rules(
+        "domain blocked.test reject\n"
+        "dst 127.0.0.2 reject\n"
+        "domain route.test port 7 reject\n"
+        "dst 127.0.0.0/8 port 9 reject\n"
+    );
+
+    if (rules.empty())
+    {
+        std::cerr << "couldn't write rules" << std::endl;
+        return 1;
+    }
+
+    // reachable on 127.0.0.2 as well
+    int backend = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in any = loopback_address(0);
+    any.sin_addr.s_addr = INADDR_ANY;
+
+    if (::bind(backend, (sockaddr*)&any, sizeof(any)) == -1 || listen(backend, 16) == -1)
+    {
+        std::cerr << "backend listen failed" << std::endl;
+        return 1;
+    }
+
+    std::thread backend_thread(serve_backend, backend);
+
+    int echo = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (::bind(echo, (sockaddr*)&any, sizeof(any)) == -1)
+    {
+        std::cerr << "UDP echo bind failed" << std::endl;
+        return 1;
+    }
+
+    std::thread echo_thread(serve_udp_echo, echo);
+
+    StubNameserver stub;
+
+    check_router(&stub, RunMode::Reactor, rules, local_port(backend), local_port(echo));
+    check_router(&stub, RunMode::Threaded, rules, local_port(backend), local_port(echo));
+
+    ::shutdown(backend, SHUT_RDWR);
+    ::close(backend);
+    backend_thread.join();
+
+    ::shutdown(echo, SHUT_RDWR);
+    echo_thread.join();
+    ::close(echo);
+
+    unlink(rules.c_str());
+
+    std::cout << (failures ? "FAILED" : "OK") << std::endl;
+    return failures ? 1 : 0;
+}
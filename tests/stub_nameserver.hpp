@@ -0,0 +1,156 @@
+#pragma once
+
+// UDP nameserver on 127.0.0.1 answering the tests' names
+
+#include "test_net.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Answers A queries by name:
+ *   a.test        10.1.2.3
+ *   route.test    127.0.0.1
+ *   pair.test     127.0.0.2, 127.0.0.1
+ *   missing.test  NXDOMAIN
+ *   big.test      truncated, no records
+ *   anything else never gets an answer
+ **/
+class StubNameserver
+{
+public:
+    StubNameserver()
+    {
+        _sock = bind_loopback(SOCK_DGRAM, 0);
+        _thread = std::thread(&StubNameserver::_run, this);
+    }
+
+    ~StubNameserver()
+    {
+        ::shutdown(_sock, SHUT_RDWR);
+        _thread.join();
+        ::close(_sock);
+    }
+
+    sockaddr_in address() const
+    {
+        return loopback_address(local_port(_sock));
+    }
+
+    int queries() const
+    {
+        return _queries;
+    }
+
+    // distinct ports queries came from
+    size_t source_ports()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _ports.size();
+    }
+
+private:
+    int _sock;
+    std::thread _thread;
+    std::atomic<int> _queries{0};
+
+    std::mutex _mutex;
+    std::set<uint16_t> _ports;
+
+private:
+    static void _add_record(std::vector<char>* response, const char* address)
+    {
+        // name points at the question, A, IN, ttl 60, 4 bytes
+        const char record[] = {(char)0xC0, 12, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4};
+        response->insert(response->end(), record, record + sizeof(record));
+
+        in_addr addr;
+        inet_pton(AF_INET, address, &addr);
+        response->insert(response->end(), (char*)&addr, (char*)&addr + 4);
+
+        (*response)[7]++;
+    }
+
+    void _run()
+    {
+        while (true)
+        {
+            char query[512];
+            sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+
+            int size = (int)::recvfrom(_sock, query, sizeof(query), 0, (sockaddr*)&from, &from_len);
+
+            if (size <= 0)
+                return;
+
+            // header, name labels, type and class
+            std::string name;
+            int offset = 12;
+
+            while (offset < size && query[offset] != 0)
+            {
+                int len = (uint8_t)query[offset];
+
+                if (!name.empty())
+                    name.push_back('.');
+
+                name.append(query + offset + 1, len);
+                offset += 1 + len;
+            }
+
+            int question_end = offset + 5;
+
+            if (question_end > size)
+                continue;
+
+            _queries++;
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _ports.insert(ntohs(from.sin_port));
+            }
+
+            std::vector<char> response(query, query + question_end);
+
+            // response, recursion desired and available
+            response[2] = (char)0x81;
+            response[3] = (char)0x80;
+
+            // no answer, authority or additional records yet
+            memset(response.data() + 6, 0, 6);
+
+            if (name == "a.test")
+            {
+                _add_record(&response, "10.1.2.3");
+            }
+            else if (name == "route.test")
+            {
+                _add_record(&response, "127.0.0.1");
+            }
+            else if (name == "pair.test")
+            {
+                _add_record(&response, "127.0.0.2");
+                _add_record(&response, "127.0.0.1");
+            }
+            else if (name == "missing.test")
+            {
+                response[3] |= 3;
+            }
+            else if (name == "big.test")
+            {
+                response[2] |= 0x02;
+            }
+            else
+            {
+                continue;
+            }
+
+            ::sendto(_sock, response.data(), response.size(), 0, (sockaddr*)&from, from_len);
+        }
+    }
+};
@@ -0,0 +1,210 @@
+#pragma once
+
+// Blocking socket helpers shared by the tests
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+inline bool send_all(int sock, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent = ::send(sock, data, size, MSG_NOSIGNAL);
+
+        if (sent <= 0)
+            return false;
+
+        data += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+inline bool recv_all(int sock, char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t received = ::recv(sock, data, size, 0);
+
+        if (received <= 0)
+            return false;
+
+        data += received;
+        size -= received;
+    }
+
+    return true;
+}
+
+inline sockaddr_in loopback_address(uint16_t port)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+// bound to 127.0.0.1, `port` 0 picks a free one
+inline int bind_loopback(int type, uint16_t port)
+{
+    int sock = socket(AF_INET, type, 0);
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in addr = loopback_address(port);
+
+    if (::bind(sock, (sockaddr*)&addr, sizeof(addr)) == -1
+        || (type == SOCK_STREAM && listen(sock, 16) == -1))
+    {
+        ::close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+inline uint16_t local_port(int sock)
+{
+    sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    getsockname(sock, (sockaddr*)&addr, &addr_len);
+    return ntohs(addr.sin_port);
+}
+
+// a port nothing listens on right now
+inline uint16_t free_port()
+{
+    int sock = bind_loopback(SOCK_STREAM, 0);
+    uint16_t port = local_port(sock);
+    ::close(sock);
+    return port;
+}
+
+inline void set_recv_timeout(int sock, int timeout_ms)
+{
+    timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// SOCKS5 address of `port` at `host` (DOMAINNAME) or at 127.0.0.1 if it's empty
+inline void append_socks5_address(std::vector<char>* message, const std::string& host, uint16_t port)
+{
+    if (host.empty())
+    {
+        message->insert(message->end(), {1, 127, 0, 0, 1});
+    }
+    else
+    {
+        message->push_back(3);
+        message->push_back((char)host.size());
+        message->insert(message->end(), host.begin(), host.end());
+    }
+
+    uint16_t net_port = htons(port);
+    message->insert(message->end(), (char*)&net_port, (char*)&net_port + 2);
+}
+
+// connects to the router at `router_port`, waiting for it to come up
+inline int connect_router(uint16_t router_port)
+{
+    sockaddr_in addr = loopback_address(router_port);
+
+    for (int attempt = 0; attempt < 50; attempt++)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (::connect(sock, (sockaddr*)&addr, sizeof(addr)) == 0)
+            return sock;
+
+        ::close(sock);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    return -1;
+}
+
+/**
+ * CONNECTs through the router at `router_port` to `port` of `host`
+ * (a DOMAINNAME request) or of 127.0.0.1 if `host` is empty, waiting
+ * for the router to come up. Returns the reply code, -1 if there was
+ * none. The socket is left open in `*sock` either way
+ **/
+inline int socks5_connect(uint16_t router_port, const std::string& host, uint16_t port, int* sock)
+{
+    *sock = connect_router(router_port);
+
+    if (*sock == -1)
+        return -1;
+
+    // no authentication
+    std::vector<char> request = {5, 1, 0, 5, 1, 0};
+    append_socks5_address(&request, host, port);
+
+    // the reply has the size of the request
+    std::vector<char> reply(request.size() - 1);
+
+    if (!send_all(*sock, request.data(), request.size())
+        || !recv_all(*sock, reply.data(), reply.size())
+        || reply[1] != 0)
+    {
+        return -1;
+    }
+
+    return (uint8_t)reply[3];
+}
+
+/**
+ * UDP ASSOCIATEs through the router at `router_port`, the control
+ * connection is left open in `*sock`. Returns the address datagrams
+ * go to, with port 0 if the router refused
+ **/
+inline sockaddr_in socks5_associate(uint16_t router_port, int* sock)
+{
+    sockaddr_in relay;
+    memset(&relay, 0, sizeof(relay));
+    relay.sin_family = AF_INET;
+
+    *sock = connect_router(router_port);
+
+    if (*sock == -1)
+        return relay;
+
+    // from any address and port
+    const char request[] = {5, 1, 0, 5, 3, 0, 1, 0, 0, 0, 0, 0, 0};
+    char reply[2 + 10];
+
+    if (!send_all(*sock, request, sizeof(request))
+        || !recv_all(*sock, reply, sizeof(reply))
+        || reply[1] != 0 || reply[3] != 0 || reply[5] != 1)
+    {
+        return relay;
+    }
+
+    memcpy(&relay.sin_addr, reply + 6, 4);
+    memcpy(&relay.sin_port, reply + 10, 2);
+    return relay;
+}
+
+// client datagram to `port` of `host`, see append_socks5_address()
+inline std::vector<char> socks5_datagram(const std::string& host, uint16_t port, const std::string& payload, uint8_t frag = 0)
+{
+    std::vector<char> datagram = {0, 0, (char)frag};
+    append_socks5_address(&datagram, host, port);
+    datagram.insert(datagram.end(), payload.begin(), payload.end());
+    return datagram;
+}
@@ -0,0 +1,381 @@
+// Batched UDP relaying keeps datagram boundaries and order, whether
+// datagrams come one by one or coalesced by UDP_GRO, and what it
+// costs per datagram next to udp_batch=1
+
+#include "s5router/s5router.hpp"
+#include "test_net.hpp"
+
+#include <atomic>
+#include <iostream>
+
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <time.h>
+
+using namespace s5r;
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+// payload bytes depend on the sequence number and the offset
+static std::string make_payload(uint32_t sequence, size_t size)
+{
+    std::string payload(size, '\0');
+
+    for (size_t i = 0; i < size; i++)
+    {
+        payload[i] = (char)(sequence * 7 + i);
+    }
+
+    memcpy(&payload[0], &sequence, std::min(size, sizeof(sequence)));
+    return payload;
+}
+
+// one send of `data` cut into `segment` sized datagrams by the kernel
+static bool send_segments(int sock, const sockaddr_in& addr, const std::string& data, uint16_t segment)
+{
+    iovec iov;
+    iov.iov_base = (void*)data.data();
+    iov.iov_len = data.size();
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = (void*)&addr;
+    message.msg_namelen = sizeof(addr);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_UDP;
+    header->cmsg_type = UDP_SEGMENT;
+    header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(header), &segment, sizeof(segment));
+
+    return sendmsg(sock, &message, 0) == (ssize_t)data.size();
+}
+
+// `count` payloads of `size` bytes behind `header`, the last one `last` bytes
+static std::string make_burst(uint32_t count, size_t size, size_t last, const std::vector<char>& header)
+{
+    std::string burst;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        burst.append(header.begin(), header.end());
+        burst += make_payload(i, i + 1 == count ? last : size);
+    }
+
+    return burst;
+}
+
+struct Backend
+{
+    int sock;
+    std::thread thread;
+
+    // datagrams counted in sink mode
+    std::atomic<uint64_t> received{0};
+    std::atomic<bool> sink{false};
+
+    // "burst" datagrams are answered with one segmented send,
+    // anything else is echoed unless sinking
+    void serve()
+    {
+        std::vector<char> buffer(65536);
+
+        while (true)
+        {
+            sockaddr_in addr;
+            socklen_t addr_len = sizeof(addr);
+            ssize_t size = recvfrom(sock, buffer.data(), buffer.size(), 0, (sockaddr*)&addr, &addr_len);
+
+            if (size <= 0)
+                return;
+
+            received++;
+
+            if (sink)
+                continue;
+
+            if (std::string(buffer.data(), size) == "burst")
+            {
+                send_segments(sock, addr, make_burst(20, 200, 120, {}), 200);
+                continue;
+            }
+
+            sendto(sock, buffer.data(), size, 0, (sockaddr*)&addr, addr_len);
+        }
+    }
+};
+
+// next datagram relayed back from `port` of 127.0.0.1, its payload
+// in `*payload`, false if none came or the header is wrong
+static bool recv_reply(int sock, uint16_t port, std::string* payload)
+{
+    char buffer[65536];
+    ssize_t size = recv(sock, buffer, sizeof(buffer), 0);
+
+    std::vector<char> header = socks5_datagram("", port, "");
+
+    if (size < (ssize_t)header.size() || memcmp(buffer, header.data(), header.size()) != 0)
+        return false;
+
+    payload->assign(buffer + header.size(), size - header.size());
+    return true;
+}
+
+static void check_order(const char* name, int client, const sockaddr_in& relay, uint16_t port)
+{
+    constexpr uint32_t COUNT = 200;
+
+    // queued for the router to read at once, more would
+    // overflow its receive buffer before it gets to run
+    constexpr uint32_t BURST = 32;
+
+    uint32_t intact = 0;
+    bool failed = false;
+
+    for (uint32_t sent = 0; sent < COUNT && !failed; )
+    {
+        for (uint32_t end = std::min(sent + BURST, COUNT); sent < end; sent++)
+        {
+            std::vector<char> datagram = socks5_datagram("", port, make_payload(sent, 100 + (sent % 50) * 7));
+            sendto(client, datagram.data(), datagram.size(), 0, (sockaddr*)&relay, sizeof(relay));
+        }
+
+        std::string payload;
+
+        while (intact < sent && !failed)
+        {
+            failed = !recv_reply(client, port, &payload)
+                || payload != make_payload(intact, 100 + (intact % 50) * 7);
+
+            if (!failed)
+                intact++;
+        }
+    }
+
+    if (intact != COUNT)
+        std::cerr << name << ": " << intact << " of " << COUNT << " datagrams in order" << std::endl;
+
+    check(intact == COUNT, "datagrams keep boundaries and order");
+}
+
+// a client datagram the kernel hands over coalesced (UDP_GRO)
+static void check_client_segments(const char* name, int client, const sockaddr_in& relay, uint16_t port)
+{
+    std::vector<char> header = socks5_datagram("", port, "");
+    send_segments(client, relay, make_burst(20, 100, 60, header), (uint16_t)(header.size() + 100));
+
+    uint32_t intact = 0;
+    std::string payload;
+
+    while (intact < 20 && recv_reply(client, port, &payload)
+        && payload == make_payload(intact, intact == 19 ? 60 : 100))
+    {
+        intact++;
+    }
+
+    if (intact != 20)
+        std::cerr << name << ": " << intact << " of 20 client segments" << std::endl;
+
+    check(intact == 20, "client segments split");
+}
+
+// a route datagram the kernel hands over coalesced (UDP_GRO)
+static void check_route_segments(const char* name, int client, const sockaddr_in& relay, uint16_t port)
+{
+    std::vector<char> datagram = socks5_datagram("", port, "burst");
+    sendto(client, datagram.data(), datagram.size(), 0, (sockaddr*)&relay, sizeof(relay));
+
+    uint32_t intact = 0;
+    std::string payload;
+
+    while (intact < 20 && recv_reply(client, port, &payload)
+        && payload == make_payload(intact, intact == 19 ? 120 : 200))
+    {
+        intact++;
+    }
+
+    if (intact != 20)
+        std::cerr << name << ": " << intact << " of 20 route segments" << std::endl;
+
+    check(intact == 20, "route segments split");
+}
+
+static double cpu_seconds(clockid_t clock)
+{
+    timespec time;
+    clock_gettime(clock, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// CPU time of the process but this thread and the backend's
+static double router_cpu_seconds(Backend* backend)
+{
+    clockid_t backend_clock;
+    pthread_getcpuclockid(backend->thread.native_handle(), &backend_clock);
+
+    return cpu_seconds(CLOCK_PROCESS_CPUTIME_ID)
+        - cpu_seconds(CLOCK_THREAD_CPUTIME_ID)
+        - cpu_seconds(backend_clock);
+}
+
+// router CPU microseconds per datagram relayed to a sink. Bursts are
+// sent once the last one arrived so nothing is lost to full buffers,
+// the client and the sink are left out as they cost the same anyway
+static double measure_cpu(int client, const sockaddr_in& relay, uint16_t port, Backend* backend)
+{
+    constexpr int BURSTS = 4000;
+    constexpr int BURST = 64;
+
+    std::vector<char> datagram = socks5_datagram("", port, make_payload(0, 64));
+
+    mmsghdr messages[BURST];
+    iovec iov;
+    iov.iov_base = datagram.data();
+    iov.iov_len = datagram.size();
+
+    for (auto& message : messages)
+    {
+        memset(&message, 0, sizeof(message));
+        message.msg_hdr.msg_name = (void*)&relay;
+        message.msg_hdr.msg_namelen = sizeof(relay);
+        message.msg_hdr.msg_iov = &iov;
+        message.msg_hdr.msg_iovlen = 1;
+    }
+
+    backend->sink = true;
+    uint64_t before = backend->received;
+    double started = router_cpu_seconds(backend);
+
+    for (int burst = 0; burst < BURSTS; burst++)
+    {
+        uint64_t expected = backend->received + BURST;
+
+        for (int sent = 0; sent < BURST; )
+        {
+            int result = sendmmsg(client, messages + sent, BURST - sent, 0);
+
+            if (result > 0)
+                sent += result;
+        }
+
+        // a lost datagram only costs this burst its wait
+        auto sent_at = std::chrono::steady_clock::now();
+
+        while (backend->received < expected
+            && std::chrono::steady_clock::now() - sent_at < std::chrono::milliseconds(100))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    double seconds = router_cpu_seconds(backend) - started;
+    backend->sink = false;
+
+    return seconds * 1e6 / (backend->received - before);
+}
+
+static double check_mode(const char* name, const S5Settings& settings, Backend* backend)
+{
+    in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+
+    uint16_t router_port = free_port();
+    S5Router router(router_port, loopback, loopback, settings);
+    std::thread server([&router]() -> void {
+        router.run();
+    });
+
+    int control;
+    sockaddr_in relay = socks5_associate(router_port, &control);
+    check(relay.sin_port != 0, "UDP associated");
+
+    int client = socket(AF_INET, SOCK_DGRAM, 0);
+    set_recv_timeout(client, 1000);
+
+    int buffer_size = 4 * 1024 * 1024;
+    setsockopt(client, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    uint16_t port = local_port(backend->sock);
+    int before = failures;
+
+    check_order(name, client, relay, port);
+    check_client_segments(name, client, relay, port);
+    check_route_segments(name, client, relay, port);
+
+    double cpu = measure_cpu(client, relay, port, backend);
+
+    std::cout << name << ": " << (failures == before ? "OK" : "FAILED")
+        << ", " << cpu << "us of router CPU per datagram" << std::endl;
+
+    ::close(client);
+    ::close(control);
+
+    router.stop();
+    server.join();
+
+    return cpu;
+}
+
+int main()
+{
+    Backend backend;
+    backend.sock = bind_loopback(SOCK_DGRAM, 0);
+
+    if (backend.sock == -1)
+    {
+        std::cerr << "backend bind failed" << std::endl;
+        return 1;
+    }
+
+    int buffer_size = 4 * 1024 * 1024;
+    setsockopt(backend.sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    backend.thread = std::thread(&Backend::serve, &backend);
+
+    S5Settings settings;
+    settings.run_mode = RunMode::Reactor;
+    settings.workers = 1;
+
+    settings.udp_batch = 1;
+    settings.udp_offload = false;
+    double single = check_mode("reactor udp_batch=1", settings, &backend);
+
+    settings.udp_batch = 16;
+    double batched = check_mode("reactor udp_batch=16", settings, &backend);
+
+    settings.udp_offload = true;
+    check_mode("reactor udp_batch=16 offload", settings, &backend);
+
+    settings.run_mode = RunMode::Threaded;
+    settings.udp_workers = 0;
+    check_mode("threaded udp_batch=16 offload", settings, &backend);
+
+    settings.udp_batch = 1;
+    settings.udp_offload = false;
+    check_mode("threaded udp_batch=1", settings, &backend);
+
+    std::cout << "udp_batch=16 takes " << (int)(100 - batched * 100 / single)
+        << "% less router CPU per datagram than udp_batch=1" << std::endl;
+
+    ::shutdown(backend.sock, SHUT_RDWR);
+    backend.thread.join();
+    ::close(backend.sock);
+
+    std::cout << (failures ? "FAILED" : "OK") << std::endl;
+    return failures ? 1 : 0;
+}
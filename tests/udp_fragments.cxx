@@ -0,0 +1,138 @@
+// UDP fragment reassembly: fragments in order, out of order, too
+// late or too large, and the datagrams that follow them
+
+#include "s5router/udp_fragments.hpp"
+
+#include <iostream>
+#include <string>
+#include <thread>
+
+using namespace s5r;
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+// FRAG of the last fragment of a datagram
+static uint8_t last(uint8_t position)
+{
+    return position | 0x80;
+}
+
+// adds a fragment, the reassembled datagram goes to `*datagram`
+static bool add(UdpFragments* fragments, uint8_t frag, const std::string& payload, std::string* datagram)
+{
+    const char* data;
+    int size;
+
+    if (!fragments->add(frag, payload.data(), (int)payload.size(), &data, &size))
+        return false;
+
+    datagram->assign(data, size);
+    return true;
+}
+
+static void check_in_order()
+{
+    UdpFragments fragments;
+    fragments.configure(1024, 1000);
+
+    UdpFragmentStats before = UdpFragments::stats();
+    std::string datagram;
+
+    check(!add(&fragments, 1, "first ", &datagram), "first fragment waits");
+    check(!add(&fragments, 2, "second ", &datagram), "second fragment waits");
+    check(add(&fragments, last(3), "third", &datagram), "last fragment completes");
+    check(datagram == "first second third", "fragments joined in order");
+
+    // the queue starts over for the next datagram
+    check(add(&fragments, last(1), "single", &datagram), "single fragment completes");
+    check(datagram == "single", "next datagram");
+
+    const char* data;
+    int size;
+    fragments.add(last(1), "held", 4, &data, &size);
+    check(fragments.holds(data) && fragments.holds(data + 2), "holds reassembled datagram");
+    check(!fragments.holds("held"), "doesn't hold other data");
+
+    check(UdpFragments::stats().reassembled - before.reassembled == 3, "reassembled counted");
+}
+
+static void check_reordered()
+{
+    UdpFragments fragments;
+    fragments.configure(1024, 1000);
+
+    UdpFragmentStats before = UdpFragments::stats();
+    std::string datagram;
+
+    // a gap abandons the queued fragments and drops itself
+    check(!add(&fragments, 1, "a", &datagram), "reordered: first");
+    check(!add(&fragments, last(3), "c", &datagram), "reordered: gap dropped");
+    check(!add(&fragments, 2, "b", &datagram), "reordered: late fragment dropped");
+    check(UdpFragments::stats().dropped - before.dropped == 3, "reordered fragments counted");
+
+    // a new first fragment starts a new datagram
+    check(!add(&fragments, 1, "x", &datagram), "restart: first");
+    check(!add(&fragments, 1, "y", &datagram), "restart: first again");
+    check(add(&fragments, last(2), "z", &datagram), "restart: completes");
+    check(datagram == "yz", "only the latest datagram");
+}
+
+static void check_expired()
+{
+    UdpFragments fragments;
+    fragments.configure(1024, 50);
+
+    UdpFragmentStats before = UdpFragments::stats();
+    std::string datagram;
+
+    add(&fragments, 1, "old ", &datagram);
+    add(&fragments, 2, "fragments", &datagram);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    check(!add(&fragments, last(3), "!", &datagram), "late fragment dropped");
+    check(UdpFragments::stats().expired - before.expired == 2, "expired fragments counted");
+
+    check(!add(&fragments, 1, "new ", &datagram), "after expiry: first");
+    check(add(&fragments, last(2), "datagram", &datagram), "after expiry: completes");
+    check(datagram == "new datagram", "after expiry: datagram");
+}
+
+static void check_oversize()
+{
+    UdpFragments fragments;
+    fragments.configure(10, 1000);
+
+    std::string datagram;
+
+    check(!add(&fragments, 1, "123456", &datagram), "oversize: first");
+    check(!add(&fragments, last(2), "789012", &datagram), "oversize: dropped");
+
+    check(add(&fragments, last(1), "1234567890", &datagram), "exactly the limit");
+    check(datagram == "1234567890", "limit datagram");
+
+    // reassembly disabled
+    UdpFragments disabled;
+    disabled.configure(0, 1000);
+    check(!add(&disabled, last(1), "x", &datagram), "disabled drops fragments");
+}
+
+int main()
+{
+    check_in_order();
+    check_reordered();
+    check_expired();
+    check_oversize();
+
+    std::cout << (failures ? "FAILED" : "OK") << std::endl;
+    return failures ? 1 : 0;
+}